@@ -0,0 +1,419 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2016 Sergey Poznyakoff
+
+   Direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   Direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+/* Built-in actions.
+
+   An action handler performs a simple operation on the file the event
+   refers to within direvent itself, without starting any process:
+
+     move DIR    - rename the file into DIR, copying it if DIR is on
+		   another file system;
+     copy DIR    - copy the file into DIR (by cloning it, if the file
+		   system supports it);
+     link DIR    - create a hard link to the file in DIR;
+     append FILE - append the full name of the file to FILE;
+     touch FILE  - update the modification time of FILE, creating it
+		   if necessary.
+
+   The descriptor of DIR or FILE is opened on first use and kept open
+   until an operation on it fails.  The file to append to is reopened
+   as well if its name no longer refers to it, e.g. after it has been
+   rotated.  The number of runs and the time they
+   took are accounted for each action type.
+
+   Copying runs synchronously within the main loop, so files larger than
+   action_copy_max bytes are not copied.  Symbolic links are never
+   followed.  The copy is written to a new temporary file in DIR, which
+   is then renamed to the final name, so that a partial copy is never
+   visible under that name. */
+
+#include "direvent.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#ifdef HAVE_LINUX_FS_H
+# include <linux/fs.h>
+#endif
+
+#ifndef O_PATH
+# define O_PATH 0
+#endif
+
+struct action_def {
+	char *name;
+	int (*run)(struct action *, int, const char *, const char *,
+		   const char *);
+	int (*open)(struct action *);
+};
+
+/* Accumulated statistics of an action type */
+struct action_stat {
+	unsigned long count;            /* Number of runs */
+	unsigned long failed;           /* Number of failed runs */
+	unsigned long long usec_total;  /* Total run time (microseconds) */
+	unsigned long long usec_max;    /* Maximum run time */
+};
+
+static struct action_stat action_stat[ACTION_TOUCH + 1];
+
+/* Maximum size of a file to copy (0 means unlimited) */
+unsigned long long action_copy_max = DEFAULT_COPY_MAX;
+
+static int
+action_open_dir(struct action *ap)
+{
+	return open(ap->arg, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+static int
+action_open_append(struct action *ap)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(ap->arg, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC
+		  | O_NOCTTY, 0666);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st)) {
+		int ec = errno;
+		close(fd);
+		errno = ec;
+		return -1;
+	}
+	ap->dev = st.st_dev;
+	ap->ino = st.st_ino;
+	return fd;
+}
+
+/* Copy the contents of the file IN to OUT.  Try to clone the file
+   first, then copy it within the kernel and finally fall back to
+   reading and writing. */
+static int
+copy_data(int in, int out)
+{
+	char buf[16384];
+	ssize_t n;
+
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0)
+		return 0;
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0)
+		;
+	if (n == 0)
+		return 0;
+	if (errno != EXDEV && errno != ENOSYS && errno != EINVAL
+	    && errno != EOPNOTSUPP)
+		return -1;
+	/* Not supported for these files: copy the rest by hand */
+#endif
+	while ((n = read(in, buf, sizeof buf)) > 0) {
+		char *p = buf;
+
+		while (n > 0) {
+			ssize_t k = write(out, p, n);
+			if (k == -1) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			p += k;
+			n -= k;
+		}
+	}
+	return n;
+}
+
+/* Create a new temporary file with mode MODE in the directory DIRFD.
+   Store its name in BUF, which is SIZE bytes long. */
+static int
+tmpfile_create(int dirfd, char *buf, size_t size, mode_t mode)
+{
+	static unsigned long serial;
+	int i, fd;
+
+	for (i = 0; i < 100; i++) {
+		snprintf(buf, size, ".direvent.%lu.%lu",
+			 (unsigned long) getpid(), serial++);
+		fd = openat(dirfd, buf,
+			    O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW
+			    | O_CLOEXEC | O_NOCTTY,
+			    mode);
+		if (fd != -1 || errno != EEXIST)
+			return fd;
+	}
+	return -1;
+}
+
+/* Copy the file NAME from the directory DIRFD into the directory of
+   AP under the same base name FILE. */
+static int
+copy_file(struct action *ap, int dirfd, const char *name, const char *file)
+{
+	int in, out, rc;
+	struct stat st;
+	char tmpname[64];
+
+	/* Don't follow symbolic links, and don't block on FIFOs */
+	in = openat(dirfd, name,
+		    O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC | O_NOCTTY);
+	if (in == -1)
+		return -1;
+	if (fstat(in, &st)) {
+		close(in);
+		return -1;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		close(in);
+		errno = EINVAL;
+		return -1;
+	}
+	if (action_copy_max
+	    && (unsigned long long) st.st_size > action_copy_max) {
+		close(in);
+		errno = EFBIG;
+		return -1;
+	}
+	out = tmpfile_create(ap->fd, tmpname, sizeof(tmpname),
+			     st.st_mode & 0777);
+	if (out == -1) {
+		close(in);
+		return -1;
+	}
+	rc = copy_data(in, out);
+	if (close(out) && rc == 0)
+		rc = -1;
+	close(in);
+	if (rc == 0)
+		rc = renameat(ap->fd, tmpname, ap->fd, file);
+	if (rc) {
+		int ec = errno;
+		unlinkat(ap->fd, tmpname, 0);
+		errno = ec;
+	}
+	return rc;
+}
+
+static int
+action_copy(struct action *ap, int dirfd, const char *name,
+	    const char *dirname, const char *file)
+{
+	return copy_file(ap, dirfd, name, file);
+}
+
+static int
+action_move(struct action *ap, int dirfd, const char *name,
+	    const char *dirname, const char *file)
+{
+	if (renameat(dirfd, name, ap->fd, file) == 0)
+		return 0;
+	if (errno != EXDEV)
+		return -1;
+	if (copy_file(ap, dirfd, name, file))
+		return -1;
+	return unlinkat(dirfd, name, 0);
+}
+
+static int
+action_link(struct action *ap, int dirfd, const char *name,
+	    const char *dirname, const char *file)
+{
+	return linkat(dirfd, name, ap->fd, file, 0);
+}
+
+static int
+action_append(struct action *ap, int dirfd, const char *name,
+	      const char *dirname, const char *file)
+{
+	size_t dlen = strlen(dirname), flen = strlen(file);
+	size_t len = dlen + flen + 2;
+	char *buf = scratch_alloc(len);
+	struct stat st;
+	ssize_t n;
+
+	/* Reopen the file if it has been renamed or removed */
+	if (stat(ap->arg, &st)
+	    || st.st_dev != ap->dev || st.st_ino != ap->ino) {
+		close(ap->fd);
+		ap->fd = action_open_append(ap);
+		if (ap->fd == -1)
+			return -1;
+	}
+
+	memcpy(buf, dirname, dlen);
+	buf[dlen] = '/';
+	memcpy(buf + dlen + 1, file, flen);
+	buf[len - 1] = '\n';
+	/* A single write to a file opened with O_APPEND keeps the lines
+	   from being interleaved with those of other writers. */
+	n = write(ap->fd, buf, len);
+	if (n == -1)
+		return -1;
+	if ((size_t) n != len) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+action_touch(struct action *ap, int dirfd, const char *name,
+	     const char *dirname, const char *file)
+{
+	int fd;
+
+	if (utimensat(AT_FDCWD, ap->arg, NULL, 0) == 0)
+		return 0;
+	if (errno != ENOENT)
+		return -1;
+	fd = open(ap->arg, O_WRONLY | O_CREAT | O_CLOEXEC | O_NOCTTY, 0666);
+	if (fd == -1)
+		return -1;
+	return close(fd);
+}
+
+static struct action_def action_tab[] = {
+	[ACTION_MOVE]   = { "move",   action_move,   action_open_dir },
+	[ACTION_COPY]   = { "copy",   action_copy,   action_open_dir },
+	[ACTION_LINK]   = { "link",   action_link,   action_open_dir },
+	[ACTION_APPEND] = { "append", action_append, action_open_append },
+	[ACTION_TOUCH]  = { "touch",  action_touch,  NULL },
+};
+
+/* Return the action type named NAME, or ACTION_NONE if there is no
+   such action. */
+enum action_type
+action_lookup(const char *name)
+{
+	int i;
+
+	for (i = ACTION_NONE + 1; i <= ACTION_TOUCH; i++)
+		if (strcmp(action_tab[i].name, name) == 0)
+			return i;
+	return ACTION_NONE;
+}
+
+static unsigned long long
+usec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int
+action_handler_run(struct watchpoint *wp, event_mask *event,
+		   const char *dirname, const char *file, void *data)
+{
+	struct action *ap = data;
+	struct action_def *def = &action_tab[ap->type];
+	struct action_stat *stat = &action_stat[ap->type];
+	unsigned long long start = usec_now(), usec;
+	int dirfd = -1;
+	const char *name = file;
+	int rc;
+
+	if (def->open && ap->fd == -1
+	    && (ap->fd = def->open(ap)) == -1) {
+		diag(LOG_ERR, _("%s: cannot open %s: %s"),
+		     def->name, ap->arg, strerror(errno));
+		rc = -1;
+	} else {
+		if (wp && strcmp(dirname, wp->dirname) == 0)
+			dirfd = watchpoint_dirfd(wp);
+		if (dirfd == -1) {
+			dirfd = AT_FDCWD;
+			name = scratch_filename(dirname, file);
+		}
+
+		rc = def->run(ap, dirfd, name, dirname, file);
+		if (rc) {
+			diag(LOG_ERR, _("%s %s/%s to %s: %s"),
+			     def->name, dirname, file, ap->arg,
+			     strerror(errno));
+			/* Reopen the destination next time: it may have
+			   been removed or replaced */
+			if (ap->fd != -1) {
+				close(ap->fd);
+				ap->fd = -1;
+			}
+		}
+	}
+
+	usec = usec_now() - start;
+	if (rc)
+		stat->failed++;
+	stat->count++;
+	stat->usec_total += usec;
+	if (usec > stat->usec_max)
+		stat->usec_max = usec;
+	debug(2, (_("%s %s/%s: %llu us"), def->name, dirname, file, usec));
+	return rc;
+}
+
+static void
+action_handler_free_data(void *ptr)
+{
+	struct action *ap = ptr;
+
+	free(ap->arg);
+	if (ap->fd != -1)
+		close(ap->fd);
+	free(ap);
+}
+
+struct handler *
+action_handler_alloc(event_mask ev_mask, filpatlist_t fpat,
+		     filpredlist_t fpred, struct action *ap)
+{
+	struct handler *hp = handler_alloc(ev_mask);
+	struct action *mem;
+
+	hp->fnames = fpat;
+	hp->fpreds = fpred;
+	filpatlist_compile(fpat);
+	hp->run = action_handler_run;
+	hp->free = action_handler_free_data;
+	mem = emalloc(sizeof(*mem));
+	*mem = *ap;
+	mem->fd = -1;
+	hp->data = mem;
+	memset(ap, 0, sizeof(*ap));
+	return hp;
+}
+
+void
+action_stats_report(void)
+{
+	int i;
+
+	for (i = ACTION_NONE + 1; i <= ACTION_TOUCH; i++) {
+		struct action_stat *stat = &action_stat[i];
+
+		if (stat->count == 0)
+			continue;
+		diag(LOG_INFO,
+		     _("action %s: %lu runs, %lu failed, "
+		       "%llu us average, %llu us max."),
+		     action_tab[i].name, stat->count, stat->failed,
+		     stat->usec_total / stat->count,
+		     stat->usec_max);
+	}
+}
@@ -18,6 +18,8 @@
 #include <grecs.h>
 #include <pwd.h>
 #include <grp.h>
+#include <ctype.h>
+#include <limits.h>
 
 static struct transtab kwpri[] = {
 	{ "emerg", LOG_EMERG },
@@ -150,7 +152,12 @@ struct eventconf {
 	struct grecs_list *pathlist;
 	event_mask ev_mask;
 	filpatlist_t fpat;
+	filpredlist_t fpred;
+	struct sampler sample;
+	struct ratelimit_conf ratelimit;
 	struct prog_handler prog_handler;
+	struct action action;
+	struct module module;
 };
 
 static struct eventconf eventconf;
@@ -159,7 +166,9 @@ static void
 eventconf_init(void)
 {
 	memset(&eventconf, 0, sizeof eventconf);
-	eventconf.prog_handler.timeout = DEFAULT_TIMEOUT;
+	eventconf.prog_handler.timeout = DEFAULT_TIMEOUT * 1000;
+	eventconf.prog_handler.batch_delay = DEFAULT_BATCH_DELAY * 1000;
+	eventconf.prog_handler.priority = PRIO_NORMAL;
 }
 
 static void
@@ -167,17 +176,47 @@ eventconf_free(void)
 {
 	grecs_list_free(eventconf.pathlist);
 	prog_handler_free(&eventconf.prog_handler);
+	free(eventconf.action.arg);
+	module_free(&eventconf.module);
 	filpatlist_destroy(&eventconf.fpat);
+	filpredlist_destroy(&eventconf.fpred);
 }
 
 void
 eventconf_flush(grecs_locus_t *loc)
 {
 	struct grecs_list_entry *ep;
-	struct handler *hp = prog_handler_alloc(eventconf.ev_mask,
-						eventconf.fpat,
-						&eventconf.prog_handler);
+	struct handler *hp;
 
+	if (eventconf.module.path) {
+		hp = module_handler_alloc(eventconf.ev_mask,
+					  eventconf.fpat,
+					  eventconf.fpred,
+					  &eventconf.module);
+		prog_handler_free(&eventconf.prog_handler);
+	} else if (eventconf.action.type != ACTION_NONE) {
+		hp = action_handler_alloc(eventconf.ev_mask,
+					  eventconf.fpat,
+					  eventconf.fpred,
+					  &eventconf.action);
+		prog_handler_free(&eventconf.prog_handler);
+	} else {
+		/* A run of the handler can stand for several events */
+		if (eventconf.sample.rate > 1 || eventconf.sample.interval
+		    || (eventconf.ratelimit.rate
+			&& eventconf.ratelimit.mode == RL_COALESCE)
+		    || eventconf.prog_handler.batch_max
+		    || (eventconf.prog_handler.flags & HF_SINGLE))
+			eventconf.prog_handler.flags |= HF_COUNT;
+		hp = prog_handler_alloc(eventconf.ev_mask,
+					eventconf.fpat,
+					eventconf.fpred,
+					&eventconf.prog_handler);
+	}
+
+	hp->sample = eventconf.sample;
+	if (eventconf.ratelimit.rate)
+		hp->ratelimit = ratelimit_create(hp, &eventconf.ratelimit);
 	for (ep = eventconf.pathlist->head; ep; ep = ep->next) {
 		struct pathent *pe = ep->data;
 		struct watchpoint *wpt;
@@ -212,13 +251,75 @@ cb_watcher(enum grecs_callback_command cmd, grecs_node_t *node,
 			grecs_error(&node->locus, 0, _("no paths configured"));
 			++err;
 		}
-		if (!eventconf.prog_handler.command) {
+		if (eventconf.action.type != ACTION_NONE
+		    || eventconf.module.path) {
+			if (eventconf.prog_handler.command
+			    || (eventconf.action.type != ACTION_NONE
+				&& eventconf.module.path)) {
+				grecs_error(&node->locus, 0,
+					    _("only one of command, action "
+					      "and module can be used"));
+				++err;
+			}
+			if (eventconf.prog_handler.uid) {
+				grecs_error(&node->locus, 0,
+					    _("user cannot be used with "
+					      "action or module"));
+				++err;
+			}
+			if (eventconf.prog_handler.priority != PRIO_NORMAL)
+				grecs_warning(&node->locus, 0,
+					      _("priority is ignored for "
+						"actions and modules"));
+		} else if (!eventconf.prog_handler.command) {
 			grecs_error(&node->locus, 0,
 				    _("no command configured"));
 			++err;
+		} else {
+			const char *msg =
+				command_check(eventconf.prog_handler.command,
+					      eventconf.prog_handler.flags
+					      & HF_SHELL);
+			if (msg) {
+				grecs_error(&node->locus, 0,
+					    _("invalid command: %s"), msg);
+				++err;
+			}
+		}
+		if ((eventconf.prog_handler.flags & (HF_COPROC|HF_STDOUT))
+		    == (HF_COPROC|HF_STDOUT)) {
+			grecs_warning(&node->locus, 0,
+				      _("stdout option is ignored for "
+					"coprocesses"));
+			eventconf.prog_handler.flags &= ~HF_STDOUT;
+		}
+		if ((eventconf.prog_handler.flags & HF_COPROC)
+		    && eventconf.prog_handler.batch_max) {
+			grecs_warning(&node->locus, 0,
+				      _("batch statement is ignored for "
+					"coprocesses"));
+			eventconf.prog_handler.batch_max = 0;
+		}
+		if ((eventconf.prog_handler.flags & HF_SINGLE)
+		    && ((eventconf.prog_handler.flags & HF_COPROC)
+			|| eventconf.prog_handler.batch_max)) {
+			grecs_warning(&node->locus, 0,
+				      _("single-flight option is ignored for "
+					"coprocesses and batches"));
+			eventconf.prog_handler.flags &= ~HF_SINGLE;
 		}
 		if (evtnullp(&eventconf.ev_mask))
 			evtsetall(&eventconf.ev_mask);
+		if (err == 0 && eventconf.module.path) {
+			const char *msg;
+
+			if (module_load(&eventconf.module, &msg)) {
+				grecs_error(&node->locus, 0,
+					    _("cannot load module %s: %s"),
+					    eventconf.module.path, msg);
+				++err;
+			}
+		}
 		if (err == 0)
 			eventconf_flush(&node->locus);
 		else
@@ -497,6 +598,10 @@ cb_option(enum grecs_callback_command cmd, grecs_node_t *node,
 			eventconf.prog_handler.flags |= HF_STDERR;
 		else if (strcmp(vp->v.string, "shell") == 0)
 			eventconf.prog_handler.flags |= HF_SHELL;
+		else if (strcmp(vp->v.string, "coprocess") == 0)
+			eventconf.prog_handler.flags |= HF_COPROC;
+		else if (strcmp(vp->v.string, "single-flight") == 0)
+			eventconf.prog_handler.flags |= HF_SINGLE;
 		else 
 			grecs_error(&vp->locus, 0, _("unrecognized option"));
 	}
@@ -591,6 +696,547 @@ cb_file_pattern(enum grecs_callback_command cmd, grecs_node_t *node,
 	return 0;
 }
 
+/* Get the string arguments of a statement.  BUF is used to return a
+   single argument. */
+static int
+get_string_args(grecs_value_t *val, grecs_locus_t *locus,
+		size_t *pc, grecs_value_t ***pv, grecs_value_t **buf)
+{
+	size_t i;
+	
+	switch (val->type) {
+	case GRECS_TYPE_STRING:
+		*buf = val;
+		*pc = 1;
+		*pv = buf;
+		break;
+
+	case GRECS_TYPE_ARRAY:
+		*pc = val->v.arg.c;
+		*pv = val->v.arg.v;
+		break;
+
+	case GRECS_TYPE_LIST:
+		grecs_error(locus, 0, _("unexpected list"));
+		return 1;
+	}
+	for (i = 0; i < *pc; i++)
+		if (assert_grecs_value_type(&(*pv)[i]->locus, (*pv)[i],
+					    GRECS_TYPE_STRING))
+			return 1;
+	return 0;
+}
+
+static int
+cb_type(enum grecs_callback_command cmd, grecs_node_t *node,
+	void *varptr, void *cb_data)
+{
+	grecs_value_t **argv, *one;
+	size_t argc, i;
+	int types = 0;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (get_string_args(node->v.value, &node->locus, &argc, &argv,
+			    &one))
+		return 1;
+	for (i = 0; i < argc; i++) {
+		int t;
+		if (filpred_type_code(argv[i]->v.string, &t)) {
+			grecs_error(&argv[i]->locus, 0,
+				    _("unrecognized file type"));
+			return 1;
+		}
+		types |= t;
+	}
+	filpred_add_type(varptr, types);
+	return 0;
+}
+
+/* Convert STR to a number, scaling it by the multiplier indicated by
+   its suffix, if any.  The suffixes and corresponding multipliers are
+   given by SUFTAB. */
+static int
+get_scaled_number(grecs_value_t *val, const char *str,
+		  struct transtab *suftab, unsigned long long *ret)
+{
+	char *p;
+	unsigned long long n;
+	int mul = 1;
+
+	errno = 0;
+	n = strtoull(str, &p, 10);
+	if (p == str || errno) {
+		grecs_error(&val->locus, 0, _("invalid number"));
+		return 1;
+	}
+	if (*p && trans_strtotok(suftab, p, &mul)) {
+		grecs_error(&val->locus, 0, _("invalid suffix"));
+		return 1;
+	}
+	if (n > (unsigned long long) -1 / mul) {
+		grecs_error(&val->locus, 0, _("number out of range"));
+		return 1;
+	}
+	*ret = n * mul;
+	return 0;
+}
+
+static struct transtab size_suffix[] = {
+	{ "k", 1024 },
+	{ "K", 1024 },
+	{ "M", 1024 * 1024 },
+	{ "G", 1024 * 1024 * 1024 },
+	{ NULL }
+};
+
+static int
+cb_size(enum grecs_callback_command cmd, grecs_node_t *node,
+	void *varptr, void *cb_data)
+{
+	grecs_value_t **argv, *one;
+	size_t argc;
+	int op = FILPRED_OP_EQ;
+	const char *str;
+	char opbuf[3];
+	size_t len;
+	unsigned long long size;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (get_string_args(node->v.value, &node->locus, &argc, &argv,
+			    &one))
+		return 1;
+	switch (argc) {
+	case 1:
+		/* Operator and number can be written together */
+		str = argv[0]->v.string;
+		len = strspn(str, "<>=!");
+		break;
+	case 2:
+		str = argv[0]->v.string;
+		len = strlen(str);
+		break;
+	default:
+		grecs_error(&argv[2]->locus, 0, _("surplus argument"));
+		return 1;
+	}
+	if (len) {
+		if (len >= sizeof(opbuf)) {
+			grecs_error(&argv[0]->locus, 0,
+				    _("invalid comparison operator"));
+			return 1;
+		}
+		memcpy(opbuf, str, len);
+		opbuf[len] = 0;
+		if (filpred_op_code(opbuf, &op)) {
+			grecs_error(&argv[0]->locus, 0,
+				    _("invalid comparison operator"));
+			return 1;
+		}
+	}
+	if (argc == 2)
+		str = argv[1]->v.string;
+	else
+		str += len;
+	if (get_scaled_number(argv[argc-1], str, size_suffix, &size))
+		return 1;
+	filpred_add_size(varptr, op, size);
+	return 0;
+}
+
+static int
+cb_owner(enum grecs_callback_command cmd, grecs_node_t *node,
+	 void *varptr, void *cb_data)
+{
+	grecs_value_t **argv, *one;
+	size_t argc, i;
+	uid_t *uidv;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (get_string_args(node->v.value, &node->locus, &argc, &argv,
+			    &one))
+		return 1;
+	uidv = ecalloc(argc, sizeof(uidv[0]));
+	for (i = 0; i < argc; i++) {
+		struct passwd *pw = getpwnam(argv[i]->v.string);
+		char *p;
+		
+		if (pw)
+			uidv[i] = pw->pw_uid;
+		else {
+			unsigned long n = strtoul(argv[i]->v.string, &p, 10);
+			if (*p) {
+				grecs_error(&argv[i]->locus, 0,
+					    _("no such user"));
+				free(uidv);
+				return 1;
+			}
+			uidv[i] = n;
+		}
+	}
+	filpred_add_owner(varptr, argc, uidv);
+	return 0;
+}
+
+static struct transtab time_suffix[] = {
+	{ "s", 1 },
+	{ "m", 60 },
+	{ "h", 60 * 60 },
+	{ "d", 24 * 60 * 60 },
+	{ "w", 7 * 24 * 60 * 60 },
+	{ NULL }
+};
+
+static int
+cb_older_than(enum grecs_callback_command cmd, grecs_node_t *node,
+	      void *varptr, void *cb_data)
+{
+	grecs_value_t *val = node->v.value;
+	unsigned long long age;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (assert_grecs_value_type(&val->locus, val, GRECS_TYPE_STRING))
+		return 1;
+	if (get_scaled_number(val, val->v.string, time_suffix, &age))
+		return 1;
+	filpred_add_older(varptr, age);
+	return 0;
+}
+
+static int
+cb_sample_interval(enum grecs_callback_command cmd, grecs_node_t *node,
+		   void *varptr, void *cb_data)
+{
+	grecs_value_t *val = node->v.value;
+	unsigned long long t;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (assert_grecs_value_type(&val->locus, val, GRECS_TYPE_STRING))
+		return 1;
+	if (get_scaled_number(val, val->v.string, time_suffix, &t))
+		return 1;
+	*(time_t*)varptr = t;
+	return 0;
+}
+
+static struct transtab msec_suffix[] = {
+	{ "ms", 1 },
+	{ "s", 1000 },
+	{ "m", 60 * 1000 },
+	{ "h", 60 * 60 * 1000 },
+	{ NULL }
+};
+
+/* Convert the time interval in VAL to milliseconds.  The value is in
+   seconds, unless followed by a suffix.  Zero is accepted only if
+   ZERO_OK is set. */
+static int
+get_msec(grecs_value_t *val, unsigned *ret, int zero_ok)
+{
+	unsigned long long t;
+	size_t len;
+
+	if (get_scaled_number(val, val->v.string, msec_suffix, &t))
+		return 1;
+	len = strlen(val->v.string);
+	if (len > 0 && isdigit(val->v.string[len-1]))
+		t *= 1000;
+	if ((t == 0 && !zero_ok) || t > UINT_MAX) {
+		grecs_error(&val->locus, 0, _("time interval out of range"));
+		return 1;
+	}
+	*ret = t;
+	return 0;
+}
+
+/* Handler timeout.  It is stored in milliseconds.  Zero disables it. */
+static int
+cb_timeout(enum grecs_callback_command cmd, grecs_node_t *node,
+	   void *varptr, void *cb_data)
+{
+	grecs_value_t *val = node->v.value;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (assert_grecs_value_type(&val->locus, val, GRECS_TYPE_STRING))
+		return 1;
+	return get_msec(val, varptr, 1);
+}
+
+/* batch COUNT [DELAY] */
+static int
+cb_batch(enum grecs_callback_command cmd, grecs_node_t *node,
+	 void *varptr, void *cb_data)
+{
+	grecs_value_t **argv, *one;
+	size_t argc;
+	unsigned long long count;
+	char *p;
+	struct prog_handler *hp = varptr;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (get_string_args(node->v.value, &node->locus, &argc, &argv,
+			    &one))
+		return 1;
+	if (argc > 2) {
+		grecs_error(&argv[2]->locus, 0, _("surplus argument"));
+		return 1;
+	}
+	errno = 0;
+	count = strtoull(argv[0]->v.string, &p, 10);
+	if (p == argv[0]->v.string || *p || errno) {
+		grecs_error(&argv[0]->locus, 0, _("invalid number"));
+		return 1;
+	}
+	if (count == 0 || count > UINT_MAX) {
+		grecs_error(&argv[0]->locus, 0, _("batch size out of range"));
+		return 1;
+	}
+	if (argc == 2 && get_msec(argv[1], &hp->batch_delay, 0))
+		return 1;
+	hp->batch_max = count;
+	return 0;
+}
+
+/* Parse the unsigned number in ARG.  Return 0 and store it in RET on
+   success. */
+static int
+get_ulong(grecs_value_t *arg, unsigned long *ret)
+{
+	unsigned long long n;
+	char *p;
+
+	errno = 0;
+	n = strtoull(arg->v.string, &p, 10);
+	if (p == arg->v.string || *p || errno) {
+		grecs_error(&arg->locus, 0, _("invalid number"));
+		return 1;
+	}
+	if (n == 0 || n > UINT_MAX) {
+		grecs_error(&arg->locus, 0, _("number out of range"));
+		return 1;
+	}
+	*ret = n;
+	return 0;
+}
+
+/* rate-limit RATE[/UNIT] [burst N] [per watcher|directory|file]
+	      [drop|defer [N]|coalesce] */
+static int
+cb_rate_limit(enum grecs_callback_command cmd, grecs_node_t *node,
+	      void *varptr, void *cb_data)
+{
+	grecs_value_t **argv, *one;
+	size_t argc, i;
+	struct ratelimit_conf *rc = varptr;
+	char *p;
+	unsigned long long n;
+	int mul = 1;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (get_string_args(node->v.value, &node->locus, &argc, &argv,
+			    &one))
+		return 1;
+
+	errno = 0;
+	n = strtoull(argv[0]->v.string, &p, 10);
+	if (p == argv[0]->v.string || (*p && *p != '/') || errno) {
+		grecs_error(&argv[0]->locus, 0, _("invalid number"));
+		return 1;
+	}
+	if (n == 0 || n > UINT_MAX) {
+		grecs_error(&argv[0]->locus, 0, _("rate out of range"));
+		return 1;
+	}
+	if (*p && trans_strtotok(time_suffix, p + 1, &mul)) {
+		grecs_error(&argv[0]->locus, 0, _("invalid time unit"));
+		return 1;
+	}
+	rc->rate = n;
+	rc->period = mul * 1000UL;
+	rc->burst = n;
+	rc->scope = RL_SCOPE_WATCHER;
+	rc->mode = RL_DROP;
+	rc->queue_size = RATELIMIT_QUEUE_SIZE;
+
+	for (i = 1; i < argc; i++) {
+		char *s = argv[i]->v.string;
+
+		if (strcmp(s, "burst") == 0) {
+			if (++i == argc) {
+				grecs_error(&argv[i-1]->locus, 0,
+					    _("missing argument"));
+				return 1;
+			}
+			if (get_ulong(argv[i], &rc->burst))
+				return 1;
+		} else if (strcmp(s, "per") == 0) {
+			if (++i == argc) {
+				grecs_error(&argv[i-1]->locus, 0,
+					    _("missing argument"));
+				return 1;
+			}
+			s = argv[i]->v.string;
+			if (strcmp(s, "watcher") == 0)
+				rc->scope = RL_SCOPE_WATCHER;
+			else if (strcmp(s, "directory") == 0)
+				rc->scope = RL_SCOPE_DIRECTORY;
+			else if (strcmp(s, "file") == 0)
+				rc->scope = RL_SCOPE_FILE;
+			else {
+				grecs_error(&argv[i]->locus, 0,
+					    _("unknown scope"));
+				return 1;
+			}
+		} else if (strcmp(s, "drop") == 0)
+			rc->mode = RL_DROP;
+		else if (strcmp(s, "defer") == 0) {
+			unsigned long size;
+
+			rc->mode = RL_DEFER;
+			if (i + 1 < argc
+			    && isdigit(argv[i+1]->v.string[0])) {
+				if (get_ulong(argv[++i], &size))
+					return 1;
+				rc->queue_size = size;
+			}
+		} else if (strcmp(s, "coalesce") == 0)
+			rc->mode = RL_COALESCE;
+		else {
+			grecs_error(&argv[i]->locus, 0,
+				    _("unrecognized argument"));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* copy-max-size SIZE */
+static int
+cb_copy_max_size(enum grecs_callback_command cmd, grecs_node_t *node,
+		 void *varptr, void *cb_data)
+{
+	grecs_value_t *val = node->v.value;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (assert_grecs_value_type(&val->locus, val, GRECS_TYPE_STRING))
+		return 1;
+	return get_scaled_number(val, val->v.string, size_suffix, varptr);
+}
+
+/* action NAME ARG */
+static int
+cb_action(enum grecs_callback_command cmd, grecs_node_t *node,
+	  void *varptr, void *cb_data)
+{
+	grecs_value_t **argv, *one;
+	size_t argc;
+	struct action *ap = varptr;
+	enum action_type type;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (get_string_args(node->v.value, &node->locus, &argc, &argv,
+			    &one))
+		return 1;
+	type = action_lookup(argv[0]->v.string);
+	if (type == ACTION_NONE) {
+		grecs_error(&argv[0]->locus, 0, _("unknown action"));
+		return 1;
+	}
+	if (argc < 2) {
+		grecs_error(&node->locus, 0, _("missing argument"));
+		return 1;
+	}
+	if (argc > 2) {
+		grecs_error(&argv[2]->locus, 0, _("surplus argument"));
+		return 1;
+	}
+	free(ap->arg);
+	ap->type = type;
+	ap->arg = estrdup(argv[1]->v.string);
+	return 0;
+}
+
+static int
+cb_priority(enum grecs_callback_command cmd, grecs_node_t *node,
+	    void *varptr, void *cb_data)
+{
+	grecs_value_t *val = node->v.value;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (assert_grecs_value_type(&val->locus, val, GRECS_TYPE_STRING))
+		return 1;
+	if (trans_strtotok(prio_transtab, val->v.string, varptr)) {
+		grecs_error(&val->locus, 0, _("unknown priority class"));
+		return 1;
+	}
+	return 0;
+}
+
+/* job-scheduler strict
+   job-scheduler weighted [HIGH NORMAL LOW] */
+static int
+cb_job_scheduler(enum grecs_callback_command cmd, grecs_node_t *node,
+		 void *varptr, void *cb_data)
+{
+	grecs_value_t **argv, *one;
+	size_t argc, i;
+	unsigned long w[PRIO_COUNT];
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (get_string_args(node->v.value, &node->locus, &argc, &argv,
+			    &one))
+		return 1;
+	if (strcmp(argv[0]->v.string, "strict") == 0) {
+		if (argc > 1) {
+			grecs_error(&argv[1]->locus, 0,
+				    _("surplus argument"));
+			return 1;
+		}
+		job_scheduler = SCHED_STRICT;
+		return 0;
+	}
+	if (strcmp(argv[0]->v.string, "weighted")) {
+		grecs_error(&argv[0]->locus, 0, _("unknown scheduler"));
+		return 1;
+	}
+	if (argc > 1) {
+		if (argc != PRIO_COUNT + 1) {
+			grecs_error(&node->locus, 0,
+				    _("expected one weight for each "
+				      "priority class"));
+			return 1;
+		}
+		for (i = 0; i < PRIO_COUNT; i++)
+			if (get_ulong(argv[i + 1], &w[i]))
+				return 1;
+		for (i = 0; i < PRIO_COUNT; i++)
+			job_class_weight[i] = w[i];
+	}
+	job_scheduler = SCHED_WEIGHTED;
+	return 0;
+}
+
+/* module PATH [ARG...] */
+static int
+cb_module(enum grecs_callback_command cmd, grecs_node_t *node,
+	  void *varptr, void *cb_data)
+{
+	grecs_value_t **argv, *one;
+	size_t argc, i;
+	struct module *mp = varptr;
+
+	ASSERT_SCALAR(cmd, &node->locus);
+	if (get_string_args(node->v.value, &node->locus, &argc, &argv,
+			    &one))
+		return 1;
+	module_free(mp);
+	mp->path = estrdup(argv[0]->v.string);
+	mp->argc = argc - 1;
+	mp->argv = ecalloc(argc, sizeof(mp->argv[0]));
+	for (i = 1; i < argc; i++)
+		mp->argv[i - 1] = estrdup(argv[i]->v.string);
+	return 0;
+}
+
 static struct grecs_keyword watcher_kw[] = {
 	{ "path", NULL, N_("Pathname to watch"),
 	  grecs_type_string, GRECS_DFLT, &eventconf.pathlist, 0,
@@ -601,13 +1247,67 @@ static struct grecs_keyword watcher_kw[] = {
 	{ "file", N_("regexp"), N_("Files to watch for"),
 	  grecs_type_string, GRECS_LIST, &eventconf.fpat, 0,
 	  cb_file_pattern },
+	{ "type", N_("type: regular|directory|symlink|fifo|socket|char|block"),
+	  N_("Select files of these types"),
+	  grecs_type_string, GRECS_DFLT, &eventconf.fpred, 0,
+	  cb_type },
+	{ "size", N_("[op] size"),
+	  N_("Select files by size"),
+	  grecs_type_string, GRECS_DFLT, &eventconf.fpred, 0,
+	  cb_size },
+	{ "owner", N_("user"),
+	  N_("Select files owned by these users"),
+	  grecs_type_string, GRECS_DFLT, &eventconf.fpred, 0,
+	  cb_owner },
+	{ "older-than", N_("time"),
+	  N_("Select files modified at least this long ago"),
+	  grecs_type_string, GRECS_DFLT, &eventconf.fpred, 0,
+	  cb_older_than },
+	{ "sample", N_("n"),
+	  N_("Deliver only one event out of this many"),
+	  grecs_type_uint, GRECS_DFLT, &eventconf.sample.rate },
+	{ "sample-interval", N_("time"),
+	  N_("Deliver at most one event per this time interval"),
+	  grecs_type_string, GRECS_DFLT, &eventconf.sample.interval, 0,
+	  cb_sample_interval },
+	{ "rate-limit",
+	  N_("rate[/unit] [burst n] [per watcher|directory|file] "
+	     "[drop|defer [n]|coalesce]"),
+	  N_("Limit the rate of events delivered to the handler"),
+	  grecs_type_string, GRECS_DFLT, &eventconf.ratelimit, 0,
+	  cb_rate_limit },
 	{ "command", NULL, N_("Command to execute on event"),
 	  grecs_type_string, GRECS_DFLT, &eventconf.prog_handler.command },
+	{ "action", N_("name arg"),
+	  N_("Perform a built-in action instead of running a command: "
+	     "move, copy or link the file to directory arg, append its "
+	     "name to file arg, or touch file arg"),
+	  grecs_type_string, GRECS_DFLT, &eventconf.action, 0,
+	  cb_action },
+	{ "module", N_("file [args...]"),
+	  N_("Handle events by calling a loadable module instead of "
+	     "running a command"),
+	  grecs_type_string, GRECS_DFLT, &eventconf.module, 0,
+	  cb_module },
 	{ "user", N_("name"), N_("Run command as this user"),
 	  grecs_type_string, GRECS_DFLT, NULL, 0,
 	  cb_user },
-	{ "timeout", N_("seconds"), N_("Timeout for the command"),
-	  grecs_type_uint, GRECS_DFLT, &eventconf.prog_handler.timeout },
+	{ "timeout", N_("time"), N_("Timeout for the command"),
+	  grecs_type_string, GRECS_DFLT, &eventconf.prog_handler.timeout, 0,
+	  cb_timeout },
+	{ "max-handlers", N_("number"),
+	  N_("Maximum number of instances of the command running "
+	     "simultaneously"),
+	  grecs_type_uint, GRECS_DFLT, &eventconf.prog_handler.max_running },
+	{ "priority", N_("class: high|normal|low"),
+	  N_("Priority class of the command invocations"),
+	  grecs_type_string, GRECS_DFLT, &eventconf.prog_handler.priority, 0,
+	  cb_priority },
+	{ "batch", N_("count [delay]"),
+	  N_("Run the command for batches of up to count events, "
+	     "collected for at most delay"),
+	  grecs_type_string, GRECS_DFLT, &eventconf.prog_handler, 0,
+	  cb_batch },
 	{ "option", NULL, N_("List of additional options"),
 	  grecs_type_string, GRECS_LIST, NULL, 0,
 	  cb_option },
@@ -629,6 +1329,25 @@ static struct grecs_keyword direvent_kw[] = {
 	  grecs_type_section, GRECS_DFLT, NULL, 0, NULL, NULL, syslog_kw },
 	{ "debug", N_("level"), N_("Set debug level"),
 	  grecs_type_int, GRECS_DFLT, &debug_level },
+	{ "dirfd-cache-size", N_("number"),
+	  N_("Maximum number of directory descriptors to keep open"),
+	  grecs_type_uint, GRECS_DFLT, &dirfd_cache_size },
+	{ "max-handlers", N_("number"),
+	  N_("Maximum number of handlers running simultaneously"),
+	  grecs_type_uint, GRECS_DFLT, &max_handlers },
+	{ "job-queue-size", N_("number"),
+	  N_("Maximum number of handler invocations waiting to be run"),
+	  grecs_type_uint, GRECS_DFLT, &job_queue_size },
+	{ "copy-max-size", N_("size"),
+	  N_("Maximum size of a file copied by the copy and move actions "
+	     "(0 means no limit)"),
+	  grecs_type_string, GRECS_DFLT, &action_copy_max, 0,
+	  cb_copy_max_size },
+	{ "job-scheduler", N_("arg: strict|weighted [high normal low]"),
+	  N_("Choose queued jobs among the priority classes strictly by "
+	     "priority, or by weighted round-robin"),
+	  grecs_type_string, GRECS_DFLT, NULL, 0,
+	  cb_job_scheduler },
 	{ "watcher", NULL, N_("Configure event watcher"),
 	  grecs_type_section, GRECS_DFLT, NULL, 0,
 	  cb_watcher, NULL, watcher_kw },
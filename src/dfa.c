@@ -0,0 +1,1148 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2016 Sergey Poznyakoff
+
+   Direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   Direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+/* Combined matching automaton for file name patterns.
+
+   Exact names, globbing patterns and regular expressions are parsed
+   into syntax trees, which are then translated into a single Thompson
+   NFA.  The NFA is converted to a DFA lazily: each DFA state is built
+   the first time it is reached while matching a name, and is cached
+   for further use.  Every DFA state knows the outcome of the match for
+   a name that ends in it, so a name is matched in a single pass, no
+   matter how many patterns the automaton contains.
+
+   Constructs that cannot be expressed by a finite automaton (e.g. back
+   references) or whose semantics depends on the locale in ways the
+   automaton does not model (collating elements, equivalence classes,
+   ranges outside the C locale) are rejected by the dfa_add_* functions.
+   The caller is supposed to handle such patterns by other means. */
+
+#include "direvent.h"
+#include <ctype.h>
+#include <locale.h>
+
+/* Character sets */
+#define CSET_SIZE 32
+typedef unsigned char cset_t[CSET_SIZE];
+
+#define CSET_ADD(s,c) \
+	((s)[(unsigned char)(c) >> 3] |= 1 << ((unsigned char)(c) & 7))
+#define CSET_DEL(s,c) \
+	((s)[(unsigned char)(c) >> 3] &= ~(1 << ((unsigned char)(c) & 7)))
+#define CSET_HAS(s,c) \
+	((s)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+/* NFA node types */
+enum {
+	NFA_SET,        /* Match a character from the set ARG */
+	NFA_SPLIT,      /* Epsilon transitions to OUT and OUT1 */
+	NFA_BOL,        /* Beginning of name assertion */
+	NFA_EOL,        /* End of name assertion */
+	NFA_MATCH       /* Pattern matched; ARG is its negation flag */
+};
+
+struct nfa_node {
+	int type;
+	int out, out1;
+	int arg;
+};
+
+/* Upper limit on the number of NFA nodes a single pattern can produce */
+#define NFA_PATTERN_MAX 4096
+
+/* Maximum number of cached DFA states.  When it is reached, the cache
+   is flushed and rebuilt from scratch. */
+#define DFA_MAX_STATES 512
+#define DFA_HASH_SIZE 127
+
+struct dfa_state {
+	struct dfa_state *next;       /* Next state in the hash bucket */
+	unsigned hash;                /* Hash value */
+	int initial;                  /* Initial state */
+	int verdict;                  /* Result of the match ending here,
+					 -1 if not yet computed */
+	size_t nn;                    /* Number of NFA nodes */
+	int *nodes;                   /* Sorted array of NFA node indices */
+	struct dfa_state **trans;     /* Transitions, indexed by byte class */
+};
+
+struct dfa {
+	/* Character sets */
+	cset_t *cset;
+	size_t ncset;
+	size_t maxcset;
+	int litcset[256];             /* Single-character sets, by char */
+	int anycset;                  /* Any character */
+	int nslcset;                  /* Any character, except '/' */
+
+	/* NFA */
+	struct nfa_node *node;
+	size_t nnode;
+	size_t maxnode;
+	int *start;                   /* Start nodes of the patterns */
+	size_t nstart;
+	size_t maxstart;
+	size_t nneg;                  /* Number of negated patterns */
+
+	/* DFA */
+	int ready;                    /* Byte classes are up to date */
+	unsigned char classmap[256];  /* Byte to class map */
+	unsigned char classrep[256];  /* Representative byte of each class */
+	int nclass;                   /* Number of byte classes */
+	struct dfa_state *bucket[DFA_HASH_SIZE];
+	size_t nstate;
+	struct dfa_state *initial;
+	unsigned long flushes;
+
+	/* Work space */
+	unsigned *mark;
+	unsigned gen;
+	int *stack;
+	int *buf;
+	size_t nbuf;
+	size_t worksize;
+};
+
+struct dfa *
+dfa_create(void)
+{
+	struct dfa *dfa = ecalloc(1, sizeof(*dfa));
+	int i;
+
+	for (i = 0; i < 256; i++)
+		dfa->litcset[i] = -1;
+	dfa->anycset = -1;
+	dfa->nslcset = -1;
+	return dfa;
+}
+
+static void
+dfa_flush(struct dfa *dfa)
+{
+	int i;
+
+	for (i = 0; i < DFA_HASH_SIZE; i++) {
+		struct dfa_state *s = dfa->bucket[i];
+		while (s) {
+			struct dfa_state *next = s->next;
+			free(s);
+			s = next;
+		}
+		dfa->bucket[i] = NULL;
+	}
+	dfa->nstate = 0;
+	dfa->initial = NULL;
+	dfa->flushes++;
+}
+
+void
+dfa_free(struct dfa *dfa)
+{
+	if (!dfa)
+		return;
+	dfa_flush(dfa);
+	free(dfa->cset);
+	free(dfa->node);
+	free(dfa->start);
+	free(dfa->mark);
+	free(dfa->stack);
+	free(dfa->buf);
+	free(dfa);
+}
+
+static int
+cset_alloc(struct dfa *dfa)
+{
+	if (dfa->ncset == dfa->maxcset) {
+		dfa->maxcset = dfa->maxcset ? 2 * dfa->maxcset : 16;
+		dfa->cset = erealloc(dfa->cset,
+				     dfa->maxcset * sizeof(dfa->cset[0]));
+	}
+	memset(dfa->cset[dfa->ncset], 0, CSET_SIZE);
+	return dfa->ncset++;
+}
+
+static int
+nfa_node_alloc(struct dfa *dfa, int type, int out, int out1, int arg)
+{
+	struct nfa_node *np;
+
+	if (dfa->nnode == dfa->maxnode) {
+		dfa->maxnode = dfa->maxnode ? 2 * dfa->maxnode : 64;
+		dfa->node = erealloc(dfa->node,
+				     dfa->maxnode * sizeof(dfa->node[0]));
+	}
+	np = &dfa->node[dfa->nnode];
+	np->type = type;
+	np->out = out;
+	np->out1 = out1;
+	np->arg = arg;
+	return dfa->nnode++;
+}
+
+/* Syntax trees */
+
+enum ast_type {
+	AST_EMPTY,
+	AST_SET,
+	AST_CAT,
+	AST_ALT,
+	AST_REPEAT,
+	AST_BOL,
+	AST_EOL
+};
+
+struct ast {
+	enum ast_type type;
+	int left, right;              /* Subtrees (CAT, ALT, REPEAT) */
+	int min, max;                 /* Repeat counts; max=-1: unlimited */
+	int cset;                     /* Character set (SET) */
+};
+
+/* Parser flags */
+#define PF_ICASE    0x01    /* Case-insensitive matching */
+#define PF_BRE      0x02    /* Basic regular expression */
+#define PF_GLOB     0x04    /* Globbing pattern */
+#define PF_PATHNAME 0x08    /* Wildcards don't match '/' */
+#define PF_PATHSCOPE 0x10   /* Pattern is matched against a pathname:
+			       "**" matches across directories */
+
+struct parser {
+	struct dfa *dfa;
+	int flags;
+	int ccoll;                    /* C collation order in effect */
+	const char *cur;              /* Current position in the input */
+	const char *start;            /* Start of the input */
+	struct ast *tree;
+	size_t ntree;
+	size_t maxtree;
+};
+
+static int
+ast_new(struct parser *p, enum ast_type type, int left, int right)
+{
+	struct ast *ap;
+
+	if (p->ntree == p->maxtree) {
+		p->maxtree = p->maxtree ? 2 * p->maxtree : 64;
+		p->tree = erealloc(p->tree, p->maxtree * sizeof(p->tree[0]));
+	}
+	ap = &p->tree[p->ntree];
+	ap->type = type;
+	ap->left = left;
+	ap->right = right;
+	ap->min = ap->max = 0;
+	ap->cset = -1;
+	return p->ntree++;
+}
+
+static int
+ast_cat(struct parser *p, int a, int b)
+{
+	if (a == -1)
+		return b;
+	if (b == -1)
+		return a;
+	return ast_new(p, AST_CAT, a, b);
+}
+
+static int
+ast_repeat(struct parser *p, int a, int min, int max)
+{
+	int n = ast_new(p, AST_REPEAT, a, -1);
+	p->tree[n].min = min;
+	p->tree[n].max = max;
+	return n;
+}
+
+static int
+ast_set(struct parser *p, int cset)
+{
+	int n = ast_new(p, AST_SET, -1, -1);
+	p->tree[n].cset = cset;
+	return n;
+}
+
+static void
+pset_add(struct parser *p, unsigned char *set, int c)
+{
+	CSET_ADD(set, c);
+	if (p->flags & PF_ICASE) {
+		CSET_ADD(set, tolower(c));
+		CSET_ADD(set, toupper(c));
+	}
+}
+
+/* Return a syntax tree matching the literal character C */
+static int
+ast_literal(struct parser *p, int c)
+{
+	struct dfa *dfa = p->dfa;
+	int n;
+
+	c = (unsigned char) c;
+	if (p->flags & PF_ICASE) {
+		n = cset_alloc(dfa);
+		pset_add(p, dfa->cset[n], c);
+	} else if ((n = dfa->litcset[c]) == -1) {
+		n = cset_alloc(dfa);
+		CSET_ADD(dfa->cset[n], c);
+		dfa->litcset[c] = n;
+	}
+	return ast_set(p, n);
+}
+
+/* Return a syntax tree matching any character (except '/', if
+   NOSLASH is set) */
+static int
+ast_any(struct parser *p, int noslash)
+{
+	struct dfa *dfa = p->dfa;
+	int *ip = noslash ? &dfa->nslcset : &dfa->anycset;
+
+	if (*ip == -1) {
+		int n = cset_alloc(dfa);
+		memset(dfa->cset[n], 0xff, CSET_SIZE);
+		CSET_DEL(dfa->cset[n], 0);
+		if (noslash)
+			CSET_DEL(dfa->cset[n], '/');
+		*ip = n;
+	}
+	return ast_set(p, *ip);
+}
+
+static struct {
+	char *name;
+	int (*isfn)(int);
+} class_tab[] = {
+	{ "alnum", isalnum },
+	{ "alpha", isalpha },
+	{ "blank", isblank },
+	{ "cntrl", iscntrl },
+	{ "digit", isdigit },
+	{ "graph", isgraph },
+	{ "lower", islower },
+	{ "print", isprint },
+	{ "punct", ispunct },
+	{ "space", isspace },
+	{ "upper", isupper },
+	{ "xdigit", isxdigit },
+	{ NULL }
+};
+
+static int
+cset_add_class(struct parser *p, unsigned char *set,
+	       const char *name, size_t len)
+{
+	int i, c;
+
+	for (i = 0; class_tab[i].name; i++) {
+		if (strlen(class_tab[i].name) == len
+		    && memcmp(class_tab[i].name, name, len) == 0) {
+			for (c = 1; c < 256; c++)
+				if (class_tab[i].isfn(c))
+					pset_add(p, set, c);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Parse a bracket expression.  On entry, p->cur points past the
+   opening bracket. */
+static int
+parse_bracket(struct parser *p)
+{
+	struct dfa *dfa = p->dfa;
+	int glob = p->flags & PF_GLOB;
+	const char *s = p->cur;
+	int neg = 0;
+	int n, c, i;
+	unsigned char *set;
+
+	n = cset_alloc(dfa);
+	set = dfa->cset[n];
+
+	if (*s == '^' || (glob && *s == '!')) {
+		neg = 1;
+		s++;
+	}
+	if (*s == ']') {
+		pset_add(p, set, ']');
+		s++;
+	}
+	while (*s != ']') {
+		int lo, hi;
+
+		if (*s == 0)
+			return -1;
+		if (*s == '[' && (s[1] == ':' || s[1] == '=' || s[1] == '.')) {
+			const char *e;
+			if (s[1] != ':')
+				return -1;
+			e = strstr(s + 2, ":]");
+			if (!e || cset_add_class(p, set, s + 2, e - s - 2))
+				return -1;
+			s = e + 2;
+			continue;
+		}
+		if (glob && *s == '\\' && *++s == 0)
+			return -1;
+		lo = (unsigned char) *s++;
+		if (*s == '-' && s[1] && s[1] != ']') {
+			s++;
+			if (*s == '[')
+				return -1;
+			if (glob && *s == '\\' && *++s == 0)
+				return -1;
+			hi = (unsigned char) *s++;
+			if (!p->ccoll)
+				return -1;
+			for (c = lo; c <= hi; c++)
+				pset_add(p, set, c);
+		} else
+			pset_add(p, set, lo);
+	}
+	p->cur = s + 1;
+
+	if (neg)
+		for (i = 0; i < CSET_SIZE; i++)
+			set[i] = ~set[i];
+	CSET_DEL(set, 0);
+	if (p->flags & PF_PATHNAME)
+		CSET_DEL(set, '/');
+	return ast_set(p, n);
+}
+
+/* Globbing patterns (see fnmatch(3)) */
+static int
+parse_glob(struct parser *p)
+{
+	int root = -1;
+	int pathname = p->flags & PF_PATHNAME;
+
+	while (*p->cur) {
+		int n;
+
+		switch (*p->cur) {
+		case '*':
+			if ((p->flags & PF_PATHSCOPE)
+			    && p->cur[1] == '*'
+			    && (p->cur == p->start || p->cur[-1] == '/')
+			    && (p->cur[2] == '/' || p->cur[2] == 0)) {
+				if (p->cur[2] == 0) {
+					/* Trailing "**" matches anything */
+					n = ast_repeat(p, ast_any(p, 0),
+						       0, -1);
+					p->cur += 2;
+				} else {
+					/* "**" followed by a slash matches
+					   zero or more directories */
+					n = ast_cat(p,
+						    ast_repeat(p,
+							       ast_any(p, 1),
+							       0, -1),
+						    ast_literal(p, '/'));
+					n = ast_repeat(p, n, 0, -1);
+					p->cur += 3;
+				}
+			} else {
+				n = ast_repeat(p, ast_any(p, pathname),
+					       0, -1);
+				p->cur++;
+			}
+			break;
+
+		case '?':
+			n = ast_any(p, pathname);
+			p->cur++;
+			break;
+
+		case '[':
+			if (p->cur[1] == 0 || strchr(p->cur + 2, ']') == NULL)
+				return -1;
+			p->cur++;
+			n = parse_bracket(p);
+			if (n == -1)
+				return -1;
+			break;
+
+		case '\\':
+			if (p->cur[1] == 0 || p->cur[1] == '/')
+				return -1;
+			p->cur++;
+			/* fall through */
+		default:
+			n = ast_literal(p, *p->cur++);
+		}
+		root = ast_cat(p, root, n);
+	}
+	return root == -1 ? ast_new(p, AST_EMPTY, -1, -1) : root;
+}
+
+/* Regular expressions */
+
+static int parse_regex(struct parser *p, int depth);
+
+static int
+parse_interval(struct parser *p, int *pmin, int *pmax)
+{
+	const char *s = p->cur;
+	char *end;
+	long min = 0, max;
+	int bre = p->flags & PF_BRE;
+
+	if (isdigit((unsigned char) *s)) {
+		min = strtol(s, &end, 10);
+		s = end;
+	} else if (*s != ',')
+		return -1;
+	if (*s == ',') {
+		s++;
+		if (isdigit((unsigned char) *s)) {
+			max = strtol(s, &end, 10);
+			s = end;
+		} else
+			max = -1;
+	} else
+		max = min;
+	if (bre) {
+		if (s[0] != '\\' || s[1] != '}')
+			return -1;
+		s += 2;
+	} else if (*s++ != '}')
+		return -1;
+	if (min > 255 || max > 255 || (max != -1 && max < min))
+		return -1;
+	*pmin = min;
+	*pmax = max;
+	p->cur = s;
+	return 0;
+}
+
+/* Return 1 if the input is at the end of a branch */
+static int
+at_branch_end(struct parser *p, const char *s)
+{
+	if (*s == 0)
+		return 1;
+	if (p->flags & PF_BRE)
+		return s[0] == '\\' && (s[1] == ')' || s[1] == '|');
+	return *s == ')' || *s == '|';
+}
+
+static int
+parse_escape(struct parser *p)
+{
+	struct dfa *dfa = p->dfa;
+	int c = *p->cur++;
+	int n, i;
+	unsigned char *set;
+
+	switch (c) {
+	case 0:
+	case '1': case '2': case '3': case '4': case '5':
+	case '6': case '7': case '8': case '9':
+	case 'b': case 'B': case '<': case '>': case '`': case '\'':
+		return -1;
+
+	case 'w':
+	case 'W':
+	case 's':
+	case 'S':
+		if (p->flags & PF_ICASE)
+			return -1;
+		n = cset_alloc(dfa);
+		set = dfa->cset[n];
+		for (i = 1; i < 256; i++) {
+			int in = (c == 'w' || c == 'W')
+				   ? (isalnum(i) || i == '_') : isspace(i);
+			if (isupper(c))
+				in = !in;
+			if (in)
+				CSET_ADD(set, i);
+		}
+		return ast_set(p, n);
+	}
+	/* Escaped alphanumerics have implementation-defined meaning */
+	if (isalnum(c))
+		return -1;
+	return ast_literal(p, c);
+}
+
+static int
+parse_branch(struct parser *p, int depth)
+{
+	int root = -1;
+	int bre = p->flags & PF_BRE;
+	const char *bstart = p->cur;
+
+	while (!at_branch_end(p, p->cur)) {
+		int n = -1;
+		const char *s = p->cur;
+		int min, max;
+
+		/* Atom */
+		if (bre && s[0] == '\\' && s[1] == '(') {
+			p->cur += 2;
+			n = parse_regex(p, depth + 1);
+			if (n == -1 || p->cur[0] != '\\' || p->cur[1] != ')')
+				return -1;
+			p->cur += 2;
+		} else if (!bre && *s == '(') {
+			p->cur++;
+			n = parse_regex(p, depth + 1);
+			if (n == -1 || *p->cur != ')')
+				return -1;
+			p->cur++;
+		} else if (*s == '^' && (!bre || s == bstart)) {
+			n = ast_new(p, AST_BOL, -1, -1);
+			p->cur++;
+		} else if (*s == '$' && (!bre || at_branch_end(p, s + 1))) {
+			n = ast_new(p, AST_EOL, -1, -1);
+			p->cur++;
+		} else if (*s == '[') {
+			p->cur++;
+			n = parse_bracket(p);
+		} else if (*s == '.') {
+			n = ast_any(p, 0);
+			p->cur++;
+		} else if (*s == '*' && bre
+			   && (s == bstart
+			       || (s == bstart + 1 && *bstart == '^'))) {
+			n = ast_literal(p, '*');
+			p->cur++;
+		} else if (!bre && strchr("*+?{)", *s)) {
+			return -1;
+		} else if (*s == '\\') {
+			p->cur++;
+			if (bre && strchr("{}+?", *p->cur))
+				return -1;
+			n = parse_escape(p);
+		} else
+			n = ast_literal(p, *p->cur++);
+		if (n == -1)
+			return -1;
+
+		/* Quantifiers */
+		for (;;) {
+			s = p->cur;
+			/* In a BRE, a star after the leading anchor is
+			   literal */
+			if (bre && p->tree[n].type == AST_BOL)
+				break;
+			if (*s == '*') {
+				min = 0;
+				max = -1;
+				p->cur++;
+			} else if (!bre && *s == '+') {
+				min = 1;
+				max = -1;
+				p->cur++;
+			} else if (!bre && *s == '?') {
+				min = 0;
+				max = 1;
+				p->cur++;
+			} else if (bre && s[0] == '\\' && s[1] == '+') {
+				min = 1;
+				max = -1;
+				p->cur += 2;
+			} else if (bre && s[0] == '\\' && s[1] == '?') {
+				min = 0;
+				max = 1;
+				p->cur += 2;
+			} else if (!bre && *s == '{') {
+				p->cur++;
+				if (parse_interval(p, &min, &max))
+					return -1;
+			} else if (bre && s[0] == '\\' && s[1] == '{') {
+				p->cur += 2;
+				if (parse_interval(p, &min, &max))
+					return -1;
+			} else
+				break;
+			if (p->tree[n].type == AST_BOL
+			    || p->tree[n].type == AST_EOL)
+				return -1;
+			n = ast_repeat(p, n, min, max);
+		}
+		root = ast_cat(p, root, n);
+	}
+	return root == -1 ? ast_new(p, AST_EMPTY, -1, -1) : root;
+}
+
+static int
+parse_regex(struct parser *p, int depth)
+{
+	int bre = p->flags & PF_BRE;
+	int root;
+
+	if (depth > 64)
+		return -1;
+	root = parse_branch(p, depth);
+	while (root != -1) {
+		int n;
+
+		if (bre && p->cur[0] == '\\' && p->cur[1] == '|')
+			p->cur += 2;
+		else if (!bre && *p->cur == '|')
+			p->cur++;
+		else
+			break;
+		n = parse_branch(p, depth);
+		if (n == -1)
+			return -1;
+		root = ast_new(p, AST_ALT, root, n);
+	}
+	if (root != -1 && depth == 0 && *p->cur)
+		return -1;
+	return root;
+}
+
+/* Translate the syntax tree N into NFA nodes, given the continuation
+   node NEXT.  Return the index of the start node, or -1 if the
+   resulting automaton is too big. */
+static int
+nfa_compile(struct parser *p, size_t base, int n, int next)
+{
+	struct dfa *dfa = p->dfa;
+	struct ast *ap = &p->tree[n];
+	int i, a, b, s;
+
+	if (dfa->nnode - base > NFA_PATTERN_MAX)
+		return -1;
+	switch (ap->type) {
+	case AST_EMPTY:
+		return next;
+
+	case AST_SET:
+		return nfa_node_alloc(dfa, NFA_SET, next, -1, ap->cset);
+
+	case AST_BOL:
+		return nfa_node_alloc(dfa, NFA_BOL, next, -1, 0);
+
+	case AST_EOL:
+		return nfa_node_alloc(dfa, NFA_EOL, next, -1, 0);
+
+	case AST_CAT:
+		if ((b = nfa_compile(p, base, ap->right, next)) == -1)
+			return -1;
+		return nfa_compile(p, base, ap->left, b);
+
+	case AST_ALT:
+		if ((a = nfa_compile(p, base, ap->left, next)) == -1
+		    || (b = nfa_compile(p, base, ap->right, next)) == -1)
+			return -1;
+		return nfa_node_alloc(dfa, NFA_SPLIT, a, b, 0);
+
+	case AST_REPEAT:
+		if (ap->max == -1) {
+			s = nfa_node_alloc(dfa, NFA_SPLIT, -1, next, 0);
+			if ((a = nfa_compile(p, base, ap->left, s)) == -1)
+				return -1;
+			dfa->node[s].out = a;
+			b = s;
+		} else {
+			b = next;
+			for (i = ap->min; i < ap->max; i++) {
+				if ((a = nfa_compile(p, base, ap->left, b))
+				    == -1)
+					return -1;
+				b = nfa_node_alloc(dfa, NFA_SPLIT, a, next, 0);
+			}
+		}
+		for (i = 0; i < ap->min; i++)
+			if ((b = nfa_compile(p, base, ap->left, b)) == -1)
+				return -1;
+		return b;
+	}
+	abort();
+}
+
+static void
+parser_init(struct parser *p, struct dfa *dfa, const char *str, int flags)
+{
+	const char *coll;
+
+	memset(p, 0, sizeof(*p));
+	p->dfa = dfa;
+	p->flags = flags;
+	p->cur = p->start = str;
+	coll = setlocale(LC_COLLATE, NULL);
+	p->ccoll = !coll || strcmp(coll, "C") == 0
+		   || strcmp(coll, "POSIX") == 0;
+}
+
+/* Finish adding a pattern.  If ROOT is -1, the pattern is not
+   supported, so roll back any changes made to the automaton.
+   Otherwise, compile ROOT and register the resulting start state. */
+static int
+parser_finish(struct parser *p, int root, int neg,
+	      size_t nnode, size_t ncset)
+{
+	struct dfa *dfa = p->dfa;
+	int start = -1;
+
+	if (root != -1) {
+		int m = nfa_node_alloc(dfa, NFA_MATCH, -1, -1, neg);
+		start = nfa_compile(p, nnode, root, m);
+	}
+	free(p->tree);
+
+	if (start == -1) {
+		int i;
+
+		dfa->nnode = nnode;
+		dfa->ncset = ncset;
+		for (i = 0; i < 256; i++)
+			if (dfa->litcset[i] >= (int) ncset)
+				dfa->litcset[i] = -1;
+		if (dfa->anycset >= (int) ncset)
+			dfa->anycset = -1;
+		if (dfa->nslcset >= (int) ncset)
+			dfa->nslcset = -1;
+		return -1;
+	}
+
+	if (dfa->nstart == dfa->maxstart) {
+		dfa->maxstart = dfa->maxstart ? 2 * dfa->maxstart : 16;
+		dfa->start = erealloc(dfa->start,
+				      dfa->maxstart * sizeof(dfa->start[0]));
+	}
+	dfa->start[dfa->nstart++] = start;
+	if (neg)
+		dfa->nneg++;
+	dfa->ready = 0;
+	return 0;
+}
+
+int
+dfa_add_exact(struct dfa *dfa, const char *str, int neg)
+{
+	struct parser p;
+	size_t nnode = dfa->nnode, ncset = dfa->ncset;
+	int root = -1;
+
+	parser_init(&p, dfa, str, 0);
+	for (; *str; str++)
+		root = ast_cat(&p, root, ast_literal(&p, *str));
+	if (root == -1)
+		root = ast_new(&p, AST_EMPTY, -1, -1);
+	return parser_finish(&p, root, neg, nnode, ncset);
+}
+
+int
+dfa_add_glob(struct dfa *dfa, const char *str, int neg, int pathscope)
+{
+	struct parser p;
+	size_t nnode = dfa->nnode, ncset = dfa->ncset;
+
+	parser_init(&p, dfa, str,
+		    PF_GLOB | PF_PATHNAME | (pathscope ? PF_PATHSCOPE : 0));
+	return parser_finish(&p, parse_glob(&p), neg, nnode, ncset);
+}
+
+int
+dfa_add_regex(struct dfa *dfa, const char *str, int cflags, int neg)
+{
+	struct parser p;
+	size_t nnode = dfa->nnode, ncset = dfa->ncset;
+	int root;
+
+	parser_init(&p, dfa, str,
+		    ((cflags & REG_EXTENDED) ? 0 : PF_BRE)
+		    | ((cflags & REG_ICASE) ? PF_ICASE : 0));
+	root = parse_regex(&p, 0);
+	if (root != -1) {
+		/* Regular expressions match anywhere in the name */
+		root = ast_cat(&p, ast_repeat(&p, ast_any(&p, 0), 0, -1),
+			       ast_cat(&p, root,
+				       ast_repeat(&p, ast_any(&p, 0), 0, -1)));
+	}
+	return parser_finish(&p, root, neg, nnode, ncset);
+}
+
+size_t
+dfa_count(struct dfa *dfa)
+{
+	return dfa ? dfa->nstart : 0;
+}
+
+/* Prepare the automaton for matching: compute byte equivalence classes
+   and allocate work space. */
+static void
+dfa_prepare(struct dfa *dfa)
+{
+	int cls[256], newid[512];
+	int i, b, ncls;
+
+	dfa_flush(dfa);
+
+	/* Two bytes belong to the same class if every character set used
+	   in the automaton either contains both of them or none. */
+	memset(cls, 0, sizeof(cls));
+	ncls = 1;
+	for (i = 0; i < dfa->ncset; i++) {
+		int n = 0;
+
+		for (b = 0; b < 2 * ncls; b++)
+			newid[b] = -1;
+		for (b = 0; b < 256; b++) {
+			int key = 2 * cls[b] + !!CSET_HAS(dfa->cset[i], b);
+			if (newid[key] == -1)
+				newid[key] = n++;
+			cls[b] = newid[key];
+		}
+		ncls = n;
+	}
+	dfa->nclass = ncls;
+	for (b = 255; b >= 0; b--) {
+		dfa->classmap[b] = cls[b];
+		dfa->classrep[cls[b]] = b;
+	}
+
+	if (dfa->worksize < dfa->nnode) {
+		dfa->worksize = dfa->nnode;
+		dfa->mark = erealloc(dfa->mark,
+				     dfa->worksize * sizeof(dfa->mark[0]));
+		/* Each node can be pushed once per incoming edge */
+		dfa->stack = erealloc(dfa->stack,
+				      (2 * dfa->worksize + 1)
+				      * sizeof(dfa->stack[0]));
+		dfa->buf = erealloc(dfa->buf,
+				    dfa->worksize * sizeof(dfa->buf[0]));
+	}
+	if (dfa->worksize)
+		memset(dfa->mark, 0, dfa->worksize * sizeof(dfa->mark[0]));
+	dfa->gen = 0;
+	dfa->ready = 1;
+}
+
+/* Closure flags */
+#define CL_BOL 0x01      /* Follow beginning of name assertions */
+#define CL_EOL 0x02      /* Follow end of name assertions */
+
+static void
+closure_begin(struct dfa *dfa)
+{
+	if (++dfa->gen == 0 && dfa->worksize) {
+		memset(dfa->mark, 0, dfa->worksize * sizeof(dfa->mark[0]));
+		dfa->gen = 1;
+	}
+	dfa->nbuf = 0;
+}
+
+/* Add to the work buffer all nodes reachable from N by epsilon
+   transitions */
+static void
+closure_add(struct dfa *dfa, int n, int flags)
+{
+	size_t sp = 0;
+
+	dfa->stack[sp++] = n;
+	while (sp) {
+		struct nfa_node *np;
+
+		n = dfa->stack[--sp];
+		if (dfa->mark[n] == dfa->gen)
+			continue;
+		dfa->mark[n] = dfa->gen;
+		np = &dfa->node[n];
+		switch (np->type) {
+		case NFA_SET:
+		case NFA_MATCH:
+			dfa->buf[dfa->nbuf++] = n;
+			break;
+
+		case NFA_EOL:
+			if (flags & CL_EOL)
+				dfa->stack[sp++] = np->out;
+			else
+				dfa->buf[dfa->nbuf++] = n;
+			break;
+
+		case NFA_BOL:
+			if (flags & CL_BOL)
+				dfa->stack[sp++] = np->out;
+			break;
+
+		case NFA_SPLIT:
+			dfa->stack[sp++] = np->out1;
+			dfa->stack[sp++] = np->out;
+		}
+	}
+}
+
+static int
+cmpint(const void *a, const void *b)
+{
+	int x = *(const int *) a;
+	int y = *(const int *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* Find or create the DFA state corresponding to the set of NFA nodes in
+   the work buffer. */
+static struct dfa_state *
+dfa_state_get(struct dfa *dfa, int initial)
+{
+	unsigned hash = initial ? 1 : 0;
+	size_t i;
+	struct dfa_state *s;
+
+	if (dfa->nbuf > 1)
+		qsort(dfa->buf, dfa->nbuf, sizeof(dfa->buf[0]), cmpint);
+	for (i = 0; i < dfa->nbuf; i++)
+		hash = hash * 31 + dfa->buf[i];
+
+	for (s = dfa->bucket[hash % DFA_HASH_SIZE]; s; s = s->next)
+		if (s->hash == hash && s->initial == initial
+		    && s->nn == dfa->nbuf
+		    && memcmp(s->nodes, dfa->buf,
+			      dfa->nbuf * sizeof(dfa->buf[0])) == 0)
+			return s;
+
+	if (dfa->nstate == DFA_MAX_STATES)
+		dfa_flush(dfa);
+
+	s = emalloc(sizeof(*s)
+		    + dfa->nclass * sizeof(s->trans[0])
+		    + dfa->nbuf * sizeof(s->nodes[0]));
+	s->trans = (struct dfa_state **)(s + 1);
+	memset(s->trans, 0, dfa->nclass * sizeof(s->trans[0]));
+	s->nodes = (int *)(s->trans + dfa->nclass);
+	if (dfa->nbuf)
+		memcpy(s->nodes, dfa->buf, dfa->nbuf * sizeof(dfa->buf[0]));
+	s->nn = dfa->nbuf;
+	s->hash = hash;
+	s->initial = initial;
+	s->verdict = -1;
+	s->next = dfa->bucket[hash % DFA_HASH_SIZE];
+	dfa->bucket[hash % DFA_HASH_SIZE] = s;
+	dfa->nstate++;
+	return s;
+}
+
+static struct dfa_state *
+dfa_initial(struct dfa *dfa)
+{
+	if (!dfa->ready)
+		dfa_prepare(dfa);
+	if (!dfa->initial) {
+		size_t i;
+
+		closure_begin(dfa);
+		for (i = 0; i < dfa->nstart; i++)
+			closure_add(dfa, dfa->start[i], CL_BOL);
+		dfa->initial = dfa_state_get(dfa, 1);
+	}
+	return dfa->initial;
+}
+
+static struct dfa_state *
+dfa_step(struct dfa *dfa, struct dfa_state *s, int cls)
+{
+	int c = dfa->classrep[cls];
+	unsigned long flushes = dfa->flushes;
+	struct dfa_state *t;
+	size_t i;
+
+	closure_begin(dfa);
+	for (i = 0; i < s->nn; i++) {
+		struct nfa_node *np = &dfa->node[s->nodes[i]];
+		if (np->type == NFA_SET && CSET_HAS(dfa->cset[np->arg], c))
+			closure_add(dfa, np->out, 0);
+	}
+	t = dfa_state_get(dfa, 0);
+	/* Cache the transition, unless S has been flushed meanwhile */
+	if (dfa->flushes == flushes)
+		s->trans[cls] = t;
+	return t;
+}
+
+/* Compute the outcome of a match that ends in the state S.  The pattern
+   list matches if any of its positive patterns matches or any of its
+   negated patterns doesn't. */
+static int
+dfa_verdict(struct dfa *dfa, struct dfa_state *s)
+{
+	if (s->verdict == -1) {
+		size_t i, nneg = 0;
+		int pos = 0;
+
+		closure_begin(dfa);
+		for (i = 0; i < s->nn; i++) {
+			int n = s->nodes[i];
+			if (dfa->node[n].type != NFA_SET)
+				closure_add(dfa, n,
+					    CL_EOL | (s->initial ? CL_BOL : 0));
+		}
+		for (i = 0; i < dfa->nbuf; i++) {
+			struct nfa_node *np = &dfa->node[dfa->buf[i]];
+			if (np->type == NFA_MATCH) {
+				if (np->arg)
+					nneg++;
+				else
+					pos = 1;
+			}
+		}
+		s->verdict = (pos || nneg < dfa->nneg) ? 0 : 1;
+	}
+	return s->verdict;
+}
+
+/* Feed the string STR to the automaton, starting from the state S.
+   Stop if a state with no further transitions is reached. */
+static struct dfa_state *
+dfa_run(struct dfa *dfa, struct dfa_state *s, const char *str)
+{
+	const unsigned char *p;
+
+	for (p = (const unsigned char *) str; *p && s->nn; p++) {
+		int cls = dfa->classmap[*p];
+		struct dfa_state *t = s->trans[cls];
+		s = t ? t : dfa_step(dfa, s, cls);
+	}
+	return s;
+}
+
+/* Match NAME against the automaton.  Return 0 if it matches, 1
+   otherwise. */
+int
+dfa_match(struct dfa *dfa, const char *name)
+{
+	return dfa_verdict(dfa, dfa_run(dfa, dfa_initial(dfa), name));
+}
+
+/* Check whether any string beginning with PREFIX can match the
+   automaton.  Return 0 if it can, and 1 if it cannot.  Negated
+   patterns match almost anything, so the answer is always 0 if there
+   are any. */
+int
+dfa_prefix_match(struct dfa *dfa, const char *prefix)
+{
+	struct dfa_state *s;
+	size_t i;
+
+	if (dfa->nneg)
+		return 0;
+	s = dfa_run(dfa, dfa_initial(dfa), prefix);
+	/* The state is alive if it can consume more characters */
+	for (i = 0; i < s->nn; i++)
+		if (dfa->node[s->nodes[i]].type == NFA_SET)
+			return 0;
+	return 1;
+}
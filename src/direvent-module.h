@@ -0,0 +1,71 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2016 Sergey Poznyakoff
+
+   Direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   Direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+/* Interface of loadable handler modules.
+
+   A module is a shared object that defines the following symbols:
+
+     direvent_module_version
+	An int variable set to DIREVENT_MODULE_VERSION (use the
+	DIREVENT_MODULE_DECLARE macro to define it).
+
+     direvent_module_run
+	Called for each event.  DATA is the pointer stored by the init
+	function (or NULL), GEN_MASK and SYS_MASK are the generic and
+	system-dependent event masks, DIR is the directory and FILE is
+	the name of the file in it.  It should return 0 on success.
+
+     direvent_module_init (optional)
+	Called once for each watcher that uses the module.  ARGC and
+	ARGV are the arguments given to the module statement after the
+	module name (ARGV[ARGC] is NULL).  The function can store a
+	pointer to its private data in *DATA.  It should return 0 on
+	success.
+
+     direvent_module_free (optional)
+	Called with the private data when the watcher is destroyed.
+
+   The functions are called from the main loop of direvent, so they
+   should return quickly. */
+
+#ifndef _DIREVENT_MODULE_H
+#define _DIREVENT_MODULE_H
+
+/* Version of the module interface */
+#define DIREVENT_MODULE_VERSION 1
+
+/* Generic (system-independent) event codes */
+#define GENEV_CREATE  0x01
+#define GENEV_WRITE   0x02
+#define GENEV_ATTRIB  0x04
+#define GENEV_DELETE  0x08
+
+typedef int (*direvent_module_init_fn) (int argc, char **argv, void **data);
+typedef int (*direvent_module_run_fn) (void *data,
+				       int gen_mask, int sys_mask,
+				       const char *dir, const char *file);
+typedef void (*direvent_module_free_fn) (void *data);
+
+#define DIREVENT_MODULE_DECLARE \
+	int direvent_module_version = DIREVENT_MODULE_VERSION
+
+extern int direvent_module_version;
+int direvent_module_init(int argc, char **argv, void **data);
+int direvent_module_run(void *data, int gen_mask, int sys_mask,
+			const char *dir, const char *file);
+void direvent_module_free(void *data);
+
+#endif
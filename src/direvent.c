@@ -133,11 +133,18 @@ debugprt(const char *fmt, ...)
 	va_end(ap);
 }
 
+/* Number of memory allocations done so far.  Resizing an allocated
+   block with erealloc does not count. */
+unsigned long alloc_count;
+/* Number of them done while processing events */
+unsigned long event_alloc_count;
+
 /* Memory allocation with error checking */
 void *
 emalloc(size_t size)
 {
 	void *p = malloc(size);
+	alloc_count++;
 	if (!p) {
 		diag(LOG_CRIT, _("not enough memory"));
 		exit(2);
@@ -149,6 +156,7 @@ void *
 ecalloc(size_t nmemb, size_t size)
 {
 	void *p = calloc(nmemb, size);
+	alloc_count++;
 	if (!p) {
 		diag(LOG_CRIT, "not enough memory");
 		exit(2);
@@ -160,6 +168,8 @@ void *
 erealloc(void *ptr, size_t size)
 {
 	void *p = realloc(ptr, size);
+	if (!ptr)
+		alloc_count++;
 	if (!p) {
 		diag(LOG_CRIT, _("not enough memory"));
 		exit(2);
@@ -177,31 +187,145 @@ estrdup(const char *str)
 	return p;
 }
 
-/* Create a full file name from directory and file name */
-char *
-mkfilename(const char *dir, const char *file)
+/* Return the length of the full file name made of DIR and FILE.  Store
+   in *PDIRLEN the number of bytes from DIR it uses. */
+static size_t
+filename_length(const char *dir, const char *file, size_t *pdirlen)
 {
-	char *tmp;
 	size_t dirlen = strlen(dir);
-	size_t fillen = strlen(file);
-	size_t len;
 
-	if (!file || file[0] == 0)
-		return strdup(dir);
+	if (file[0] == 0)
+		return *pdirlen = dirlen;
 	while (dirlen > 0 && dir[dirlen-1] == '/')
 		dirlen--;
+	*pdirlen = dirlen;
+	return dirlen + (dir[0] ? 1 : 0) + strlen(file);
+}
 
-	len = dirlen + (dir[0] ? 1 : 0) + fillen;
-	tmp = malloc(len + 1);
-	if (tmp) {
-		memcpy(tmp, dir, dirlen);
+/* Build in TMP the full file name of length LEN */
+static char *
+filename_build(char *tmp, size_t len, const char *dir, size_t dirlen,
+	       const char *file)
+{
+	memcpy(tmp, dir, dirlen);
+	if (file[0]) {
 		if (dir[0])
 			tmp[dirlen++] = '/';
-		memcpy(tmp + dirlen, file, fillen);
-		tmp[len] = 0;
+		memcpy(tmp + dirlen, file, len - dirlen);
 	}
+	tmp[len] = 0;
 	return tmp;
 }
+
+/* Create a full file name from directory and file name */
+char *
+mkfilename(const char *dir, const char *file)
+{
+	char *tmp;
+	size_t dirlen, len;
+
+	if (!file)
+		file = "";
+	len = filename_length(dir, file, &dirlen);
+	tmp = malloc(len + 1);
+	if (tmp)
+		filename_build(tmp, len, dir, dirlen, file);
+	return tmp;
+}
+
+/* Scratch arena.
+
+   Temporary strings needed while handling an event are allocated from
+   the arena, which is reset at each iteration of the main loop.  When
+   the arena runs out of space, a new chunk is added to it; at the next
+   reset all chunks are coalesced into a single one large enough to
+   hold them all.  Thus, once the arena has grown to the size needed
+   by the workload, it does not allocate any more memory.  The
+   coalesced chunk is at most SCRATCH_RETAIN_MAX bytes long, so that
+   occasional bursts (e.g. scanning a large directory tree) do not pin
+   memory for the life of the daemon. */
+
+#define SCRATCH_CHUNK_SIZE 1024
+#define SCRATCH_RETAIN_MAX (64 * 1024)
+
+union scratch_align {
+	void *p;
+	long l;
+	double d;
+};
+
+struct scratch_chunk {
+	struct scratch_chunk *next;
+	size_t size;                 /* Size of buf */
+	size_t used;                 /* Number of bytes used */
+	union scratch_align buf[1];
+};
+
+static struct scratch_chunk *scratch;
+
+static struct scratch_chunk *
+scratch_chunk_alloc(size_t size)
+{
+	struct scratch_chunk *cp = emalloc(sizeof(*cp) - sizeof(cp->buf)
+					   + size);
+	cp->next = NULL;
+	cp->size = size;
+	cp->used = 0;
+	return cp;
+}
+
+void *
+scratch_alloc(size_t size)
+{
+	void *p;
+
+	size = (size + sizeof(union scratch_align) - 1)
+		/ sizeof(union scratch_align) * sizeof(union scratch_align);
+	if (!scratch || scratch->size - scratch->used < size) {
+		size_t n = scratch ? 2 * scratch->size : SCRATCH_CHUNK_SIZE;
+		struct scratch_chunk *cp;
+
+		while (n < size)
+			n *= 2;
+		cp = scratch_chunk_alloc(n);
+		cp->next = scratch;
+		scratch = cp;
+	}
+	p = (char*) scratch->buf + scratch->used;
+	scratch->used += size;
+	return p;
+}
+
+void
+scratch_reset(void)
+{
+	size_t size = 0;
+
+	if (!scratch)
+		return;
+	if (!scratch->next && scratch->size <= SCRATCH_RETAIN_MAX) {
+		scratch->used = 0;
+		return;
+	}
+	while (scratch) {
+		struct scratch_chunk *next = scratch->next;
+		size += scratch->size;
+		free(scratch);
+		scratch = next;
+	}
+	if (size > SCRATCH_RETAIN_MAX)
+		size = SCRATCH_RETAIN_MAX;
+	scratch = scratch_chunk_alloc(size);
+}
+
+/* Create a full file name from directory and file name in the scratch
+   arena */
+char *
+scratch_filename(const char *dir, const char *file)
+{
+	size_t dirlen, len = filename_length(dir, file, &dirlen);
+	return filename_build(scratch_alloc(len + 1), len, dir, dirlen, file);
+}
 
 int
 trans_strtotok(struct transtab *tab, const char *str, int *ret)
@@ -262,7 +386,7 @@ void
 signal_setup(void (*sf) (int))
 {
 	static int sigv[] = { SIGTERM, SIGQUIT, SIGINT, SIGHUP, SIGALRM,
-			      SIGUSR1, SIGUSR1, SIGCHLD };
+			      SIGUSR1, SIGUSR2, SIGCHLD, SIGPIPE };
 	sigv_set_all(sf, NITEMS(sigv), sigv, NULL);
 }
 
@@ -386,11 +510,13 @@ genev_init()
 	for (i = 0; i < genev_xlat[i].gen_mask; i++)
 		defevt(trans_toktostr(genev_transtab, genev_xlat[i].gen_mask),
 		       &genev_xlat[i], 0);
+	sysev_xlat_init();
 }
 	
 
 int signo = 0;
 int stop = 0;
+static int report_requested;
 
 pid_t self_test_pid;
 int exit_code = 0;
@@ -402,12 +528,30 @@ sigmain(int sig)
 	switch (signo) {
 	case SIGCHLD:
 	case SIGALRM:
+	case SIGPIPE:
+		break;
+	case SIGUSR2:
+		report_requested = 1;
 		break;
 	default:
 		stop = 1;
 	}
 }
 
+/* Log the run-time statistics */
+static void
+stats_report(void)
+{
+	diag(LOG_INFO,
+	     _("memory allocations: %lu total, %lu while processing events"),
+	     alloc_count, event_alloc_count);
+	handler_stats_report();
+	dirfd_stats_report();
+	job_stats_report();
+	action_stats_report();
+	ratelimit_stats_report();
+}
+
 void
 self_test()
 {
@@ -535,12 +679,26 @@ main(int argc, char **argv)
 		self_test();
 	
 	/* Main loop */
-	while (!stop && sysev_select() == 0) {
-		process_timeouts();
+	while (!stop) {
+		unsigned long n = alloc_count;
+		int rc = sysev_select();
+		event_alloc_count += alloc_count - n;
+		if (rc)
+			break;
+		scratch_reset();
+		timer_run();
 		process_cleanup(0);
 		watchpoint_gc();
+		if (report_requested) {
+			report_requested = 0;
+			stats_report();
+		}
 	}
 
+	/* Run the events collected so far */
+	batch_flush_all();
+	/* Don't lose the output of the handlers that are still running */
+	redirector_flush_all();
 	shutdown_watchers();
 
 	diag(LOG_INFO, _("%s %s stopped"), program_name, VERSION);
@@ -22,31 +22,42 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <signal.h>
 #include <regex.h>
 #include <grecs/list.h>
 #include <grecs/symtab.h>
 #include "gettext.h"
+#include "direvent-module.h"
 
 #define _(s) gettext(s)
 #define N_(s) s
 
-/* Generic (system-independent) event codes */
-#define GENEV_CREATE  0x01
-#define GENEV_WRITE   0x02
-#define GENEV_ATTRIB  0x04
-#define GENEV_DELETE  0x08
+/* Number of bits in an event mask */
+#define EVT_BITS (sizeof(int) * 8)
 
 /* Handler flags. */
 #define HF_NOWAIT  0x01   /* Don't wait for termination */
 #define HF_STDOUT  0x02   /* Capture stdout */
 #define HF_STDERR  0x04   /* Capture stderr */
 #define HF_SHELL   0x08   /* Call program via /bin/sh -c */ 
+#define HF_COPROC  0x10   /* Feed events to persistent workers */
+#define HF_SINGLE  0x20   /* One invocation per file at a time */
+#define HF_STAT    0x40   /* Handler needs the status of the file */
+#define HF_COUNT   0x80   /* Handler runs can stand for several events */
 
 #ifndef DEFAULT_TIMEOUT
 # define DEFAULT_TIMEOUT 5
 #endif
 
+#ifndef DEFAULT_BATCH_DELAY
+# define DEFAULT_BATCH_DELAY 1
+#endif
+
+#ifndef DEFAULT_COPY_MAX
+# define DEFAULT_COPY_MAX (64 * 1024 * 1024)
+#endif
+
 typedef struct {
 	int gen_mask;        /* Generic event mask */
 	int sys_mask;        /* System event mask */
@@ -67,13 +78,21 @@ enum pattern_type {
 struct filename_pattern {
 	enum pattern_type type;
 	int neg;
+	int compiled;            /* Pattern is handled by the automaton */
+	int path;                /* Pattern is matched against the relative
+				    pathname */
 	union {
-		regex_t re;
+		struct {
+			regex_t re;      /* Compiled regexp */
+			char *expr;      /* Its source text */
+			int flags;       /* Compilation flags */
+		} rx;
 		char *glob;
 	} v;
 };
 
 typedef struct filpatlist *filpatlist_t;
+typedef struct filpredlist *filpredlist_t;
 
 struct watchpoint;
 
@@ -84,18 +103,54 @@ typedef int (*event_handler_fn) (struct watchpoint *wp,
 				 void *data);
 typedef void (*handler_free_fn) (void *data);
 
+/* Event sampling.  Of the events matching a handler, only one in RATE
+   is delivered, and not more often than once in INTERVAL seconds.
+   Zero values mean no limit. */
+struct sampler {
+	unsigned rate;        /* Deliver one event out of this many */
+	time_t interval;      /* Minimal interval between deliveries */
+	unsigned long count;  /* Events since the last delivery */
+	time_t last;          /* Time of the last delivery */
+};
+
+/* Rate limiting (see ratelimit.c).  Events are delivered to a handler
+   at most RATE per PERIOD milliseconds, with bursts of up to BURST
+   events. */
+#define RL_SCOPE_WATCHER   0  /* One bucket per handler */
+#define RL_SCOPE_DIRECTORY 1  /* One bucket per directory */
+#define RL_SCOPE_FILE      2  /* One bucket per file */
+
+#define RL_DROP     0         /* Drop events over the limit */
+#define RL_DEFER    1         /* Defer them */
+#define RL_COALESCE 2         /* Coalesce them into a summary event */
+
+#define RATELIMIT_QUEUE_SIZE 128
+
+struct ratelimit_conf {
+	unsigned long rate;   /* Number of tokens ... */
+	unsigned long period; /* ... added per this many milliseconds */
+	unsigned long burst;  /* Bucket size */
+	int scope;            /* Scope of the buckets (RL_SCOPE_*) */
+	int mode;             /* What to do with excess events (RL_*) */
+	size_t queue_size;    /* Max. number of deferred events per bucket */
+};
+
+struct ratelimit;
+
 /* Handler structure */
 struct handler {
 	size_t refcnt;        /* Reference counter */
 	event_mask ev_mask;   /* Event mask */
 	filpatlist_t fnames;  /* File name patterns */
+	filpredlist_t fpreds; /* File metadata predicates */
+	struct sampler sample; /* Event sampling */
+	struct ratelimit *ratelimit; /* Rate limiter, or NULL */
 	event_handler_fn run;
 	handler_free_fn free;
 	void *data;
 };
 
 typedef struct handler_list *handler_list_t;
-typedef struct handler_iterator *handler_iterator_t;
 
 /* Watchpoint links the directory being monitored and a list of
    handlers for various events: */
@@ -108,39 +163,99 @@ struct watchpoint {
 	int isdir;                           /* Is it directory */
 	handler_list_t handler_list;         /* List of handlers */
 	int depth;                           /* Recursion depth */
-	char *split_p;                       /* Points to the deleted directory
-						separator in dirname (see
-						split_pathname,
-						unsplit_pathname */
+	int dirfd;                           /* Cached directory descriptor,
+						or -1 (see watchpoint_dirfd) */
+	struct watchpoint *dirfd_prev;       /* Links in the LRU list of */
+	struct watchpoint *dirfd_next;       /* cached descriptors */
 #if USE_IFACE == IFACE_KQUEUE
 	mode_t file_mode;
 	time_t file_ctime;
 #endif
 };
 
-#define __cat2__(a,b) a ## b
-#define handler_matches_event(h,m,f,n)		\
-	(((h)->ev_mask.__cat2__(m,_mask) & (f)) &&	\
-	 filpatlist_match((h)->fnames, n) == 0)
-
 struct handler *handler_alloc(event_mask ev_mask);
 void handler_free(struct handler *hp);
 
+struct batch;
+
 struct prog_handler {
 	int flags;     /* Handler flags */
 	char *command; /* Handler command (with eventual arguments) */
 	uid_t uid;     /* Run as this user (unless 0) */
 	gid_t *gidv;   /* Run with these groups' privileges */
 	size_t gidc;   /* Number of elements in gidv */
-	unsigned timeout; /* Handler timeout */
+	unsigned timeout; /* Handler timeout (ms) */
 	char **env;    /* Environment */
+	unsigned max_running; /* Max. number of running instances (0 - no
+				 limit) */
+	unsigned running; /* Number of running instances */
+	unsigned queued;  /* Number of queued invocations */
+	unsigned batch_max;   /* Max. number of events in a batch (0 -
+				 no batching) */
+	unsigned batch_delay; /* Max. delay of a batch (ms) */
+	struct batch *batch;  /* Batch being collected */
+	struct template *tmpl; /* Compiled command and environment, or NULL
+				  if it is expanded on each run */
+	int priority;         /* Priority class (PRIO_*) */
 };
 
 struct handler *prog_handler_alloc(event_mask ev_mask, filpatlist_t fpat,
+				   filpredlist_t fpred,
 				   struct prog_handler *p);
 void prog_handler_free(struct prog_handler *);
 size_t prog_handler_envrealloc(struct prog_handler *hp, size_t count);
 
+/* Built-in actions */
+enum action_type {
+	ACTION_NONE,
+	ACTION_MOVE,   /* Move the file to a directory */
+	ACTION_COPY,   /* Copy the file to a directory */
+	ACTION_LINK,   /* Link the file into a directory */
+	ACTION_APPEND, /* Append the file name to a file */
+	ACTION_TOUCH   /* Update modification time of a file */
+};
+
+struct action {
+	enum action_type type;
+	char *arg;     /* Destination directory or file */
+	int fd;        /* Its descriptor, or -1 if not open */
+	dev_t dev;     /* Device and inode of the file opened for append */
+	ino_t ino;
+};
+
+enum action_type action_lookup(const char *name);
+struct handler *action_handler_alloc(event_mask ev_mask, filpatlist_t fpat,
+				     filpredlist_t fpred,
+				     struct action *ap);
+void action_stats_report(void);
+
+extern unsigned long long action_copy_max;
+
+/* Loadable modules */
+struct module {
+	char *path;          /* Shared object file name */
+	size_t argc;         /* Number of arguments */
+	char **argv;         /* Arguments */
+	void *dlh;           /* Handle returned by dlopen */
+	direvent_module_run_fn run;   /* Entry points */
+	direvent_module_free_fn free;
+	void *data;          /* Instance data */
+};
+
+int module_load(struct module *mp, const char **errmsg);
+void module_free(struct module *mp);
+struct handler *module_handler_alloc(event_mask ev_mask, filpatlist_t fpat,
+				     filpredlist_t fpred,
+				     struct module *mp);
+
+struct ratelimit *ratelimit_create(struct handler *hp,
+				   struct ratelimit_conf const *conf);
+void ratelimit_free(struct ratelimit *rl);
+int ratelimit_check(struct handler *hp, event_mask *event,
+		    const char *dirname, const char *file,
+		    unsigned long count);
+void ratelimit_stats_report(void);
+
 
 extern int foreground;
 extern int debug_level;
@@ -165,6 +280,10 @@ char *estrdup(const char *str);
 
 char *mkfilename(const char *dir, const char *file);
 
+void *scratch_alloc(size_t size);
+void scratch_reset(void);
+char *scratch_filename(const char *dir, const char *file);
+
 void diag(int prio, const char *fmt, ...);
 void debugprt(const char *fmt, ...);
 
@@ -185,6 +304,8 @@ int defevt(const char *name, event_mask *mask, int line);
 int getevt(const char *name, event_mask *mask);
 int evtnullp(event_mask *mask);
 event_mask *event_mask_init(event_mask *m, int fflags, event_mask const *);
+void sysev_xlat_init(void);
+int sysev_to_genev(int sys);
 void evtsetall(event_mask *m);
 
 /* Translate generic events to system ones and vice-versa */
@@ -218,16 +339,23 @@ void watchpoint_unref(struct watchpoint *dw);
 void watchpoint_gc(void);
 
 int watchpoint_pattern_match(struct watchpoint *dwp, const char *file_name);
+int watchpoint_subtree_match(struct watchpoint *wpt, const char *name);
 
 void watchpoint_run_handlers(struct watchpoint *wp, int evflags,
 			      const char *dirname, const char *filename);
+void handler_stats_report(void);
 
 
 void setup_watchers(void);
 void shutdown_watchers(void);
 
 struct watchpoint *watchpoint_lookup(const char *dirname);
-int check_new_watcher(const char *dir, const char *name);
+int check_new_watcher(struct watchpoint *parent, const char *name, int isdir);
+
+#define DIRFD_CACHE_SIZE 64
+extern unsigned dirfd_cache_size;
+int watchpoint_dirfd(struct watchpoint *wpt);
+void dirfd_stats_report(void);
 struct watchpoint *watchpoint_install(const char *path, int *pnew);
 struct watchpoint *watchpoint_install_ptr(struct watchpoint *dw);
 void watchpoint_suspend(struct watchpoint *dwp);
@@ -236,8 +364,7 @@ int watchpoint_install_sentinel(struct watchpoint *dwp);
 
 int watch_pathname(struct watchpoint *parent, const char *dirname, int isdir, int notify);
 
-char *split_pathname(struct watchpoint *dp, char **dirname);
-void unsplit_pathname(struct watchpoint *dp);
+const char *split_pathname(struct watchpoint *dp, const char **dirname);
 
 void ev_log(int flags, struct watchpoint *dp);
 void deliver_ev_create(struct watchpoint *dp,
@@ -245,16 +372,10 @@ void deliver_ev_create(struct watchpoint *dp,
 int subwatcher_create(struct watchpoint *parent, const char *dirname,
 		      int notify);
 
-struct handler *handler_itr_first(struct watchpoint *dp,
-				       handler_iterator_t *itr);
-struct handler *handler_itr_next(handler_iterator_t *itr);
-struct handler *handler_itr_current(handler_iterator_t itr);
+struct handler *handler_list_item(handler_list_t hlist, size_t n);
 
-#define for_each_handler(d,i,h)				\
-	for (h = handler_itr_first(d, &(i));	\
-	     h;						\
-	     h = handler_itr_next(&(i)))
-	
+#define for_each_handler(d,i,h)					\
+	for (i = 0; (h = handler_list_item((d)->handler_list, i)) != NULL; i++)
 
 handler_list_t handler_list_create(void);
 handler_list_t handler_list_copy(handler_list_t);
@@ -266,8 +387,83 @@ size_t handler_list_size(handler_list_t hlist);
 
 struct process *process_lookup(pid_t pid);
 void process_cleanup(int expect_term);
-void process_timeouts(void);
-char **environ_setup(char **hint, char **kve);
+void redirector_flush_all(void);
+int redirector_wait(int fd, int timeout);
+
+/* timer.c */
+typedef uint64_t timer_msec_t;
+
+struct timer {
+	struct timer *next, *prev;
+	timer_msec_t expires;   /* Expiration time (monotonic, ms) */
+	int level, slot;        /* Location in the timer wheel */
+	int active;             /* True if the timer is armed */
+	void (*func)(struct timer *); /* Function to call on expiration */
+	void *data;             /* Data for it */
+};
+
+timer_msec_t timer_now(void);
+void timer_set(struct timer *t, unsigned long msec,
+	       void (*func)(struct timer *), void *data);
+void timer_cancel(struct timer *t);
+void timer_run(void);
+int timer_next(void);
+
+#define JOB_QUEUE_SIZE 1024
+extern unsigned max_handlers;
+extern unsigned job_queue_size;
+
+/* Priority classes of handlers */
+#define PRIO_HIGH   0
+#define PRIO_NORMAL 1
+#define PRIO_LOW    2
+#define PRIO_COUNT  3
+
+extern struct transtab prio_transtab[];
+
+/* Job schedulers */
+#define SCHED_STRICT   0  /* Strict priority */
+#define SCHED_WEIGHTED 1  /* Weighted round-robin among the classes */
+
+extern int job_scheduler;
+extern unsigned job_class_weight[PRIO_COUNT];
+void job_stats_report(void);
+void batch_flush_all(void);
+/* Redirector codes */
+#define REDIR_OUT 0
+#define REDIR_ERR 1
+
+/* Parameters of a process to spawn */
+struct spawn_params {
+	uid_t uid;                  /* Run with these privileges */
+	size_t gidc;                /* Supplementary groups */
+	gid_t *gidv;
+	const char *dirname;        /* Working directory */
+	int dirfd;                  /* Its descriptor or -1 */
+	int fd[2];                  /* Descriptors for stdout and stderr,
+				       indexed by REDIR_ codes (-1 if
+				       not redirected) */
+	int fd_in;                  /* Descriptor for stdin (-1 if
+				       closed) */
+	char **argv;                /* Command line */
+	char **env;                 /* Environment */
+};
+
+pid_t spawn_process(struct spawn_params *sp, const char *command);
+
+char **environ_setup(char **hint, char **kve, int flags);
+void environ_free(char **env);
+
+struct wordsplit;
+struct template;
+int command_expand(const char *command, int shell, char **kve,
+		   struct wordsplit *ws);
+const char *command_check(const char *command, int shell);
+struct template *template_compile(const char *command, int flags,
+				  char **hint);
+void template_fill(struct template *tp, char **kve, char ***argv,
+		   char ***env);
+void template_free(struct template *tp);
 
 #define NITEMS(a) ((sizeof(a)/sizeof((a)[0])))
 struct sigtab {
@@ -288,4 +484,59 @@ void filpatlist_add_exact(filpatlist_t *fptr, char const *arg);
 void filpatlist_destroy(filpatlist_t *fptr);
 int filpatlist_match(filpatlist_t fp, const char *name);
 int filpatlist_is_empty(filpatlist_t fp);
+int filpatlist_is_pathscope(filpatlist_t fp);
+int filpatlist_prefix_match(filpatlist_t fp, const char *dir);
+void filpatlist_compile(filpatlist_t fp);
+
+/* Kinds of literal patterns */
+#define FPL_EXACT  0     /* Exact name */
+#define FPL_PREFIX 1     /* LIT* */
+#define FPL_SUFFIX 2     /* *LIT */
+
+int filpatlist_literals(filpatlist_t fp,
+			void (*fn)(int, char const *, size_t, void *),
+			void *data);
+
+/* File types for filpred_add_type */
+#define FILPRED_T_REG  0x01
+#define FILPRED_T_DIR  0x02
+#define FILPRED_T_LNK  0x04
+#define FILPRED_T_FIFO 0x08
+#define FILPRED_T_SOCK 0x10
+#define FILPRED_T_CHR  0x20
+#define FILPRED_T_BLK  0x40
+
+/* Comparison operators for filpred_add_size */
+#define FILPRED_OP_EQ 0
+#define FILPRED_OP_NE 1
+#define FILPRED_OP_LT 2
+#define FILPRED_OP_LE 3
+#define FILPRED_OP_GT 4
+#define FILPRED_OP_GE 5
+
+struct stat;
+int filpred_type_code(char const *name, int *ret);
+int filpred_op_code(char const *name, int *ret);
+void filpred_add_type(filpredlist_t *fptr, int types);
+void filpred_add_size(filpredlist_t *fptr, int op, off_t size);
+void filpred_add_owner(filpredlist_t *fptr, size_t uidc, uid_t *uidv);
+void filpred_add_older(filpredlist_t *fptr, time_t age);
+void filpredlist_destroy(filpredlist_t *fptr);
+int filpredlist_match(filpredlist_t fp, struct stat const *st);
+
+struct stat const *event_file_stat(void);
+unsigned long event_sample_count(void);
+void handler_deliver(struct handler *hp, event_mask *event,
+		     const char *dirname, const char *filename,
+		     unsigned long count);
+
+struct dfa;
+struct dfa *dfa_create(void);
+void dfa_free(struct dfa *dfa);
+int dfa_add_exact(struct dfa *dfa, const char *str, int neg);
+int dfa_add_glob(struct dfa *dfa, const char *str, int neg, int pathscope);
+int dfa_add_regex(struct dfa *dfa, const char *str, int cflags, int neg);
+size_t dfa_count(struct dfa *dfa);
+int dfa_match(struct dfa *dfa, const char *name);
+int dfa_prefix_match(struct dfa *dfa, const char *prefix);
 
@@ -109,22 +109,65 @@ env_concat(const char *name, size_t namelen, const char *a, const char *b)
 	return res;
 }
 
-static char *defenv[] = {
-	"DIREVENT_SYSEV_CODE=${sysev_code}",
-	"DIREVENT_SYSEV_NAME=${sysev_name}",
-	"DIREVENT_GENEV_CODE=${genev_code}",
-	"DIREVENT_GENEV_NAME=${genev_name}",
-	"DIREVENT_FILE=${file}",
-	NULL
+/* Variables added to the environment of each handler.  A variable
+   with a non-zero FLAGS is added only if the handler has all these
+   flags set. */
+static struct defenv {
+	char *var;
+	int flags;
+} defenv[] = {
+	{ "DIREVENT_SYSEV_CODE=${sysev_code}" },
+	{ "DIREVENT_SYSEV_NAME=${sysev_name}" },
+	{ "DIREVENT_GENEV_CODE=${genev_code}" },
+	{ "DIREVENT_GENEV_NAME=${genev_name}" },
+	{ "DIREVENT_FILE=${file}" },
+	{ "DIREVENT_FILE_SIZE=${file_size}", HF_STAT },
+	{ "DIREVENT_FILE_MTIME=${file_mtime}", HF_STAT },
+	{ "DIREVENT_FILE_INODE=${file_inode}", HF_STAT },
+	{ "DIREVENT_SAMPLE_COUNT=${sample_count}", HF_COUNT },
+	{ NULL }
 };
 
+/* Free the environment ENV created by environ_setup.  Its entries
+   that come from the direvent environment are left intact. */
+void
+environ_free(char **env)
+{
+	size_t i, j;
+
+	if (!env)
+		return;
+	for (i = 0; env[i]; i++) {
+		for (j = 0; environ[j]; j++)
+			if (env[i] == environ[j])
+				break;
+		if (!environ[j])
+			free(env[i]);
+	}
+	free(env);
+}
+
+static char **
+environ_abort(char **env, struct wordsplit *ws, int wsflags)
+{
+	environ_free(env);
+	if (wsflags & WRDSF_REUSE)
+		wordsplit_free(ws);
+	return NULL;
+}
+
+/* Create the environment for a handler.  HINT is the list of
+   environment modifications from the configuration and KVE is the
+   list of macros to expand in it.  FLAGS are the handler flags (HF_*),
+   which select the variables from defenv.  Return NULL on error.  The
+   returned environment should be freed using environ_free. */
 char **
-environ_setup(char **hint, char **kve)
+environ_setup(char **hint, char **kve, int flags)
 {
 	char *empty[1] = { NULL };
 	char **old_env = environ;
 	char **new_env;
-	char **addenv = defenv;
+	struct defenv *addenv = defenv;
 	char *var;
 	size_t count, i, j, n;
 	struct wordsplit ws;
@@ -138,7 +181,7 @@ environ_setup(char **hint, char **kve)
 	else if (strcmp(hint[0], "-") == 0 || strcmp(hint[0], "--") == 0) {
 		old_env = NULL;
 		if (hint[0][1] == '-')
-			addenv = empty;
+			addenv = NULL;
 		hint++;
         }
 	
@@ -148,8 +191,9 @@ environ_setup(char **hint, char **kve)
 		for (i = 0; old_env[i]; i++)
 			count++;
 
-	for (i = 0; addenv[i]; i++)
-		count++;
+	if (addenv)
+		for (i = 0; addenv[i].var; i++)
+			count++;
 	
 	for (i = 0; hint[i]; i++)
 		count++;
@@ -169,12 +213,14 @@ environ_setup(char **hint, char **kve)
 				new_env[n++] = old_env[i];
 		}
 
-	for (i = 0; addenv[i]; i++)
-		if (!var_is_unset(hint, addenv[i])) {
-			if (wordsplit(addenv[i], &ws, wsflags)) {
-				diag(LOG_CRIT, "wordsplit: %s",
+	for (i = 0; addenv && addenv[i].var; i++)
+		if ((addenv[i].flags & flags) == addenv[i].flags
+		    && !var_is_unset(hint, addenv[i].var)) {
+			if (wordsplit(addenv[i].var, &ws, wsflags)) {
+				diag(LOG_ERR, "wordsplit: %s",
 				     wordsplit_strerror(&ws));
-				_exit(127);
+				new_env[n] = NULL;
+				return environ_abort(new_env, &ws, wsflags);
 			}
 			wsflags |= WRDSF_REUSE;
 			new_env[n++] = estrdup(ws.ws_wordv[0]);
@@ -189,9 +235,10 @@ environ_setup(char **hint, char **kve)
 		}
 
 		if (wordsplit(hint[i], &ws, wsflags)) {
-			diag(LOG_CRIT, "wordsplit: %s",
+			diag(LOG_ERR, "wordsplit: %s",
 			     wordsplit_strerror(&ws));
-			_exit(127);
+			new_env[n] = NULL;
+			return environ_abort(new_env, &ws, wsflags);
 		}
 		wsflags |= WRDSF_REUSE;
 		var = ws.ws_wordv[0];
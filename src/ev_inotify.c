@@ -138,19 +138,13 @@ sysev_rm_watch(struct watchpoint *wpt)
 	inotify_rm_watch(ifd, wpt->wd);
 }
 
-/* Remove a watcher identified by its directory and file name */
-void
-remove_watcher(const char *dir, const char *name)
+/* Remove a watcher identified by its parent and file name */
+static void
+remove_watcher(struct watchpoint *parent, const char *name)
 {
 	struct watchpoint *wpt;
-	char *fullname = mkfilename(dir, name);
-	if (!fullname) {
-		diag(LOG_EMERG, "not enough memory: "
-		     "cannot look up a watcher to delete");
-		return;
-	}
-	wpt = watchpoint_lookup(fullname);
-	free(fullname);
+
+	wpt = watchpoint_lookup(scratch_filename(parent->dirname, name));
 	if (wpt)
 		watchpoint_suspend(wpt);
 }
@@ -159,7 +153,7 @@ static void
 process_event(struct inotify_event *ep)
 {
 	struct watchpoint *wpt;
-	char *dirname, *filename;
+	const char *dirname, *filename;
 	
 	wpt = wpget(ep->wd);
 	if (!wpt) {
@@ -200,7 +194,7 @@ process_event(struct inotify_event *ep)
 
 	if (ep->mask & IN_CREATE) {
 		debug(1, ("%s/%s created", wpt->dirname, ep->name));
-		if (check_new_watcher(wpt->dirname, ep->name) > 0)
+		if (check_new_watcher(wpt, ep->name, ep->mask & IN_ISDIR) > 0)
 			return;
 	}
 
@@ -212,12 +206,10 @@ process_event(struct inotify_event *ep)
 	}
 
 	watchpoint_run_handlers(wpt, ep->mask, dirname, filename);
-	
-	unsplit_pathname(wpt);
 
 	if (ep->mask & (IN_DELETE|IN_MOVED_FROM)) {
 		debug(1, ("%s/%s deleted", wpt->dirname, ep->name));
-		remove_watcher(wpt->dirname, ep->name);
+		remove_watcher(wpt, ep->name);
 	}
 }	
 
@@ -228,11 +220,17 @@ sysev_select()
 	struct inotify_event *ep;
 	size_t size;
 	ssize_t rdbytes;
-
-	rdbytes = read(ifd, buffer, sizeof(buffer));
+	int rc;
+
+	/* Log the handler output while waiting for events or for the
+	   nearest timer to expire */
+	rc = redirector_wait(ifd, timer_next());
+	if (rc == 1)
+		return 0;
+	rdbytes = rc == 0 ? read(ifd, buffer, sizeof(buffer)) : -1;
 	if (rdbytes == -1) {
 		if (errno == EINTR) {
-			if (!signo || signo == SIGCHLD || signo == SIGALRM)
+			if (!stop)
 				return 0;
 			diag(LOG_NOTICE, "got signal %d", signo);
 			return 1;
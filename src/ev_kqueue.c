@@ -63,9 +63,9 @@ int
 sysev_filemask(struct watchpoint *dp)
 {
 	struct handler *h;
-	handler_iterator_t itr;
+	size_t i;
 
-	for_each_handler(dp, itr, h) {
+	for_each_handler(dp, i, h) {
 		if (h->ev_mask.sys_mask)
 			return S_IFMT;
 	}
@@ -159,7 +159,7 @@ check_created(struct watchpoint *dp)
 			continue;
 		}
 
-		if (stat(pathname, &st)) {
+		if (fstatat(dirfd(dir), ent->d_name, &st, 0)) {
 			diag(LOG_ERR, "cannot stat %s: %s",
 			     pathname, strerror(errno));
 		/* If ok, first see if the file is newer than the last
@@ -184,7 +184,7 @@ static void
 process_event(struct kevent *ep)
 {
 	struct watchpoint *dp = ep->udata;
-	char *filename, *dirname;
+	const char *filename, *dirname;
 	
 	if (!dp) {
 		diag(LOG_NOTICE, "unrecognized event %x", ep->fflags);
@@ -204,8 +204,6 @@ process_event(struct kevent *ep)
 	filename = split_pathname(dp, &dirname);
 
 	watchpoint_run_handlers(dp, ep->fflags, dirname, filename);
-
-	unsplit_pathname(dp);
 	
 	if (ep->fflags & (NOTE_DELETE|NOTE_RENAME)) {
 		debug(1, ("%s deleted", dp->dirname));
@@ -217,13 +215,23 @@ process_event(struct kevent *ep)
 int
 sysev_select()
 {
+	static struct timespec ts0;
 	int i, n;
 	
 	chclosed_elim();
-	n = kevent(kq, chtab, chcnt, evtab, chcnt, NULL);
+	/* Apply the pending changes, then log the handler output while
+	   waiting for events or for the nearest timer to expire */
+	n = kevent(kq, chtab, chcnt, NULL, 0, &ts0);
+	if (n != -1) {
+		n = redirector_wait(kq, timer_next());
+		if (n == 1)
+			return 0;
+		if (n == 0)
+			n = kevent(kq, NULL, 0, evtab, chcnt, NULL);
+	}
 	if (n == -1) {
 		if (errno == EINTR) {
-			if (signo == 0 || signo == SIGCHLD || signo == SIGALRM)
+			if (!stop)
 				return 0;
 			diag(LOG_NOTICE, "got signal %d", signo);
 		}
@@ -15,6 +15,7 @@
    with direvent. If not, see <http://www.gnu.org/licenses/>. */
 
 #include "direvent.h"
+#include <strings.h>
 
 
 struct symevt {
@@ -130,16 +131,36 @@ struct transtab genev_transtab[] = {
 	{ NULL }
 };
 
+/* Generic events corresponding to each system event bit */
+static int sysev_genev[EVT_BITS];
+
+void
+sysev_xlat_init(void)
+{
+	int i, b;
+
+	for (i = 0; i < genev_xlat[i].gen_mask; i++)
+		for (b = 0; b < EVT_BITS; b++)
+			if ((unsigned) genev_xlat[i].sys_mask & (1U << b))
+				sysev_genev[b] |= genev_xlat[i].gen_mask;
+}
+
+/* Translate system event mask SYS into the generic one */
+int
+sysev_to_genev(int sys)
+{
+	int gen = 0;
+
+	for (; sys; sys &= sys - 1)
+		gen |= sysev_genev[ffs(sys) - 1];
+	return gen;
+}
+
 event_mask *
 event_mask_init(event_mask *m, int fflags, event_mask const *req)
 {
-	int i;
-
 	m->sys_mask = fflags & req->sys_mask;
-	m->gen_mask = 0;
-	for (i = 0; i < genev_xlat[i].gen_mask; i++)
-		if (genev_xlat[i].sys_mask & m->sys_mask)
-			m->gen_mask |= genev_xlat[i].gen_mask;
+	m->gen_mask = sysev_to_genev(m->sys_mask);
 	if (req->gen_mask)
 		m->gen_mask &= req->gen_mask;
 	return m;
@@ -0,0 +1,232 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2016 Sergey Poznyakoff
+
+   Direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   Direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+/* File metadata predicates.
+
+   A predicate list selects files by their type, size, owner and age.
+   A file matches the list if it matches all predicates in it. */
+
+#include "direvent.h"
+#include <sys/stat.h>
+#include <time.h>
+
+enum filpred_type {
+	FILPRED_TYPE,          /* File type is one of the given ones */
+	FILPRED_SIZE,          /* File size compares to the given value */
+	FILPRED_OWNER,         /* File is owned by one of the given users */
+	FILPRED_OLDER          /* File was modified long enough ago */
+};
+
+struct filpred {
+	struct filpred *next;
+	enum filpred_type type;
+	union {
+		int types;                   /* FILPRED_TYPE: bitmask of
+						FILPRED_T_ constants */
+		struct {
+			int op;              /* FILPRED_OP_ constant */
+			off_t size;
+		} size;                      /* FILPRED_SIZE */
+		struct {
+			size_t uidc;
+			uid_t *uidv;
+		} owner;                     /* FILPRED_OWNER */
+		time_t age;                  /* FILPRED_OLDER */
+	} v;
+};
+
+struct filpredlist {
+	struct filpred *head, *tail;
+};
+
+static struct transtab kwtype[] = {
+	{ "regular",   FILPRED_T_REG },
+	{ "directory", FILPRED_T_DIR },
+	{ "symlink",   FILPRED_T_LNK },
+	{ "fifo",      FILPRED_T_FIFO },
+	{ "socket",    FILPRED_T_SOCK },
+	{ "char",      FILPRED_T_CHR },
+	{ "block",     FILPRED_T_BLK },
+	{ NULL }
+};
+
+static struct transtab kwop[] = {
+	{ "=",  FILPRED_OP_EQ },
+	{ "!=", FILPRED_OP_NE },
+	{ "<",  FILPRED_OP_LT },
+	{ "<=", FILPRED_OP_LE },
+	{ ">",  FILPRED_OP_GT },
+	{ ">=", FILPRED_OP_GE },
+	{ NULL }
+};
+
+int
+filpred_type_code(char const *name, int *ret)
+{
+	return trans_strtotok(kwtype, name, ret);
+}
+
+int
+filpred_op_code(char const *name, int *ret)
+{
+	return trans_strtotok(kwop, name, ret);
+}
+
+static struct filpred *
+filpred_new(filpredlist_t *fptr, enum filpred_type type)
+{
+	struct filpred *pred = ecalloc(1, sizeof(*pred));
+
+	pred->type = type;
+	if (!*fptr)
+		*fptr = ecalloc(1, sizeof(**fptr));
+	if ((*fptr)->tail)
+		(*fptr)->tail->next = pred;
+	else
+		(*fptr)->head = pred;
+	(*fptr)->tail = pred;
+	return pred;
+}
+
+void
+filpred_add_type(filpredlist_t *fptr, int types)
+{
+	filpred_new(fptr, FILPRED_TYPE)->v.types = types;
+}
+
+void
+filpred_add_size(filpredlist_t *fptr, int op, off_t size)
+{
+	struct filpred *pred = filpred_new(fptr, FILPRED_SIZE);
+	pred->v.size.op = op;
+	pred->v.size.size = size;
+}
+
+void
+filpred_add_owner(filpredlist_t *fptr, size_t uidc, uid_t *uidv)
+{
+	struct filpred *pred = filpred_new(fptr, FILPRED_OWNER);
+	pred->v.owner.uidc = uidc;
+	pred->v.owner.uidv = uidv;
+}
+
+void
+filpred_add_older(filpredlist_t *fptr, time_t age)
+{
+	filpred_new(fptr, FILPRED_OLDER)->v.age = age;
+}
+
+void
+filpredlist_destroy(filpredlist_t *fptr)
+{
+	if (fptr && *fptr) {
+		struct filpred *pred = (*fptr)->head;
+		while (pred) {
+			struct filpred *next = pred->next;
+			if (pred->type == FILPRED_OWNER)
+				free(pred->v.owner.uidv);
+			free(pred);
+			pred = next;
+		}
+		free(*fptr);
+		*fptr = NULL;
+	}
+}
+
+static int
+file_type_bit(mode_t mode)
+{
+	switch (mode & S_IFMT) {
+	case S_IFREG:
+		return FILPRED_T_REG;
+	case S_IFDIR:
+		return FILPRED_T_DIR;
+	case S_IFLNK:
+		return FILPRED_T_LNK;
+	case S_IFIFO:
+		return FILPRED_T_FIFO;
+	case S_IFSOCK:
+		return FILPRED_T_SOCK;
+	case S_IFCHR:
+		return FILPRED_T_CHR;
+	case S_IFBLK:
+		return FILPRED_T_BLK;
+	}
+	return 0;
+}
+
+static int
+size_compare(int op, off_t a, off_t b)
+{
+	switch (op) {
+	case FILPRED_OP_EQ:
+		return a == b;
+	case FILPRED_OP_NE:
+		return a != b;
+	case FILPRED_OP_LT:
+		return a < b;
+	case FILPRED_OP_LE:
+		return a <= b;
+	case FILPRED_OP_GT:
+		return a > b;
+	case FILPRED_OP_GE:
+		return a >= b;
+	}
+	return 0;
+}
+
+static int
+filpred_eval(struct filpred *pred, struct stat const *st)
+{
+	size_t i;
+
+	switch (pred->type) {
+	case FILPRED_TYPE:
+		return (pred->v.types & file_type_bit(st->st_mode)) != 0;
+
+	case FILPRED_SIZE:
+		return size_compare(pred->v.size.op, st->st_size,
+				    pred->v.size.size);
+
+	case FILPRED_OWNER:
+		for (i = 0; i < pred->v.owner.uidc; i++)
+			if (pred->v.owner.uidv[i] == st->st_uid)
+				return 1;
+		return 0;
+
+	case FILPRED_OLDER:
+		return time(NULL) - st->st_mtime >= pred->v.age;
+	}
+	return 0;
+}
+
+/* Return 0 if the file described by ST matches all predicates from FP,
+   and 1 otherwise.  ST is NULL if the file could not be stat'ed, in
+   which case it matches only an empty list. */
+int
+filpredlist_match(filpredlist_t fp, struct stat const *st)
+{
+	struct filpred *pred;
+
+	if (!fp)
+		return 0;
+	if (!st)
+		return 1;
+	for (pred = fp->head; pred; pred = pred->next)
+		if (!filpred_eval(pred, st))
+			return 1;
+	return 0;
+}
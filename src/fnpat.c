@@ -28,13 +28,24 @@ filename_pattern_free(void *p)
 		free(pat->v.glob);
 		break;
 	case PAT_REGEX:
-		regfree(&pat->v.re);
+		regfree(&pat->v.rx.re);
+		free(pat->v.rx.expr);
 	}
 	free(pat);
 }
 
+/* A pattern list is path-scoped if it contains at least one globbing
+   pattern or exact name with a slash in it.  Such patterns are matched
+   against the pathname of the file relative to the top-level watched
+   directory, and "**" in them matches any number of directories.  The
+   rest of the patterns in a path-scoped list are matched against the
+   last component of that pathname, as usual. */
 struct filpatlist {
 	grecs_list_ptr_t list;
+	struct dfa *dfa;       /* Automaton built from the patterns */
+	size_t residue;        /* Number of patterns it doesn't handle */
+	size_t npath;          /* Number of path patterns */
+	size_t nneg;           /* Number of negated patterns */
 };
 
 static int
@@ -48,12 +59,19 @@ filpatlist_add_pattern(filpatlist_t *fptr, struct filename_pattern *pat)
 {
 	grecs_list_ptr_t list;
 	if (!*fptr) {
-		*fptr = emalloc(sizeof(*fptr));
+		*fptr = ecalloc(1, sizeof(**fptr));
 		(*fptr)->list = grecs_list_create();
 		(*fptr)->list->free_entry = filename_pattern_free;
 	}
 	list = (*fptr)->list;
 	grecs_list_append(list, pat);
+	if (pat->path)
+		(*fptr)->npath++;
+	if (pat->neg)
+		(*fptr)->nneg++;
+	/* Invalidate the automaton */
+	dfa_free((*fptr)->dfa);
+	(*fptr)->dfa = NULL;
 }
 	
 void
@@ -62,6 +80,7 @@ filpatlist_add_exact(filpatlist_t *fptr, char const *arg)
 	struct filename_pattern *pat = emalloc(sizeof(*pat));
 	
 	pat->neg = 0;
+	pat->path = 0;
 	pat->type = PAT_EXACT;
 	pat->v.glob = estrdup(arg);
 	filpatlist_add_pattern(fptr, pat);
@@ -79,6 +98,7 @@ filpatlist_add(filpatlist_t *fptr, char const *arg, grecs_locus_t *loc)
 		++arg;
 	} else
 		pat->neg = 0;
+	pat->path = 0;
 	if (arg[0] == '/') {
 		int rc;
 		char *q, *p;
@@ -108,18 +128,21 @@ filpatlist_add(filpatlist_t *fptr, char const *arg, grecs_locus_t *loc)
 		}
 		
 		*p = 0;
-		rc = regcomp(&pat->v.re, arg + 1, flags);
+		rc = regcomp(&pat->v.rx.re, arg + 1, flags);
+		pat->v.rx.expr = estrdup(arg + 1);
+		pat->v.rx.flags = flags;
 		*p = '/';
 
 		if (rc) {
 			char errbuf[128];
-			regerror(rc, &pat->v.re, errbuf, sizeof(errbuf));
+			regerror(rc, &pat->v.rx.re, errbuf, sizeof(errbuf));
 			grecs_error(loc, 0, "%s", errbuf);
 			filename_pattern_free(pat);
 			return 1;
 		}
 	} else {
 		pat->type = is_glob(arg) ? PAT_GLOB : PAT_EXACT;
+		pat->path = strchr(arg, '/') != NULL;
 		pat->v.glob = estrdup(arg);
 	}
 	filpatlist_add_pattern(fptr, pat);
@@ -131,6 +154,7 @@ filpatlist_destroy(filpatlist_t *fptr)
 {
 	if (fptr && *fptr) {
 		grecs_list_free((*fptr)->list);
+		dfa_free((*fptr)->dfa);
 		free(*fptr);
 		*fptr = NULL;
 	}
@@ -145,31 +169,307 @@ filpatlist_is_empty(filpatlist_t fp)
 }
 
 int
-filpatlist_match(filpatlist_t fp, const char *name)
+filpatlist_is_pathscope(filpatlist_t fp)
+{
+	return fp && fp->npath;
+}
+
+static int
+is_literal(char const *str, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+		if (strchr("[]*?\\", str[i]))
+			return 0;
+	return 1;
+}
+
+/* Classify pattern PAT.  If it is a positive exact name or a glob of
+   the form "LIT*" or "*LIT", where LIT contains no special characters,
+   return its kind and store the literal part in PSTR and PLEN.
+   Otherwise, return -1. */
+static int
+filename_pattern_literal(struct filename_pattern *pat,
+			 char const **pstr, size_t *plen)
+{
+	size_t len;
+
+	if (pat->neg)
+		return -1;
+	switch (pat->type) {
+	case PAT_EXACT:
+		*pstr = pat->v.glob;
+		*plen = strlen(pat->v.glob);
+		return FPL_EXACT;
+
+	case PAT_GLOB:
+		len = strlen(pat->v.glob);
+		if (pat->v.glob[0] == '*'
+		    && is_literal(pat->v.glob + 1, len - 1)) {
+			*pstr = pat->v.glob + 1;
+			*plen = len - 1;
+			return FPL_SUFFIX;
+		}
+		if (len > 0 && pat->v.glob[len-1] == '*'
+		    && is_literal(pat->v.glob, len - 1)) {
+			*pstr = pat->v.glob;
+			*plen = len - 1;
+			return FPL_PREFIX;
+		}
+		break;
+
+	default:
+		break;
+	}
+	return -1;
+}
+
+/* If all patterns in FP are literal (see filename_pattern_literal above),
+   call FN for each of them and return 0.  Otherwise, return -1 without
+   calling FN. */
+int
+filpatlist_literals(filpatlist_t fp,
+		    void (*fn)(int, char const *, size_t, void *),
+		    void *data)
 {
 	struct grecs_list_entry *ep;
+	char const *str;
+	size_t len;
 
-	if (!fp || !fp->list)
-		return 0;
+	if (!fp || !fp->list || !fp->list->head || fp->npath)
+		return -1;
+	for (ep = fp->list->head; ep; ep = ep->next)
+		if (filename_pattern_literal(ep->data, &str, &len) == -1)
+			return -1;
+	for (ep = fp->list->head; ep; ep = ep->next) {
+		int kind = filename_pattern_literal(ep->data, &str, &len);
+		fn(kind, str, len, data);
+	}
+	return 0;
+}
+
+/* Add to DFA a path-scoped glob matching the last component of a
+   pathname against PAT, which is an exact name if EXACT is set, and a
+   globbing pattern otherwise. */
+static int
+dfa_add_basename(struct dfa *dfa, char const *pat, int exact, int neg)
+{
+	size_t len = strlen(pat);
+	char *buf = emalloc(3 + 2 * len + 1);
+	char *q = buf;
+	int rc;
+
+	memcpy(q, "**/", 3);
+	q += 3;
+	for (; *pat; pat++) {
+		if (exact && *pat == '\\')
+			*q++ = '\\';
+		*q++ = *pat;
+	}
+	*q = 0;
+	rc = dfa_add_glob(dfa, buf, neg, 1);
+	free(buf);
+	return rc;
+}
+
+/* Compile the patterns from FP into a single automaton.  Patterns that
+   cannot be handled by it are left to filename_pattern_match.
+
+   The automaton of a path-scoped list operates on relative pathnames.
+   Regular expressions in such lists are always matched separately. */
+void
+filpatlist_compile(filpatlist_t fp)
+{
+	struct grecs_list_entry *ep;
+
+	if (!fp || fp->dfa)
+		return;
+	fp->dfa = dfa_create();
+	fp->residue = 0;
 	for (ep = fp->list->head; ep; ep = ep->next) {
 		struct filename_pattern *pat = ep->data;
 		int rc;
-		
+
 		switch (pat->type) {
 		case PAT_EXACT:
-			rc = strcmp(pat->v.glob, name);
+			if (fp->npath && !pat->path)
+				rc = dfa_add_basename(fp->dfa, pat->v.glob, 1,
+						      pat->neg);
+			else
+				rc = dfa_add_exact(fp->dfa, pat->v.glob,
+						   pat->neg);
 			break;
 		case PAT_GLOB:
-			rc = fnmatch(pat->v.glob, name, FNM_PATHNAME);
+			if (fp->npath && !pat->path)
+				rc = dfa_add_basename(fp->dfa, pat->v.glob, 0,
+						      pat->neg);
+			else
+				rc = dfa_add_glob(fp->dfa, pat->v.glob,
+						  pat->neg, pat->path);
 			break;
 		case PAT_REGEX:
-			rc = regexec(&pat->v.re, name, 0, NULL, 0);
+			if (fp->npath)
+				rc = -1;
+			else
+				rc = dfa_add_regex(fp->dfa, pat->v.rx.expr,
+						   pat->v.rx.flags, pat->neg);
 			break;
 		}
-		if (pat->neg)
-			rc = !rc;
-		if (rc == 0)
+		pat->compiled = rc == 0;
+		if (rc) {
+			debug(2, (_("pattern %s is not handled by automaton"),
+				  pat->type == PAT_REGEX
+				    ? pat->v.rx.expr : pat->v.glob));
+			fp->residue++;
+		}
+	}
+}
+
+/* Match a single pathname component NAME of length LEN against the
+   component PAT of length PLEN of a path pattern. */
+static int
+component_match(char const *pat, size_t plen, char const *name, size_t len)
+{
+	char *buf = emalloc(plen + len + 2);
+	int rc;
+
+	memcpy(buf, pat, plen);
+	buf[plen] = 0;
+	memcpy(buf + plen + 1, name, len);
+	buf[plen + len + 1] = 0;
+	rc = fnmatch(buf, buf + plen + 1, FNM_PATHNAME);
+	free(buf);
+	return rc;
+}
+
+/* Match PATH against the path pattern PAT.  This is used for patterns
+   the automaton cannot handle. */
+static int
+pathglob_match(char const *pat, char const *path)
+{
+	for (;;) {
+		char const *pe = strchr(pat, '/');
+		char const *se = strchr(path, '/');
+		size_t plen = pe ? pe - pat : strlen(pat);
+		size_t len = se ? se - path : strlen(path);
+
+		if (plen == 2 && pat[0] == '*' && pat[1] == '*') {
+			if (!pe)
+				return 0;
+			/* Try the rest of the pattern at each directory
+			   level */
+			for (;;) {
+				if (pathglob_match(pe + 1, path) == 0)
+					return 0;
+				if (!se)
+					return 1;
+				path = se + 1;
+				se = strchr(path, '/');
+			}
+		}
+		if (component_match(pat, plen, path, len))
+			return 1;
+		if (!pe || !se)
+			return (pe || se) ? 1 : 0;
+		pat = pe + 1;
+		path = se + 1;
+	}
+}
+
+static int
+filename_pattern_match(struct filename_pattern *pat, const char *name)
+{
+	int rc;
+
+	switch (pat->type) {
+	case PAT_EXACT:
+		rc = strcmp(pat->v.glob, name);
+		break;
+	case PAT_GLOB:
+		if (pat->path)
+			rc = pathglob_match(pat->v.glob, name);
+		else
+			rc = fnmatch(pat->v.glob, name, FNM_PATHNAME);
+		break;
+	case PAT_REGEX:
+		rc = regexec(&pat->v.rx.re, name, 0, NULL, 0);
+		break;
+	}
+	if (pat->neg)
+		rc = !rc;
+	return rc;
+}
+
+/* The automaton operates on bytes.  In a multibyte locale, names
+   containing non-ASCII characters are matched pattern by pattern. */
+static int
+need_mbmatch(const char *name)
+{
+	if (MB_CUR_MAX == 1)
+		return 0;
+	for (; *name; name++)
+		if (*(unsigned char*)name & 0x80)
+			return 1;
+	return 0;
+}
+
+/* Match NAME against the patterns from FP.  For path-scoped lists,
+   NAME is the pathname relative to the top-level watched directory.
+   Return 0 if it matches, 1 otherwise. */
+int
+filpatlist_match(filpatlist_t fp, const char *name)
+{
+	struct grecs_list_entry *ep;
+	const char *base = name;
+	int all;
+
+	if (!fp || !fp->list)
+		return 0;
+	filpatlist_compile(fp);
+	if (fp->npath) {
+		const char *p = strrchr(name, '/');
+		if (p)
+			base = p + 1;
+	}
+	all = need_mbmatch(name);
+	if (!all) {
+		if (dfa_count(fp->dfa) && dfa_match(fp->dfa, name) == 0)
+			return 0;
+		if (fp->residue == 0)
+			return 1;
+	}
+	for (ep = fp->list->head; ep; ep = ep->next) {
+		struct filename_pattern *pat = ep->data;
+		if (!all && pat->compiled)
+			continue;
+		if (filename_pattern_match(pat, pat->path ? name : base) == 0)
 			return 0;
 	}
 	return 1;
 }
+
+/* Check whether pathnames under the directory DIR (relative to the
+   top-level watched directory) can match the path-scoped list FP.
+   Return 1 if none of them can, and 0 if some can or if it cannot be
+   determined. */
+int
+filpatlist_prefix_match(filpatlist_t fp, const char *dir)
+{
+	char *buf;
+	size_t len;
+	int rc;
+
+	if (!fp || !fp->npath || fp->nneg)
+		return 0;
+	filpatlist_compile(fp);
+	if (fp->residue || need_mbmatch(dir))
+		return 0;
+	len = strlen(dir);
+	buf = emalloc(len + 2);
+	memcpy(buf, dir, len);
+	buf[len] = '/';
+	buf[len + 1] = 0;
+	rc = dfa_prefix_match(fp->dfa, buf);
+	free(buf);
+	return rc;
+}
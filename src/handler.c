@@ -16,6 +16,10 @@
 
 #include "direvent.h"
 #include <grecs.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
 
 struct handler *
 handler_alloc(event_mask ev_mask)
@@ -26,21 +30,6 @@ handler_alloc(event_mask ev_mask)
 	return hp;
 }
 
-void
-watchpoint_run_handlers(struct watchpoint *wp, int evflags,
-			const char *dirname, const char *filename)
-{
-	handler_iterator_t itr;
-	struct handler *hp;
-	event_mask m;
-
-	for_each_handler(wp, itr, hp) {
-		if (handler_matches_event(hp, sys, evflags, filename))
-			hp->run(wp, event_mask_init(&m, evflags, &hp->ev_mask),
-				dirname, filename, hp->data);
-	}
-}
-
 static void
 handler_ref(struct handler *hp)
 {
@@ -51,6 +40,9 @@ void
 handler_free(struct handler *hp)
 {
 	filpatlist_destroy(&hp->fnames);
+	filpredlist_destroy(&hp->fpreds);
+	if (hp->ratelimit)
+		ratelimit_free(hp->ratelimit);
 	if (hp->free)
 		hp->free(hp->data);
 }
@@ -58,123 +50,109 @@ handler_free(struct handler *hp)
 static void
 handler_unref(struct handler *hp)
 {
-	if (hp && --hp->refcnt) {
+	if (hp && --hp->refcnt == 0) {
 		handler_free(hp);
 		free(hp);
 	}
 }
 
-/* Handler lists */
+/* Handler lists.
 
-static void
-handler_listent_free(void *p)
-{
-	struct handler *hp = p;
-	handler_unref(hp);
-}
+   Handlers are kept in a reference-counted vector.  A vector is never
+   modified while anyone else holds a reference to it: instead, the list
+   gets a modified copy (copy-on-write).  Thus, a dispatch loop, which
+   holds a reference to the vector it iterates over, is not affected
+   by handlers being removed from or added to the list in the
+   meantime. */
 
-struct handler_list {
+struct handler_vec {
 	size_t refcnt;
-	grecs_list_ptr_t list;
-	struct handler_iterator *itr_chain;
+	size_t count;                  /* Number of handlers */
+	size_t max;                    /* Number of allocated slots */
+	struct handler *tab[1];        /* Handlers */
 };
 
-struct handler_iterator {
-	struct handler_iterator *prev, *next;
-	handler_list_t hlist;
-	struct grecs_list_entry *ent;
-	int advanced;
-};
+struct handler_index;
 
-static struct handler_iterator *itr_avail;
+struct handler_list {
+	size_t refcnt;
+	struct handler_vec *vec;       /* Handlers */
+	struct handler_index *index;   /* Pattern index */
+};
 
-struct handler *
-handler_itr_first(struct watchpoint *wpt, handler_iterator_t *ret_itr)
+static struct handler_vec *
+handler_vec_alloc(size_t max)
 {
-	struct handler_iterator *itr;
-		
-	if (!wpt->handler_list)
-		return NULL;
+	struct handler_vec *vec;
 
-	if (itr_avail) {
-		itr = itr_avail;
-		itr_avail = itr->next;
-		if (itr_avail)
-			itr_avail->prev = NULL;
-	} else 
-		itr = emalloc(sizeof *itr);
+	vec = emalloc(sizeof(*vec) + (max - 1) * sizeof(vec->tab[0]));
+	vec->refcnt = 1;
+	vec->count = 0;
+	vec->max = max;
+	return vec;
+}
 
-	itr->prev = NULL;
-	itr->next = wpt->handler_list->itr_chain;
-	itr->hlist = wpt->handler_list;
-	if (wpt->handler_list->itr_chain)
-	    wpt->handler_list->itr_chain->prev = itr;
-	wpt->handler_list->itr_chain = itr;
+static void
+handler_vec_unref(struct handler_vec *vec)
+{
+	size_t i;
 
-	itr->ent = wpt->handler_list->list->head;
-	itr->advanced = 0;
-	*ret_itr = itr;
-	return handler_itr_current(itr);
+	if (!vec || --vec->refcnt)
+		return;
+	for (i = 0; i < vec->count; i++)
+		handler_unref(vec->tab[i]);
+	free(vec);
 }
 
-struct handler *
-handler_itr_next(handler_iterator_t *pitr)
+/* Make sure the vector of HLIST can be modified in place and has room
+   for at least N handlers. */
+static struct handler_vec *
+handler_list_vec_mod(handler_list_t hlist, size_t n)
 {
-	struct handler_iterator *itr;
-	
-	if (!pitr || (itr = *pitr) == NULL)
-		return NULL;
-	if (itr->advanced)
-		itr->advanced = 0;
-	else 
-		itr->ent = itr->ent->next;
-
-	if (!itr->ent) {
-		/* Remove from iterator chain */
-		struct handler_iterator *p;
-		if ((p = itr->prev) != NULL)
-			p->next = itr->next;
-		else
-			itr->hlist->itr_chain = itr->next;
-		if ((p = itr->next) != NULL)
-			p->prev = itr->prev;
-			
-		/* Add to the available chain */
-		if (itr_avail)
-			itr_avail->prev = itr;
-		itr->prev = NULL;
-		itr->next = itr_avail;
-		itr->hlist = NULL;
-		itr_avail = itr;
-		*pitr = NULL;
-		return NULL;
+	struct handler_vec *vec = hlist->vec;
+
+	if (vec->refcnt > 1 || n > vec->max) {
+		struct handler_vec *nv;
+		size_t i, max = vec->max;
+
+		while (n > max)
+			max *= 2;
+		nv = handler_vec_alloc(max);
+		for (i = 0; i < vec->count; i++) {
+			handler_ref(vec->tab[i]);
+			nv->tab[i] = vec->tab[i];
+		}
+		nv->count = vec->count;
+		handler_vec_unref(vec);
+		hlist->vec = vec = nv;
 	}
-	return handler_itr_current(itr);
-}
-		
-struct handler *
-handler_itr_current(handler_iterator_t itr)
-{
-	if (!itr)
-		return NULL;
-	return itr->ent ? itr->ent->data : NULL;
+	return vec;
 }
 
+static void handler_index_unref(struct handler_index *idx);
+
 handler_list_t
 handler_list_create(void)
 {
 	handler_list_t hlist = emalloc(sizeof(*hlist));
-	hlist->list = grecs_list_create();
-	hlist->list->free_entry = handler_listent_free;
 	hlist->refcnt = 1;
-	hlist->itr_chain = NULL;
+	hlist->vec = handler_vec_alloc(4);
+	hlist->index = NULL;
 	return hlist;
 }
 
 size_t
 handler_list_size(handler_list_t hlist)
 {
-	return grecs_list_size(hlist->list);
+	return hlist->vec->count;
+}
+
+struct handler *
+handler_list_item(handler_list_t hlist, size_t n)
+{
+	if (!hlist || n >= hlist->vec->count)
+		return NULL;
+	return hlist->vec->tab[n];
 }
 
 handler_list_t
@@ -191,7 +169,8 @@ handler_list_unref(handler_list_t hlist)
 {
 	if (hlist) {
 		if (--hlist->refcnt == 0) {
-			grecs_list_free(hlist->list);
+			handler_index_unref(hlist->index);
+			handler_vec_unref(hlist->vec);
 			free(hlist);
 		}
 	}
@@ -200,31 +179,837 @@ handler_list_unref(handler_list_t hlist)
 void
 handler_list_append(handler_list_t hlist, struct handler *hp)
 {
+	struct handler_vec *vec = handler_list_vec_mod(hlist,
+						       hlist->vec->count + 1);
 	handler_ref(hp);
-	grecs_list_append(hlist->list, hp);
+	vec->tab[vec->count++] = hp;
+}
+
+static size_t
+handler_vec_find(struct handler_vec *vec, struct handler *hp)
+{
+	size_t i;
+
+	for (i = 0; i < vec->count; i++)
+		if (vec->tab[i] == hp)
+			break;
+	return i;
 }
 
 size_t
 handler_list_remove(handler_list_t hlist, struct handler *hp)
 {
-	struct grecs_list_entry *ep;
-	for (ep = hlist->list->head; ep; ep = ep->next)
-		if (ep->data == hp)
-			break;
-	if (!ep)
+	struct handler_vec *vec;
+	size_t i;
+
+	if (handler_vec_find(hlist->vec, hp) == hlist->vec->count)
 		abort();
+	vec = handler_list_vec_mod(hlist, hlist->vec->count);
+	i = handler_vec_find(vec, hp);
+	memmove(vec->tab + i, vec->tab + i + 1,
+		(vec->count - i - 1) * sizeof(vec->tab[0]));
+	vec->count--;
+	handler_unref(hp);
+	return vec->count;
+}
+
+/* Handler index.
+
+   Most handlers select files by exact names or by globs of the form
+   "PREFIX*" or "*SUFFIX".  The index maps such literals to the handlers
+   that use them: exact names are kept in a hash table, prefixes and
+   suffixes in two tries.  A single lookup yields the set of handlers
+   whose patterns match a file name.  Handlers using any other kind of
+   pattern are marked as "complex" and are matched the usual way.
+   Handlers with path-scoped patterns are matched against the relative
+   pathname of each file anew, because their match results cannot be
+   cached by file name.
+
+   The index is built on demand for a handler list and is shared by all
+   watchpoints that use that list.  It is rebuilt whenever the list
+   changes. */
+
+#define BM_BITS (sizeof(unsigned long) * 8)
+#define BM_WORDS(n) (((n) + BM_BITS - 1) / BM_BITS)
+#define BM_SET(bm,i) ((bm)[(i) / BM_BITS] |= 1UL << ((i) % BM_BITS))
+#define BM_ISSET(bm,i) ((bm)[(i) / BM_BITS] & (1UL << ((i) % BM_BITS)))
+
+/* References to handlers from an index entry */
+struct litref {
+	size_t *hv;                   /* Handler indices */
+	size_t hc;                    /* Number of used entries in hv */
+	size_t hmax;                  /* Number of allocated entries */
+};
 
-	if (hlist->itr_chain) {
-		struct handler_iterator *itr;
+/* Exact name entry */
+struct litent {
+	struct litent *next;
+	size_t len;                   /* Length of the name */
+	uint64_t head;                /* Its first 8 bytes, zero-padded */
+	struct litref ref;
+	char str[1];
+};
+
+/* Trie of prefixes or suffixes */
+struct trie {
+	struct trie *child;
+	struct trie *sibling;
+	unsigned char c;
+	struct litref ref;
+};
+
+/* If there are at most this many exact names, they are compared
+   sequentially rather than hashed */
+#define INDEX_LINEAR_MAX 8
+
+/* Match result cache.
+
+   Each index keeps a small direct-mapped cache of recently seen file
+   names along with the bitmaps of handlers matching them.  Since the
+   index is rebuilt when its handler list changes, so is the cache. */
+#define MATCH_CACHE_SIZE 64    /* Number of entries; must be a power of 2 */
+#define MATCH_CACHE_NAMELEN 64 /* Longer names are not cached */
+
+struct match_cache_entry {
+	unsigned hash;                /* Hash of the name */
+	char name[MATCH_CACHE_NAMELEN]; /* File name; empty if unused */
+	int used;                     /* True if the entry is in use */
+};
 
-		for (itr = hlist->itr_chain; itr; itr = itr->next)
-			if (itr->ent == ep) {
-				itr->ent = ep->next;
-				itr->advanced = 1;
+static unsigned long match_cache_hits;
+static unsigned long match_cache_misses;
+/* Number of handler runs suppressed by metadata predicates */
+static unsigned long pred_skipped;
+/* Number of events dropped by sampling */
+static unsigned long sample_dropped;
+
+struct handler_index {
+	size_t refcnt;
+	struct handler_vec *vec;      /* Vector it indexes */
+	size_t count;                 /* Number of handlers */
+	struct handler **tab;         /* Handlers, in list order */
+	size_t nwords;                /* Size of a bitmap in words */
+	unsigned long *complex;       /* Handlers needing full matching */
+	unsigned long *pathscope;     /* Handlers with path-scoped patterns */
+	size_t npath;                 /* Number of such handlers */
+	unsigned long *work;          /* Work bitmap */
+	int busy;                     /* Work bitmap is in use */
+	struct litent **exact;        /* Hash table of exact names */
+	size_t nexact;                /* Number of exact names */
+	size_t hashsize;              /* Size of the hash table */
+	struct trie prefix;           /* Prefix trie */
+	struct trie suffix;           /* Suffix trie */
+	struct match_cache_entry *cache; /* Match result cache */
+	unsigned long *cache_bits;    /* Bitmaps for cache entries */
+	/* Dispatch tables: for each bit of system and generic event masks,
+	   the bitmap of handlers interested in it */
+	unsigned long *sysev_tab;
+	unsigned long *genev_tab;
+};
+
+static uint64_t
+lithead(char const *str, size_t len)
+{
+	uint64_t h = 0;
+	memcpy(&h, str, len < sizeof(h) ? len : sizeof(h));
+	return h;
+}
+
+static void
+litref_add(struct litref *ref, size_t n)
+{
+	if (ref->hc > 0 && ref->hv[ref->hc - 1] == n)
+		return;
+	if (ref->hc == ref->hmax) {
+		ref->hmax = ref->hmax ? 2 * ref->hmax : 2;
+		ref->hv = erealloc(ref->hv, ref->hmax * sizeof(ref->hv[0]));
+	}
+	ref->hv[ref->hc++] = n;
+}
+
+static void
+litref_mark(struct litref *ref, unsigned long *bm)
+{
+	size_t i;
+	for (i = 0; i < ref->hc; i++)
+		BM_SET(bm, ref->hv[i]);
+}
+
+static struct trie *
+trie_insert(struct trie *node, char const *str, size_t len, int reverse)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = reverse ? str[len - i - 1] : str[i];
+		struct trie *p;
+
+		for (p = node->child; p; p = p->sibling)
+			if (p->c == c)
+				break;
+		if (!p) {
+			p = ecalloc(1, sizeof(*p));
+			p->c = c;
+			p->sibling = node->child;
+			node->child = p;
+		}
+		node = p;
+	}
+	return node;
+}
+
+static void
+trie_lookup(struct trie *node, char const *str, size_t len, int reverse,
+	    unsigned long *bm)
+{
+	size_t i;
+
+	litref_mark(&node->ref, bm);
+	for (i = 0; i < len; i++) {
+		unsigned char c = reverse ? str[len - i - 1] : str[i];
+
+		for (node = node->child; node; node = node->sibling)
+			if (node->c == c)
+				break;
+		if (!node)
+			break;
+		litref_mark(&node->ref, bm);
+	}
+}
+
+static void
+trie_free(struct trie *node)
+{
+	while (node) {
+		struct trie *next = node->sibling;
+		trie_free(node->child);
+		free(node->ref.hv);
+		free(node);
+		node = next;
+	}
+}
+
+static unsigned
+name_hash(char const *str, size_t len)
+{
+	size_t i;
+	unsigned h = 0;
+
+	for (i = 0; i < len; i++)
+		h = h * 31 + (unsigned char) str[i];
+	return h;
+}
+
+static size_t
+exact_hash(struct handler_index *idx, char const *str, size_t len)
+{
+	if (idx->hashsize == 1)
+		return 0;
+	return name_hash(str, len) % idx->hashsize;
+}
+
+static struct litent *
+exact_lookup(struct handler_index *idx, char const *str, size_t len,
+	     uint64_t head)
+{
+	struct litent *ent;
+
+	for (ent = idx->exact[exact_hash(idx, str, len)]; ent; ent = ent->next)
+		if (ent->len == len && ent->head == head
+		    && (len <= sizeof(head)
+			|| memcmp(ent->str + sizeof(head), str + sizeof(head),
+				  len - sizeof(head)) == 0))
+			return ent;
+	return NULL;
+}
+
+struct index_closure {
+	struct handler_index *idx;
+	size_t n;                     /* Handler number */
+};
+
+static void
+index_count_literal(int kind, char const *str, size_t len, void *data)
+{
+	struct index_closure *clos = data;
+	if (kind == FPL_EXACT)
+		clos->idx->nexact++;
+}
+
+static void
+index_add_literal(int kind, char const *str, size_t len, void *data)
+{
+	struct index_closure *clos = data;
+	struct handler_index *idx = clos->idx;
+	struct litent *ent;
+	uint64_t head;
+
+	switch (kind) {
+	case FPL_EXACT:
+		head = lithead(str, len);
+		ent = exact_lookup(idx, str, len, head);
+		if (!ent) {
+			size_t h = exact_hash(idx, str, len);
+			ent = ecalloc(1, sizeof(*ent) + len);
+			memcpy(ent->str, str, len);
+			ent->len = len;
+			ent->head = head;
+			ent->next = idx->exact[h];
+			idx->exact[h] = ent;
+		}
+		litref_add(&ent->ref, clos->n);
+		break;
+
+	case FPL_PREFIX:
+		litref_add(&trie_insert(&idx->prefix, str, len, 0)->ref,
+			   clos->n);
+		break;
+
+	case FPL_SUFFIX:
+		litref_add(&trie_insert(&idx->suffix, str, len, 1)->ref,
+			   clos->n);
+	}
+}
+
+/* Mark handler N in the bitmaps of TAB that correspond to bits set in
+   MASK. */
+static void
+evtab_add(unsigned long *tab, size_t nwords, int mask, size_t n)
+{
+	unsigned bits = mask;
+	size_t b;
+
+	for (b = 0; bits; b++, bits >>= 1)
+		if (bits & 1)
+			BM_SET(tab + b * nwords, n);
+}
+
+static struct handler_index *
+handler_index_build(handler_list_t hlist)
+{
+	struct handler_index *idx = ecalloc(1, sizeof(*idx));
+	struct index_closure clos;
+	size_t i;
+
+	idx->refcnt = 1;
+	idx->vec = hlist->vec;
+	idx->vec->refcnt++;
+	idx->count = idx->vec->count;
+	idx->tab = idx->vec->tab;
+	idx->nwords = BM_WORDS(idx->count) + 1;
+	idx->complex = ecalloc(idx->nwords, sizeof(idx->complex[0]));
+	idx->pathscope = ecalloc(idx->nwords, sizeof(idx->pathscope[0]));
+	idx->work = ecalloc(2 * idx->nwords, sizeof(idx->work[0]));
+	idx->cache = ecalloc(MATCH_CACHE_SIZE, sizeof(idx->cache[0]));
+	idx->cache_bits = ecalloc(MATCH_CACHE_SIZE * idx->nwords,
+				  sizeof(idx->cache_bits[0]));
+	idx->sysev_tab = ecalloc(EVT_BITS * idx->nwords,
+				 sizeof(idx->sysev_tab[0]));
+	idx->genev_tab = ecalloc(EVT_BITS * idx->nwords,
+				 sizeof(idx->genev_tab[0]));
+
+	clos.idx = idx;
+	for (i = 0; i < idx->count; i++)
+		filpatlist_literals(idx->tab[i]->fnames, index_count_literal,
+				    &clos);
+	idx->hashsize = idx->nexact <= INDEX_LINEAR_MAX
+			 ? 1 : 2 * idx->nexact + 1;
+	idx->exact = ecalloc(idx->hashsize, sizeof(idx->exact[0]));
+
+	for (i = 0; i < idx->count; i++) {
+		struct handler *hp = idx->tab[i];
+
+		clos.n = i;
+		if (filpatlist_is_pathscope(hp->fnames)) {
+			BM_SET(idx->pathscope, i);
+			idx->npath++;
+		} else if (filpatlist_literals(hp->fnames, index_add_literal,
+					       &clos))
+			BM_SET(idx->complex, i);
+		evtab_add(idx->sysev_tab, idx->nwords, hp->ev_mask.sys_mask, i);
+		evtab_add(idx->genev_tab, idx->nwords, hp->ev_mask.gen_mask, i);
+	}
+	debug(3, (_("built handler index: %lu handlers, %lu exact names"),
+		  (unsigned long) idx->count, (unsigned long) idx->nexact));
+	return idx;
+}
+
+static void
+handler_index_unref(struct handler_index *idx)
+{
+	size_t i;
+
+	if (!idx || --idx->refcnt)
+		return;
+	handler_vec_unref(idx->vec);
+	free(idx->complex);
+	free(idx->pathscope);
+	free(idx->work);
+	free(idx->cache);
+	free(idx->cache_bits);
+	free(idx->sysev_tab);
+	free(idx->genev_tab);
+	for (i = 0; i < idx->hashsize; i++) {
+		struct litent *ent = idx->exact[i];
+		while (ent) {
+			struct litent *next = ent->next;
+			free(ent->ref.hv);
+			free(ent);
+			ent = next;
+		}
+	}
+	free(idx->exact);
+	trie_free(idx->prefix.child);
+	free(idx->prefix.ref.hv);
+	trie_free(idx->suffix.child);
+	free(idx->suffix.ref.hv);
+	free(idx);
+}
+
+/* Return the up-to-date index for HLIST.  The caller must release it
+   using handler_index_unref when done. */
+static struct handler_index *
+handler_index_get(handler_list_t hlist)
+{
+	if (!hlist->index || hlist->index->vec != hlist->vec) {
+		handler_index_unref(hlist->index);
+		hlist->index = handler_index_build(hlist);
+	}
+	hlist->index->refcnt++;
+	return hlist->index;
+}
+
+/* Store in BM the bitmap of handlers from IDX whose patterns match
+   NAME. */
+static void
+handler_index_scan(struct handler_index *idx, const char *name,
+		   unsigned long *bm)
+{
+	size_t len, i;
+	struct litent *ent;
+
+	memset(bm, 0, idx->nwords * sizeof(bm[0]));
+	if (strchr(name, '/')) {
+		/* Wildcards in literal globs don't match slashes: match all
+		   handlers in full */
+		for (i = 0; i < idx->count; i++)
+			if (!BM_ISSET(idx->pathscope, i)
+			    && filpatlist_match(idx->tab[i]->fnames, name) == 0)
+				BM_SET(bm, i);
+		return;
+	}
+
+	len = strlen(name);
+	if (idx->nexact
+	    && (ent = exact_lookup(idx, name, len, lithead(name, len))))
+		litref_mark(&ent->ref, bm);
+	trie_lookup(&idx->prefix, name, len, 0, bm);
+	trie_lookup(&idx->suffix, name, len, 1, bm);
+
+	for (i = 0; i < idx->nwords; i++) {
+		unsigned long bits = idx->complex[i];
+		size_t n;
+
+		for (n = i * BM_BITS; bits; bits >>= 1, n++)
+			if ((bits & 1)
+			    && filpatlist_match(idx->tab[n]->fnames, name) == 0)
+				BM_SET(bm, n);
+	}
+}
+
+/* Return a scratch area for two bitmaps.  If the work area of IDX is
+   in use (by an outer dispatch), allocate a new one. */
+static unsigned long *
+handler_index_acquire(struct handler_index *idx)
+{
+	if (idx->busy)
+		return ecalloc(2 * idx->nwords, sizeof(idx->work[0]));
+	idx->busy = 1;
+	return idx->work;
+}
+
+static void
+handler_index_release(struct handler_index *idx, unsigned long *bm)
+{
+	if (bm == idx->work)
+		idx->busy = 0;
+	else
+		free(bm);
+}
+
+/* Store in BM the bitmap of handlers from IDX whose patterns match
+   NAME. */
+static void
+handler_index_lookup(struct handler_index *idx, const char *name,
+		     unsigned long *bm)
+{
+	size_t len = strlen(name);
+	unsigned hash;
+	struct match_cache_entry *ent;
+	unsigned long *bits;
+
+	if (len >= MATCH_CACHE_NAMELEN) {
+		handler_index_scan(idx, name, bm);
+		return;
+	}
+
+	hash = name_hash(name, len);
+	ent = &idx->cache[hash & (MATCH_CACHE_SIZE - 1)];
+	bits = idx->cache_bits + (ent - idx->cache) * idx->nwords;
+	if (ent->used && ent->hash == hash && strcmp(ent->name, name) == 0) {
+		match_cache_hits++;
+	} else {
+		match_cache_misses++;
+		handler_index_scan(idx, name, bits);
+		ent->used = 1;
+		ent->hash = hash;
+		memcpy(ent->name, name, len + 1);
+	}
+	memcpy(bm, bits, idx->nwords * sizeof(bm[0]));
+}
+
+/* Return the pathname of the file NAME from the directory DIRNAME,
+   relative to the directory of the top-level watchpoint WP descends
+   from. */
+static const char *
+watchpoint_relpath(struct watchpoint *wp, const char *dirname,
+		   const char *name)
+{
+	size_t len;
+
+	while (wp->parent)
+		wp = wp->parent;
+	len = strlen(wp->dirname);
+	while (len > 0 && wp->dirname[len - 1] == '/')
+		len--;
+	if (strncmp(dirname, wp->dirname, len) == 0 && dirname[len] == '/') {
+		dirname += len;
+		while (*dirname == '/')
+			dirname++;
+		if (*dirname)
+			return scratch_filename(dirname, name);
+	}
+	return name;
+}
+
+/* Add to BM the handlers from IDX with path-scoped patterns matching
+   PATH.  If MASK is not NULL, consider only handlers set in it. */
+static void
+handler_index_paths(struct handler_index *idx, const char *path,
+		    unsigned long *mask, unsigned long *bm)
+{
+	size_t i;
+
+	for (i = 0; i < idx->nwords; i++) {
+		unsigned long bits = idx->pathscope[i];
+		size_t n;
+
+		if (mask)
+			bits &= mask[i];
+		for (n = i * BM_BITS; bits; bits >>= 1, n++)
+			if ((bits & 1)
+			    && filpatlist_match(idx->tab[n]->fnames, path) == 0)
+				BM_SET(bm, n);
+	}
+}
+
+/* Store in BM the bitmap of handlers from IDX interested in any of
+   the events from FLAGS (system or generic ones, depending on SYS).
+   Return 0 if there are none. */
+static int
+handler_index_events(struct handler_index *idx, int sys, int flags,
+		     unsigned long *bm)
+{
+	unsigned long *tab = sys ? idx->sysev_tab : idx->genev_tab;
+	unsigned bits = flags;
+	unsigned long any = 0;
+	size_t b, i;
+
+	memset(bm, 0, idx->nwords * sizeof(bm[0]));
+	for (b = 0; bits; b++, bits >>= 1) {
+		if (bits & 1) {
+			unsigned long *p = tab + b * idx->nwords;
+			for (i = 0; i < idx->nwords; i++) {
+				bm[i] |= p[i];
+				any |= p[i];
+			}
+		}
+	}
+	return any != 0;
+}
+
+/* Return the number of the first handler set in the bitmap BM
+   at or after N, or idx->count if there are none. */
+static size_t
+handler_index_next(struct handler_index *idx, unsigned long *bm, size_t n)
+{
+	while (n < idx->count) {
+		size_t w = n / BM_BITS;
+		unsigned long bits = bm[w] >> (n % BM_BITS);
+		if (bits == 0) {
+			n = (w + 1) * BM_BITS;
+			continue;
+		}
+		while (!(bits & 1)) {
+			bits >>= 1;
+			n++;
+		}
+		break;
+	}
+	return n < idx->count ? n : idx->count;
+}
+
+void
+handler_stats_report(void)
+{
+	diag(LOG_INFO, _("match cache: %lu hits, %lu misses"),
+	     match_cache_hits, match_cache_misses);
+	diag(LOG_INFO, _("handlers skipped by predicates: %lu"),
+	     pred_skipped);
+	diag(LOG_INFO, _("events dropped by sampling: %lu"),
+	     sample_dropped);
+}
+
+/* Status of the file the event being dispatched refers to.  The file
+   is stat'ed at most once per event, when first needed. */
+struct event_stat {
+	struct watchpoint *wp;        /* Watchpoint, or NULL */
+	const char *dirname;
+	const char *filename;
+	int state;                    /* 0 - not stat'ed yet, 1 - st is
+					 valid, -1 - stat failed */
+	struct stat st;
+	unsigned long count;          /* Number of events the handler being
+					 run stands for */
+};
+
+static struct event_stat *event_stat_cur;
+
+/* Return the status of the file the current event refers to, or NULL
+   if it is not available. */
+struct stat const *
+event_file_stat(void)
+{
+	struct event_stat *es = event_stat_cur;
+	int fd, rc;
+
+	if (!es)
+		return NULL;
+	if (es->state == 0) {
+		if (es->wp && strcmp(es->dirname, es->wp->dirname) == 0
+		    && (fd = watchpoint_dirfd(es->wp)) != -1)
+			rc = fstatat(fd, es->filename, &es->st,
+				     AT_SYMLINK_NOFOLLOW);
+		else
+			rc = lstat(scratch_filename(es->dirname,
+						    es->filename),
+				   &es->st);
+		if (rc) {
+			debug(1, (_("cannot stat %s/%s: %s"),
+				  es->dirname, es->filename,
+				  strerror(errno)));
+			es->state = -1;
+		} else
+			es->state = 1;
+	}
+	return es->state > 0 ? &es->st : NULL;
+}
+
+/* Return the number of events the current handler run stands for.
+   It is greater than 1 only for sampling handlers. */
+unsigned long
+event_sample_count(void)
+{
+	return event_stat_cur ? event_stat_cur->count : 1;
+}
+
+/* Account for an event matching the handler HP.  Return 0 and store
+   the number of events accumulated since the last delivery in PCOUNT,
+   if the event must be delivered.  Return 1 if it must be dropped. */
+static int
+handler_sample(struct handler *hp, unsigned long *pcount)
+{
+	struct sampler *sp = &hp->sample;
+
+	sp->count++;
+	if (sp->rate > 1 && sp->count < sp->rate)
+		return 1;
+	if (sp->interval) {
+		time_t now = time(NULL);
+		if (now - sp->last < sp->interval)
+			return 1;
+		sp->last = now;
+	}
+	*pcount = sp->count;
+	sp->count = 0;
+	return 0;
+}
+
+/* Deliver the event EVENT on FILENAME in DIRNAME, which stands for
+   COUNT events, to the handler HP outside of event dispatching, e.g.
+   after it has been deferred by the rate limiter. */
+void
+handler_deliver(struct handler *hp, event_mask *event,
+		const char *dirname, const char *filename,
+		unsigned long count)
+{
+	struct event_stat es, *prev_es;
+
+	es.wp = NULL;
+	es.dirname = dirname;
+	es.filename = filename;
+	es.state = 0;
+	es.count = count;
+	prev_es = event_stat_cur;
+	event_stat_cur = &es;
+	hp->run(NULL, event, dirname, filename, hp->data);
+	event_stat_cur = prev_es;
+}
+
+/* Run handlers from the watchpoint WP that are interested in FLAGS and
+   match FILENAME.  If SYS is true, FLAGS is a system event mask,
+   otherwise it is a generic one. */
+static void
+handler_dispatch(struct watchpoint *wp, int sys, int flags,
+		 const char *dirname, const char *filename)
+{
+	handler_list_t hlist = wp->handler_list;
+	struct handler_index *idx;
+	unsigned long *bm, *evbm;
+	size_t i;
+	struct event_stat es, *prev_es;
+
+	if (!hlist)
+		return;
+	es.wp = wp;
+	es.dirname = dirname;
+	es.filename = filename;
+	es.state = 0;
+	prev_es = event_stat_cur;
+	event_stat_cur = &es;
+	hlist->refcnt++;
+	idx = handler_index_get(hlist);
+	bm = handler_index_acquire(idx);
+	evbm = bm + idx->nwords;
+	/* Match the name only if some handlers are interested in the
+	   event */
+	if (handler_index_events(idx, sys, flags, evbm)) {
+		handler_index_lookup(idx, filename, bm);
+		if (idx->npath)
+			handler_index_paths(idx,
+					    watchpoint_relpath(wp, dirname,
+							       filename),
+					    evbm, bm);
+		for (i = 0; i < idx->nwords; i++)
+			bm[i] &= evbm[i];
+	} else
+		memset(bm, 0, idx->nwords * sizeof(bm[0]));
+	for (i = handler_index_next(idx, bm, 0); i < idx->count;
+	     i = handler_index_next(idx, bm, i + 1)) {
+		struct handler *hp = idx->tab[i];
+		event_mask m;
+
+		/* A handler may have been removed by another one */
+		if (hlist->vec != idx->vec
+		    && handler_vec_find(hlist->vec, hp) == hlist->vec->count)
+			continue;
+		if (hp->fpreds
+		    && filpredlist_match(hp->fpreds, event_file_stat())) {
+			pred_skipped++;
+			continue;
+		}
+		es.count = 1;
+		if ((hp->sample.rate > 1 || hp->sample.interval)
+		    && handler_sample(hp, &es.count)) {
+			sample_dropped++;
+			continue;
+		}
+		if (sys)
+			event_mask_init(&m, flags, &hp->ev_mask);
+		else {
+			m.gen_mask = flags;
+			m.sys_mask = 0;
+		}
+		if (hp->ratelimit
+		    && ratelimit_check(hp, &m, dirname, filename, es.count))
+			continue;
+		hp->run(wp, &m, dirname, filename, hp->data);
+	}
+	handler_index_release(idx, bm);
+	handler_index_unref(idx);
+	handler_list_unref(hlist);
+	event_stat_cur = prev_es;
+}
+
+void
+watchpoint_run_handlers(struct watchpoint *wp, int evflags,
+			const char *dirname, const char *filename)
+{
+	handler_dispatch(wp, 1, evflags, dirname, filename);
+}
+
+/* Deliver GENEV_CREATE event */
+void
+deliver_ev_create(struct watchpoint *wp, const char *dirname, const char *name)
+{
+	handler_dispatch(wp, 0, GENEV_CREATE, dirname, name);
+}
+
+int
+watchpoint_pattern_match(struct watchpoint *wpt, const char *file_name)
+{
+	struct handler_index *idx;
+	unsigned long *bm;
+	int rc = 1;
+
+	if (!wpt->handler_list)
+		return 1;
+	idx = handler_index_get(wpt->handler_list);
+	bm = handler_index_acquire(idx);
+	handler_index_lookup(idx, file_name, bm);
+	if (idx->npath)
+		handler_index_paths(idx,
+				    watchpoint_relpath(wpt, wpt->dirname,
+						       file_name),
+				    NULL, bm);
+	if (handler_index_next(idx, bm, 0) < idx->count)
+		rc = 0;
+	handler_index_release(idx, bm);
+	handler_index_unref(idx);
+	return rc;
+}
+
+/* Check whether files under the subdirectory NAME of WPT can match the
+   patterns of its handlers.  Return 0 if they can, 1 if they cannot,
+   and -1 if no handler of WPT has path-scoped patterns, in which case
+   the decision is up to the caller. */
+int
+watchpoint_subtree_match(struct watchpoint *wpt, const char *name)
+{
+	struct handler_index *idx;
+	const char *dir;
+	size_t i;
+	int rc;
+
+	if (!wpt->handler_list)
+		return -1;
+	idx = handler_index_get(wpt->handler_list);
+	if (idx->npath == 0)
+		rc = -1;
+	else {
+		dir = watchpoint_relpath(wpt, wpt->dirname, name);
+		rc = 1;
+		for (i = 0; i < idx->count; i++) {
+			/* Other patterns can match at any depth */
+			if (!BM_ISSET(idx->pathscope, i)
+			    || filpatlist_prefix_match(idx->tab[i]->fnames,
+						       dir) == 0) {
+				rc = 0;
+				break;
 			}
+		}
 	}
-	
-	grecs_list_remove_entry(hlist->list, ep);
-	return grecs_list_size(hlist->list);
+	handler_index_unref(idx);
+	return rc;
 }
 
@@ -0,0 +1,149 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2016 Sergey Poznyakoff
+
+   Direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   Direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+/* Loadable handler modules (see direvent-module.h for the interface
+   modules must implement).  Each watcher that uses a module gets its
+   own instance, created by the module's init function.  The shared
+   object is loaded once for each instance; the dynamic loader takes
+   care of sharing it. */
+
+#include "direvent.h"
+#ifdef HAVE_DLFCN_H
+# include <dlfcn.h>
+#endif
+
+/* Free the instance of the module MP and unload it. */
+static void
+module_unload(struct module *mp)
+{
+	if (!mp->dlh)
+		return;
+	if (mp->free)
+		mp->free(mp->data);
+#ifdef HAVE_DLOPEN
+	dlclose(mp->dlh);
+#endif
+	mp->dlh = NULL;
+	mp->free = NULL;
+	mp->data = NULL;
+}
+
+/* Load the module MP and initialize its instance.  On error, return
+   -1 and point *ERRMSG to the description of the error. */
+int
+module_load(struct module *mp, const char **errmsg)
+{
+#ifdef HAVE_DLOPEN
+	int *version;
+	direvent_module_init_fn init;
+
+	mp->dlh = dlopen(mp->path, RTLD_NOW | RTLD_LOCAL);
+	if (!mp->dlh) {
+		*errmsg = dlerror();
+		return -1;
+	}
+
+	version = dlsym(mp->dlh, "direvent_module_version");
+	if (!version) {
+		*errmsg = _("not a direvent module");
+		module_unload(mp);
+		return -1;
+	}
+	if (*version != DIREVENT_MODULE_VERSION) {
+		*errmsg = _("unsupported module interface version");
+		module_unload(mp);
+		return -1;
+	}
+	mp->run = (direvent_module_run_fn)
+		    dlsym(mp->dlh, "direvent_module_run");
+	if (!mp->run) {
+		*errmsg = _("module does not define direvent_module_run");
+		module_unload(mp);
+		return -1;
+	}
+	mp->free = (direvent_module_free_fn)
+		    dlsym(mp->dlh, "direvent_module_free");
+	init = (direvent_module_init_fn)
+		    dlsym(mp->dlh, "direvent_module_init");
+	if (init && init(mp->argc, mp->argv, &mp->data)) {
+		*errmsg = _("module initialization failed");
+		mp->free = NULL;
+		module_unload(mp);
+		return -1;
+	}
+	return 0;
+#else
+	*errmsg = _("loadable modules are not supported on this system");
+	return -1;
+#endif
+}
+
+/* Unload the module MP and free its configuration. */
+void
+module_free(struct module *mp)
+{
+	size_t i;
+
+	module_unload(mp);
+	free(mp->path);
+	for (i = 0; i < mp->argc; i++)
+		free(mp->argv[i]);
+	free(mp->argv);
+	memset(mp, 0, sizeof(*mp));
+}
+
+static int
+module_handler_run(struct watchpoint *wp, event_mask *event,
+		   const char *dirname, const char *file, void *data)
+{
+	struct module *mp = data;
+	int rc;
+
+	rc = mp->run(mp->data, event->gen_mask, event->sys_mask,
+		     dirname, file);
+	if (rc)
+		debug(1, (_("%s: module returned %d for %s/%s"),
+			  mp->path, rc, dirname, file));
+	return rc;
+}
+
+static void
+module_handler_free_data(void *ptr)
+{
+	module_free(ptr);
+	free(ptr);
+}
+
+/* Create a handler running the module MP, which must have been loaded
+   by module_load. */
+struct handler *
+module_handler_alloc(event_mask ev_mask, filpatlist_t fpat,
+		     filpredlist_t fpred, struct module *mp)
+{
+	struct handler *hp = handler_alloc(ev_mask);
+	struct module *mem;
+
+	hp->fnames = fpat;
+	hp->fpreds = fpred;
+	filpatlist_compile(fpat);
+	hp->run = module_handler_run;
+	hp->free = module_handler_free_data;
+	mem = emalloc(sizeof(*mem));
+	*mem = *mp;
+	hp->data = mem;
+	memset(mp, 0, sizeof(*mp));
+	return hp;
+}
@@ -20,31 +20,48 @@
 #include <grp.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <poll.h>
+#ifdef HAVE_PIDFD_OPEN
+# include <sys/pidfd.h>
+#endif
 #include "wordsplit.h"
 
-/* Process list */
+/* Process table.
+
+   Running processes are kept in a doubly-linked list and in a hash
+   table keyed by PID, so that a terminated process is found in
+   constant time.  Process structures are allocated in slabs and
+   recycled via a free list.
 
-/* Redirector codes */
-#define REDIR_OUT 0
-#define REDIR_ERR 1
+   Where pidfd_open(2) is available, a pidfd is opened for each
+   process and polled along with the event notification descriptor
+   (see redirector_wait).  It becomes readable when the process
+   terminates, so the termination is noticed even if SIGCHLD arrives
+   just before the main loop goes to sleep, and the process is reaped
+   directly, without scanning. */
 
-#define PROC_HANDLER 0
-#define PROC_REDIR   1
+struct redirector;
+struct coproc;
+struct flight;
 
 /* A running process is described by this structure */
 struct process {
 	struct process *next, *prev;
-	int type;               /* Process type */
-	unsigned timeout;       /* Timeout in seconds */
+	struct process *hnext;  /* Next process in the hash chain */
 	pid_t pid;              /* PID */
-	time_t start;           /* Time when the process started */
-	union {
-		struct process *redir[2];
-                /* Pointers to the redirector processes, if
-		   type == PROC_HANDLER (NULL if no redirector) */
-		struct process *master;
-                /* Master process, if type == PROC_REDIR */
-	} v;
+	int pidfd;              /* Its pidfd, or -1 */
+	size_t pollidx;         /* Index of the pidfd in the poll set, or 0 */
+	struct timer timer;     /* Timeout timer */
+	struct prog_handler *handler; /* Handler it runs */
+	struct coproc *coproc;  /* Coprocess worker it runs, or NULL */
+	struct flight *flight;  /* Single-flight entry, or NULL */
+	struct redirector *redir[2];
+                /* Redirectors capturing its stdout and stderr (NULL
+		   if not redirected) */
 };
 
 /* List of running processes */
@@ -52,6 +69,93 @@ struct process *proc_list;
 /* List of available process slots */
 struct process *proc_avail;
 
+/* Number of process structures allocated at once */
+#define PROC_SLAB 64
+
+/* Hash table of running processes */
+static struct process **proc_hash;
+static size_t proc_hash_size;   /* Number of buckets (power of 2) */
+static size_t proc_count;       /* Number of running processes */
+
+static void handler_done(struct prog_handler *hp);
+static void job_queue_run(void);
+static void redirector_close(struct redirector *rp);
+static void flight_done(struct flight *fp);
+static void handler_started(struct prog_handler *hp);
+static void coproc_exited(struct coproc *cp);
+
+/* Poll set.
+
+   The descriptors monitored by redirector_wait are kept in an array,
+   which is updated as redirectors, coprocesses and processes come and
+   go, instead of being rebuilt on each wakeup.  Slot 0 is reserved for
+   the descriptor passed to redirector_wait.  The owner of a descriptor
+   keeps the index of its slot (0 if it is not in the set), so that a
+   descriptor is removed in constant time by moving the last slot in
+   its place. */
+
+/* Types of poll set entries, in the order they are serviced */
+enum {
+	POLLSRC_REDIR,          /* Redirector */
+	POLLSRC_COPROC,         /* Coprocess acknowledgements */
+	POLLSRC_PROC,           /* Process pidfd */
+	POLLSRC_COUNT
+};
+
+struct pollsrc {
+	int type;               /* Entry type (see above) */
+	void *ptr;              /* Its owner */
+	size_t *idx;            /* Where the owner keeps the slot index */
+};
+
+static struct pollfd *poll_fd;
+static struct pollsrc *poll_src;
+static size_t poll_count = 1;   /* Number of used slots */
+static size_t poll_max;         /* Number of allocated slots */
+
+/* Make sure there is room for one more slot */
+static void
+pollset_grow(void)
+{
+	if (poll_count >= poll_max) {
+		poll_max = poll_max ? 2 * poll_max : 16;
+		poll_fd = erealloc(poll_fd, poll_max * sizeof(poll_fd[0]));
+		poll_src = erealloc(poll_src, poll_max * sizeof(poll_src[0]));
+	}
+}
+
+/* Add descriptor FD of type TYPE, owned by PTR, to the poll set.  Store
+   its slot index in *IDX. */
+static void
+pollset_add(int fd, int type, void *ptr, size_t *idx)
+{
+	pollset_grow();
+	poll_fd[poll_count].fd = fd;
+	poll_fd[poll_count].events = POLLIN;
+	poll_fd[poll_count].revents = 0;
+	poll_src[poll_count].type = type;
+	poll_src[poll_count].ptr = ptr;
+	poll_src[poll_count].idx = idx;
+	*idx = poll_count++;
+}
+
+/* Remove the descriptor whose slot index is kept in *IDX from the poll
+   set, if it is there. */
+static void
+pollset_remove(size_t *idx)
+{
+	size_t i = *idx;
+
+	if (i == 0)
+		return;
+	*idx = 0;
+	if (i != --poll_count) {
+		poll_fd[i] = poll_fd[poll_count];
+		poll_src[i] = poll_src[poll_count];
+		*poll_src[i].idx = i;
+	}
+}
+
 /* Declare functions for handling process lists */
 struct process *
 proc_unlink(struct process **root, struct process *p)
@@ -84,43 +188,119 @@ proc_push(struct process **pp, struct process *p)
 	*pp = p;
 }
 
-
+static struct process *
+proc_alloc(void)
+{
+	if (!proc_avail) {
+		struct process *slab = ecalloc(PROC_SLAB, sizeof(slab[0]));
+		int i;
+
+		for (i = 0; i < PROC_SLAB; i++)
+			proc_push(&proc_avail, &slab[i]);
+	}
+	return proc_pop(&proc_avail);
+}
+
+static inline size_t
+proc_hash_index(pid_t pid)
+{
+	return ((size_t) pid * 2654435761u) & (proc_hash_size - 1);
+}
+
+static void
+proc_hash_insert(struct process *p)
+{
+	size_t i;
+
+	if (proc_count >= proc_hash_size) {
+		/* Keep the load factor at most 1 */
+		struct process **old = proc_hash;
+		size_t j, old_size = proc_hash_size;
+
+		proc_hash_size = old_size ? old_size * 2 : 64;
+		proc_hash = ecalloc(proc_hash_size, sizeof(proc_hash[0]));
+		for (j = 0; j < old_size; j++) {
+			struct process *q, *next;
+
+			for (q = old[j]; q; q = next) {
+				next = q->hnext;
+				i = proc_hash_index(q->pid);
+				q->hnext = proc_hash[i];
+				proc_hash[i] = q;
+			}
+		}
+		free(old);
+	}
+	i = proc_hash_index(p->pid);
+	p->hnext = proc_hash[i];
+	proc_hash[i] = p;
+	proc_count++;
+}
+
+static void
+proc_hash_remove(struct process *p)
+{
+	struct process **pp;
+
+	for (pp = &proc_hash[proc_hash_index(p->pid)]; *pp;
+	     pp = &(*pp)->hnext)
+		if (*pp == p) {
+			*pp = p->hnext;
+			p->hnext = NULL;
+			proc_count--;
+			break;
+		}
+}
+
+
 /* Process list handling (high-level) */
 
+static void
+process_timeout(struct timer *t)
+{
+	struct process *p = t->data;
+	diag(LOG_ERR, _("process %lu timed out"), (unsigned long) p->pid);
+	kill(p->pid, SIGKILL);
+}
+
+/* Register the process PID, which should be killed if it does not
+   terminate within TIMEOUT milliseconds (0 means no timeout). */
 struct process *
-register_process(int type, pid_t pid, time_t t, unsigned timeout)
+register_process(pid_t pid, unsigned timeout)
 {
-	struct process *p;
+	struct process *p = proc_alloc();
 
-	if (proc_avail)
-		p = proc_pop(&proc_avail);
-	else
-		p = emalloc(sizeof(*p));
 	memset(p, 0, sizeof(*p));
-	p->type = type;
-	p->timeout = timeout;
 	p->pid = pid;
-	p->start = t;
+#ifdef HAVE_PIDFD_OPEN
+	p->pidfd = pidfd_open(pid, 0);
+	if (p->pidfd != -1) {
+		fcntl(p->pidfd, F_SETFD, FD_CLOEXEC);
+		pollset_add(p->pidfd, POLLSRC_PROC, p, &p->pollidx);
+	}
+#else
+	p->pidfd = -1;
+#endif
+	if (timeout)
+		timer_set(&p->timer, timeout, process_timeout, p);
 	proc_push(&proc_list, p);
+	proc_hash_insert(p);
 	return p;
 }
 
-void
-deregister_process(pid_t pid, time_t t)
+/* Remove the terminated process P from the table */
+static void
+deregister_process(struct process *p)
 {
-	struct process *p;
-
-	for (p = proc_list; p; p = p->next)
-		if (p->pid == pid) {
-			if (p->prev)
-				p->prev->next = p->next;
-			else
-				proc_list = p;
-			if (p->next)
-				p->next->prev = p->prev;
-			free(p);
-			break;
-		}
+	timer_cancel(&p->timer);
+	if (p->pidfd != -1) {
+		pollset_remove(&p->pollidx);
+		close(p->pidfd);
+	}
+	proc_hash_remove(p);
+	proc_unlink(&proc_list, p);
+	p->pid = 0;
+	proc_push(&proc_avail, p);
 }
 
 struct process *
@@ -128,7 +308,9 @@ process_lookup(pid_t pid)
 {
 	struct process *p;
 
-	for (p = proc_list; p; p = p->next)
+	if (proc_count == 0)
+		return NULL;
+	for (p = proc_hash[proc_hash_index(pid)]; p; p = p->hnext)
 		if (p->pid == pid)
 			return p;
 	return NULL;
@@ -168,6 +350,49 @@ print_status(pid_t pid, int status, sigset_t *mask)
 		     (unsigned long) pid);
 }
 
+/* Finish off the terminated process P */
+static void
+process_exited(struct process *p)
+{
+	struct flight *fp = p->flight;
+
+	/* Log the rest of its output */
+	redirector_close(p->redir[REDIR_OUT]);
+	redirector_close(p->redir[REDIR_ERR]);
+	if (p->coproc)
+		coproc_exited(p->coproc);
+	handler_done(p->handler);
+	deregister_process(p);
+	if (fp)
+		flight_done(fp);
+}
+
+/* Reap the process P, whose pidfd has become readable.
+
+   The pidfd only tells that P has terminated; it is reaped by its PID.
+   This is safe, because the PID of a child cannot be reused before
+   the child is waited for.  Reaping with waitid(P_PIDFD) would return
+   a siginfo_t, which would have to be converted back to a wait status
+   for print_status, and gains nothing here. */
+static void
+process_reap(struct process *p)
+{
+	int status;
+	sigset_t set;
+
+	if (waitpid(p->pid, &status, WNOHANG) != p->pid)
+		return;
+	sigemptyset(&set);
+	print_status(p->pid, status, &set);
+	process_exited(p);
+}
+
+/* Reap all terminated children.  This is called on each iteration of
+   the main loop.  It waits for any child, because the self-test
+   process and the handlers started where pidfd_open is not available
+   (or has failed) have no pidfd.  Handlers that have one are reaped
+   here as well, if they terminated after the poll; their pidfd is
+   then closed by deregister_process before it is polled again. */
 void
 process_cleanup(int expect_term)
 {
@@ -202,192 +427,189 @@ process_cleanup(int expect_term)
 				sigaddset(&set, SIGKILL);
 			}
 			print_status(pid, status, &set);
-			if (!p)
-				continue;
-
-			if (p->type == PROC_HANDLER) {
-				if (p->v.redir[REDIR_OUT])
-					p->v.redir[REDIR_OUT]->v.master = NULL;
-				if (p->v.redir[REDIR_ERR])
-					p->v.redir[REDIR_ERR]->v.master = NULL;
-			}
-			p->pid = 0;
-			proc_unlink(&proc_list, p);
-			proc_push(&proc_avail, p);
+			if (p)
+				process_exited(p);
 		}
 	}
+	job_queue_run();
 }
 
-void
-process_timeouts()
-{
-	struct process *p;
-	time_t now = time(NULL);
-	time_t alarm_time = 0, x;
+/* Redirectors.
+
+   The standard output and error of a handler can be captured and
+   logged (see the stdout and stderr options).  The daemon reads them
+   from pipes.  The pipes are monitored by the main loop along with
+   the event notification descriptor (see redirector_wait).  Each
+   redirector keeps the incomplete last line read from its pipe, and
+   logs all complete lines at once.  When the handler terminates, the
+   data remaining in the pipe are logged and the redirector is
+   closed. */
+
+#define REDIR_BUFSIZE 512
+
+struct redirector {
+	int fd;                       /* Read end of the pipe */
+	size_t pollidx;               /* Its index in the poll set, or 0 */
+	int prio;                     /* Log priority */
+	int eof;                      /* End of file reached */
+	char *tag;                    /* Tag for log messages */
+	size_t len;                   /* Number of bytes in buf */
+	char buf[REDIR_BUFSIZE];      /* Line buffer */
+};
 
-	debug(2, (_("begin scanning process list")));
-	for (p = proc_list; p; p = p->next) {
-		x = now - p->start;
-		if (x >= p->timeout) {
-			diag(LOG_ERR, _("process %lu timed out"),
-			     (unsigned long) p->pid);
-			kill(p->pid, SIGKILL);
-		} else if (alarm_time == 0 ||
-			   p->timeout - x < alarm_time)
-			alarm_time = p->timeout - x;
-	}
+/* Create a redirector logging with priority PRIO lines read from the
+   pipe.  Return the write end of the pipe, or -1 on error. */
+static int
+redirector_open(const char *tag, int prio, struct redirector **return_redir)
+{
+	int p[2];
+	struct redirector *rp;
 
-	if (alarm_time) {
-		debug(2, (_("scheduling alarm in %lu seconds"),
-			  (unsigned long) alarm_time));
-		alarm(alarm_time);
+	if (pipe(p)) {
+		diag(LOG_ERR,
+		     _("cannot start redirector for %s, pipe failed: %s"),
+		     tag, strerror(errno));
+		return -1;
 	}
-	debug(2, ("end scanning process list"));
+	fcntl(p[0], F_SETFL, fcntl(p[0], F_GETFL) | O_NONBLOCK);
+	fcntl(p[0], F_SETFD, FD_CLOEXEC);
+
+	rp = emalloc(sizeof(*rp));
+	rp->fd = p[0];
+	rp->prio = prio;
+	rp->tag = estrdup(tag);
+	rp->len = 0;
+	rp->eof = 0;
+	pollset_add(rp->fd, POLLSRC_REDIR, rp, &rp->pollidx);
+	
+	*return_redir = rp;
+	return p[1];
 }
-
-int
-switchpriv(struct prog_handler *hp)
+
+/* Log the complete lines from the buffer of RP.  If FLUSH is true, log
+   the incomplete line as well. */
+static void
+redirector_log(struct redirector *rp, int flush)
 {
-	if (hp->uid == 0 || hp->uid == getuid())
-		return 0;
+	char *start = rp->buf, *end = rp->buf + rp->len;
+	char *p;
 	
-	if (setgroups(hp->gidc, hp->gidv) < 0) {
-		diag(LOG_CRIT, "setgroups: %s",
-		     strerror(errno));
-		return 1;
-	}
-	if (setregid(hp->gidv[0], hp->gidv[0]) < 0) {
-		diag(LOG_CRIT, "setregid(%lu,%lu): %s",
-		     (unsigned long) hp->gidv[0],
-		     (unsigned long) hp->gidv[0],
-		     strerror(errno));
-		return 1;
-	}
-	if (setreuid(hp->uid, hp->uid) < 0) {
-		diag(LOG_CRIT, "setreuid(%lu,%lu): %s",
-		     (unsigned long) hp->uid,
-		     (unsigned long) hp->uid,
-		     strerror(errno));
-		return 1;
+	while ((p = memchr(start, '\n', end - start)) != NULL) {
+		*p = 0;
+		diag(rp->prio, "%s: %s", rp->tag, start);
+		start = p + 1;
 	}
-	return 0;
-}		
-
-typedef fd_set *bigfd_set;
-
-#define BIGFD_SET_COUNT \
-	((sysconf(_SC_OPEN_MAX) + FD_SETSIZE - 1) / FD_SETSIZE)
-
-#define BIGFD_SET_ALLOC() \
-	ecalloc(BIGFD_SET_COUNT, sizeof(fd_set))
-
-#define BIGFD_ZERO(fds) \
-	memset(fds, 0, sizeof(*bigfd_set) * BIGFD_SET_COUNT)
-#define BIGFD_SET(n, fds) \
-	FD_SET((n) % FD_SETSIZE, (fds) + (n) / FD_SETSIZE)
-#define BIGFD_ISSET(n, fds) \
-	FD_ISSET((n) % FD_SETSIZE, (fds) + (n) / FD_SETSIZE)
+	if (start == rp->buf && rp->len == sizeof(rp->buf))
+		flush = 1; /* Line too long: log it in pieces */
+	if (flush && start < end) {
+		diag(rp->prio, "%s: %.*s", rp->tag, (int) (end - start),
+		     start);
+		start = end;
+	}
+	rp->len = end - start;
+	memmove(rp->buf, start, rp->len);
+}
 
+/* Read and log the data available from RP. */
 static void
-close_fds(bigfd_set fdset)
+redirector_read(struct redirector *rp)
 {
-	int i;
-
-	for (i = dup(0); i >= 0; i--) {
-		if (fdset && BIGFD_ISSET(i, fdset))
-			continue;
-		close(i);
+	ssize_t n;
+	
+	while (!rp->eof) {
+		n = read(rp->fd, rp->buf + rp->len, sizeof(rp->buf) - rp->len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			diag(LOG_ERR, _("error reading output of %s: %s"),
+			     rp->tag, strerror(errno));
+			rp->eof = 1;
+		} else if (n == 0)
+			rp->eof = 1;
+		else {
+			rp->len += n;
+			redirector_log(rp, 0);
+		}
 	}
+	/* A redirector at end of file is kept until its process is
+	   reaped, but there is nothing more to poll for */
+	if (rp->eof)
+		pollset_remove(&rp->pollidx);
 }
-
-/* Operations with handlers and redirections */
 
+/* Log the remaining data from RP and destroy it. */
 static void
-redir_exit(int sig)
+redirector_close(struct redirector *rp)
 {
-	_exit(0);
+	if (!rp)
+		return;
+	redirector_read(rp);
+	redirector_log(rp, 1);
+	pollset_remove(&rp->pollidx);
+	close(rp->fd);
+	free(rp->tag);
+	free(rp);
 }
 
-int
-open_redirector(const char *tag, int prio, struct process **return_proc)
+/* Log the output the handlers that are still running have written so
+   far, including incomplete lines.  This is called before exiting. */
+void
+redirector_flush_all(void)
 {
-	int p[2];
-	FILE *fp;
-	char buf[512];
-	pid_t pid;
-	bigfd_set fdset;
+	struct process *p;
+	int i;
 
-	if (pipe(p)) {
-		diag(LOG_ERR,
-		     _("cannot start redirector for %s, pipe failed: %s"),
-		     tag, strerror(errno));
-		return -1;
-	}
-	switch (pid = fork()) {
-	case 0:
-		/* Redirector process */
-		fdset = BIGFD_SET_ALLOC();
-		BIGFD_SET(p[0], fdset);
-		if (facility <= 0)
-			BIGFD_SET(2, fdset);
-		close_fds(fdset);
-		
-		alarm(0);
-		signal_setup(redir_exit);
-
-		fp = fdopen(p[0], "r");
-		if (fp == NULL)
-			_exit(1);
-		if (facility > 0) 
-			openlog(tag, LOG_PID, facility);
-
-		while (fgets(buf, sizeof(buf), fp) > 0) {
-			int len = strlen(buf);
-			if (len && buf[len-1] == '\n')
-				buf[len-1] = 0;
-			diag(prio, "%s", buf);
-		}
-		_exit(0);
-      
-	case -1:
-		diag(LOG_CRIT,
-		     _("cannot run redirector `%s': fork failed: %s"),
-		     tag, strerror(errno));
-		return -1;
+	for (p = proc_list; p; p = p->next)
+		for (i = 0; i < 2; i++)
+			if (p->redir[i]) {
+				redirector_read(p->redir[i]);
+				redirector_log(p->redir[i], 1);
+			}
+}
 
-	default:
-		debug(1, (_("redirector for %s started, pid=%lu"),
-			  tag, (unsigned long) pid));
-		close(p[0]);
-		*return_proc = register_process(PROC_REDIR, pid, 
-						time(NULL), 0);
-		return p[1];
-	}
+/* Prepared arguments of a handler process */
+struct spawn_args {
+	char **argv;                  /* Command line */
+	char **env;                   /* Environment */
+	char *xargv[4];               /* Shell command line */
+	struct wordsplit ws;          /* Words of the command */
+	int tmpl;                     /* Filled from the template */
+};
+
+/* Return a copy of STR allocated in the scratch arena. */
+static char *
+kve_strdup(const char *str)
+{
+	return strcpy(scratch_alloc(strlen(str) + 1), str);
 }
-
+
+/* Maximum number of entries in a kve array */
+#define KVE_MAX 21
+
+/* Fill KVE with the names and values of the variables describing the
+   event EVENT on FILE.  ST is the status of the file, if available, and
+   COUNT is the number of events the run stands for. */
 static void
-runcmd(const char *cmd, char **envhint, event_mask *event, const char *file,
-       int shell)
+kve_setup(char **kve, event_mask *event, const char *file,
+	  struct stat const *st, unsigned long count)
 {
-	char *kve[13];
 	char *p,*q;
 	char buf[1024];
 	int i = 0, j;
-	char **argv;
-	char *xargv[4];
-	struct wordsplit ws;
 	
 	kve[i++] = "file";
 	kve[i++] = (char*) file;
 	
 	snprintf(buf, sizeof buf, "%d", event->sys_mask);
 	kve[i++] = "sysev_code";
-	kve[i++] = estrdup(buf);
+	kve[i++] = kve_strdup(buf);
 
 	if (self_test_pid) {
 		snprintf(buf, sizeof buf, "%lu", (unsigned long)self_test_pid);
 		kve[i++] = "self_test_pid";
-		kve[i++] = estrdup(buf);
+		kve[i++] = kve_strdup(buf);
 	}
 	
 	q = buf;
@@ -401,147 +623,1341 @@ runcmd(const char *cmd, char **envhint, event_mask *event, const char *file,
 	*q = 0;	
 	if (q > buf) {
 		kve[i++] = "sysev_name";
-		kve[i++] = estrdup(buf);
+		kve[i++] = kve_strdup(buf);
 	}
 	p = trans_toktostr(genev_transtab, event->gen_mask);
 	if (p) {
 		snprintf(buf, sizeof buf, "%d", event->gen_mask);
 		kve[i++] = "genev_code";
-		kve[i++] = estrdup(buf);
+		kve[i++] = kve_strdup(buf);
 		kve[i++] = "genev_name";
 		kve[i++] = p;
 	}
+	if (st) {
+		snprintf(buf, sizeof buf, "%jd", (intmax_t) st->st_size);
+		kve[i++] = "file_size";
+		kve[i++] = kve_strdup(buf);
+		snprintf(buf, sizeof buf, "%jd", (intmax_t) st->st_mtime);
+		kve[i++] = "file_mtime";
+		kve[i++] = kve_strdup(buf);
+		snprintf(buf, sizeof buf, "%ju", (uintmax_t) st->st_ino);
+		kve[i++] = "file_inode";
+		kve[i++] = kve_strdup(buf);
+	}
+	snprintf(buf, sizeof buf, "%lu", count);
+	kve[i++] = "sample_count";
+	kve[i++] = kve_strdup(buf);
 	kve[i++] = 0;
+}
+
+/* Prepare the command line and environment for running the handler
+   HP.  KVE are the variables to expand in them.  Return 0 on success
+   and -1 on error.
+
+   The command and environment are filled from the template compiled
+   by prog_handler_alloc.  If there is none, they are expanded anew
+   each time. */
+static int
+spawn_prepare(struct spawn_args *sa, struct prog_handler *hp, char **kve)
+{
+	int shell = hp->flags & HF_SHELL;
 
-	ws.ws_env = (const char **) kve;
-	if (wordsplit(cmd, &ws,
-		      WRDSF_NOCMD | WRDSF_QUOTE
-		      | WRDSF_SQUEEZE_DELIMS | WRDSF_CESCAPES
-		      | WRDSF_ENV | WRDSF_ENV_KV
-		      | (shell ? WRDSF_NOSPLIT : 0))) {
-		diag(LOG_CRIT, "wordsplit: %s",
-		     wordsplit_strerror (&ws));
-		_exit(127);
+	if (hp->tmpl) {
+		template_fill(hp->tmpl, kve, &sa->argv, &sa->env);
+		sa->tmpl = 1;
+		return 0;
 	}
+	sa->tmpl = 0;
+
+	if (command_expand(hp->command, shell, kve, &sa->ws))
+		return -1;
 	
 	if (shell) {
-		xargv[0] = "/bin/sh";
-		xargv[1] = "-c";
-		xargv[2] = ws.ws_wordv[0];
-		xargv[3] = NULL;
-		argv = xargv;
+		sa->xargv[0] = "/bin/sh";
+		sa->xargv[1] = "-c";
+		sa->xargv[2] = sa->ws.ws_wordv[0];
+		sa->xargv[3] = NULL;
+		sa->argv = sa->xargv;
 	} else
-		argv = ws.ws_wordv;
+		sa->argv = sa->ws.ws_wordv;
+
+	sa->env = environ_setup(hp->env, kve, hp->flags);
+	if (!sa->env) {
+		wordsplit_free(&sa->ws);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+spawn_free(struct spawn_args *sa)
+{
+	if (sa->tmpl)
+		return;
+	environ_free(sa->env);
+	wordsplit_free(&sa->ws);
+}
+
+/* Pending jobs.
+
+   The number of handler processes running simultaneously can be
+   limited globally (max-handlers) and for each handler (max-handlers
+   in the watcher block).  An invocation that would exceed any of the
+   limits is kept in the job queue until a handler process terminates.
+   The jobs are started in the order of their arrival, except that a
+   job whose handler is at its limit does not prevent jobs of other
+   handlers from being started.
+
+   Each handler belongs to a priority class (high, normal or low), and
+   each class has a queue of its own.  When a slot becomes free, the
+   next job is selected among the classes by the job scheduler.  The
+   strict scheduler always prefers a higher class.  The weighted
+   scheduler serves the classes in turn, starting at most as many jobs
+   from a class in each round as its weight, so that lower classes are
+   not starved.  If the queue is full, a new job evicts the newest job of
+   the lowest class below its own, if there is any.
+
+   The same queue implements the "wait" option: invocations of such a
+   handler are queued while its previous instance is running, and are
+   started one by one as the instances terminate. */
+
+struct job {
+	struct job *next;
+	struct prog_handler *hp;      /* Handler to run */
+	event_mask event;             /* Event */
+	char *dirname;                /* Directory */
+	char *file;                   /* File name */
+	int have_stat;                /* True if st is valid */
+	struct stat st;               /* File status */
+	unsigned long count;          /* Number of events */
+	int in_fd;                    /* Standard input or -1 */
+	struct flight *flight;        /* Single-flight entry, or NULL */
+	timer_msec_t queued;          /* Time the job was queued at */
+};
+
+/* Queue of a priority class */
+struct job_class {
+	struct job *head, *tail;      /* Queued jobs */
+	size_t count;                 /* Number of them */
+	unsigned credit;              /* Jobs it can start in the current
+					 round (weighted scheduler) */
+	/* Statistics */
+	unsigned long runs;           /* Number of invocations started */
+	unsigned long queued;         /* Number of them queued first */
+	unsigned long dropped;        /* Number of invocations dropped */
+	unsigned long long wait_total; /* Total wait time (ms) */
+	unsigned long wait_max;       /* Max. wait time (ms) */
+};
+
+struct transtab prio_transtab[] = {
+	{ "high",   PRIO_HIGH },
+	{ "normal", PRIO_NORMAL },
+	{ "low",    PRIO_LOW },
+	{ NULL }
+};
+
+unsigned max_handlers;                /* Global limit on running handlers */
+unsigned job_queue_size = JOB_QUEUE_SIZE; /* Max. number of queued jobs */
+int job_scheduler = SCHED_STRICT;     /* Job scheduler */
+unsigned job_class_weight[PRIO_COUNT] = { 4, 2, 1 };
+				      /* Weights of the classes */
+
+static unsigned handlers_running;     /* Number of running handlers */
+static struct job_class job_class[PRIO_COUNT]; /* The job queues */
+static size_t job_count;              /* Number of jobs in them */
+static int job_class_cur = PRIO_COUNT - 1;
+				      /* Class being served (weighted
+					 scheduler); the first round
+					 starts with the highest one */
+static unsigned job_class_used;       /* Bitmap of classes in use */
+static int job_queue_hold;            /* Set while running the queue */
+
+/* Statistics */
+static size_t job_count_max;          /* Max. queue depth */
+static unsigned long job_total;       /* Number of jobs queued */
+static unsigned long job_started;     /* Number of queued jobs started */
+static unsigned long job_dropped;     /* Number of jobs dropped */
+static unsigned long long job_wait_total; /* Total wait time (ms) */
+static unsigned long job_wait_max;    /* Max. wait time (ms) */
+
+/* Coprocesses.
+
+   A handler with the "coprocess" option does not start its command for
+   each event.  Instead, the command is started once and runs as a
+   worker, which reads event records from its standard input.  There
+   are at most max-handlers workers for such a handler (1 by default),
+   started as the events arrive.  A worker that terminates is replaced
+   by a new one when the next event needs it.
+
+   A record consists of lines NAME=VALUE, with the same names as the
+   environment variables of an ordinary handler, followed by an empty
+   line.  Backslashes and newlines in values are escaped as \\ and \n.
+   The DIREVENT_DIR variable gives the directory the event occurred in.
+
+   Having processed a record, the worker writes a line with its status
+   (0 for success) to its standard output.  Until then, the worker is
+   busy and counts as a running handler, so that the handler limits,
+   the job queue and the "wait" option work as usual.  The handler
+   timeout applies to each record: a worker that fails to acknowledge
+   it in time is killed. */
+
+#define COPROC_BUFSIZE 512
+
+struct coproc {
+	struct coproc *next, *prev;
+	struct prog_handler *hp;      /* Handler it serves */
+	struct process *proc;         /* Its process */
+	int in;                       /* Write end of its stdin */
+	int ack;                      /* Read end of its stdout (-1 at
+					 end of file) */
+	size_t pollidx;               /* Index of ack in the poll set, or 0 */
+	char *file;                   /* File name of the record being
+					 processed, or NULL if idle */
+	struct timer timer;           /* Record timeout */
+	size_t len;                   /* Number of bytes in buf */
+	char buf[COPROC_BUFSIZE];     /* Acknowledgement line buffer */
+};
+
+static struct coproc *coproc_head;
 
-	execve(argv[0], argv, environ_setup(envhint, kve));
+static unsigned
+coproc_pool_size(struct prog_handler *hp)
+{
+	return hp->max_running ? hp->max_running : 1;
+}
 
-	diag(LOG_ERR, "execve: %s \"%s\": %s", argv[0], cmd, strerror(errno));
-	_exit(127);
+static void
+coproc_unlink(struct coproc *cp)
+{
+	if (cp->prev)
+		cp->prev->next = cp->next;
+	else
+		coproc_head = cp->next;
+	if (cp->next)
+		cp->next->prev = cp->prev;
 }
 
+/* Finish the record the worker CP is processing */
+static void
+coproc_done(struct coproc *cp)
+{
+	timer_cancel(&cp->timer);
+	free(cp->file);
+	cp->file = NULL;
+	handler_done(cp->hp);
+}
+
+static void
+coproc_timeout(struct timer *t)
+{
+	struct coproc *cp = t->data;
+
+	diag(LOG_ERR, _("%s: worker %lu timed out processing %s"),
+	     cp->hp->command, (unsigned long) cp->proc->pid, cp->file);
+	kill(cp->proc->pid, SIGKILL);
+}
+
+/* Called when the process of the worker CP has terminated */
+static void
+coproc_exited(struct coproc *cp)
+{
+	if (cp->file) {
+		diag(LOG_ERR, _("%s: worker %lu terminated while processing %s"),
+		     cp->hp->command, (unsigned long) cp->proc->pid,
+		     cp->file);
+		coproc_done(cp);
+	}
+	close(cp->in);
+	if (cp->ack != -1) {
+		pollset_remove(&cp->pollidx);
+		close(cp->ack);
+	}
+	coproc_unlink(cp);
+	free(cp);
+}
+
+/* Start a new worker for the handler HP */
+static struct coproc *
+coproc_open(struct prog_handler *hp)
+{
+	int in[2], out[2];
+	int err_fd = -1;
+	struct redirector *redir = NULL;
+	struct spawn_args sa;
+	struct spawn_params sp;
+	char *kve[1] = { NULL };
+	pid_t pid;
+	struct coproc *cp;
+
+	if (pipe(in)) {
+		diag(LOG_ERR, _("%s: cannot start worker, pipe failed: %s"),
+		     hp->command, strerror(errno));
+		return NULL;
+	}
+	if (pipe(out)) {
+		diag(LOG_ERR, _("%s: cannot start worker, pipe failed: %s"),
+		     hp->command, strerror(errno));
+		close(in[0]);
+		close(in[1]);
+		return NULL;
+	}
+	fcntl(in[1], F_SETFL, fcntl(in[1], F_GETFL) | O_NONBLOCK);
+	fcntl(in[1], F_SETFD, FD_CLOEXEC);
+	fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL) | O_NONBLOCK);
+	fcntl(out[0], F_SETFD, FD_CLOEXEC);
+	if (hp->flags & HF_STDERR)
+		err_fd = redirector_open(hp->command, LOG_ERR, &redir);
+
+	if (spawn_prepare(&sa, hp, kve))
+		pid = -1;
+	else {
+		sp.uid = hp->uid;
+		sp.gidc = hp->gidc;
+		sp.gidv = hp->gidv;
+		sp.dirname = "/";
+		sp.dirfd = -1;
+		sp.fd[REDIR_OUT] = out[1];
+		sp.fd[REDIR_ERR] = err_fd;
+		sp.fd_in = in[0];
+		sp.argv = sa.argv;
+		sp.env = sa.env;
+		pid = spawn_process(&sp, hp->command);
+		spawn_free(&sa);
+	}
+	close(in[0]);
+	close(out[1]);
+	close(err_fd);
+	if (pid == -1) {
+		close(in[1]);
+		close(out[0]);
+		redirector_close(redir);
+		return NULL;
+	}
+	debug(1, (_("%s: started worker %lu"), hp->command,
+		  (unsigned long) pid));
+
+	cp = ecalloc(1, sizeof(*cp));
+	cp->hp = hp;
+	cp->in = in[1];
+	cp->ack = out[0];
+	pollset_add(cp->ack, POLLSRC_COPROC, cp, &cp->pollidx);
+	cp->proc = register_process(pid, 0);
+	cp->proc->coproc = cp;
+	cp->proc->redir[REDIR_ERR] = redir;
+
+	cp->next = coproc_head;
+	if (coproc_head)
+		coproc_head->prev = cp;
+	coproc_head = cp;
+	return cp;
+}
+
+/* Return an idle worker for the handler HP, starting it if necessary */
+static struct coproc *
+coproc_get(struct prog_handler *hp)
+{
+	struct coproc *cp;
+
+	for (cp = coproc_head; cp; cp = cp->next)
+		if (cp->hp == hp && !cp->file && cp->ack != -1)
+			return cp;
+	return coproc_open(hp);
+}
+
+/* Size of the value VAL escaped for a record */
+static size_t
+record_value_size(const char *val)
+{
+	size_t n;
+
+	for (n = 0; *val; val++)
+		n += (*val == '\\' || *val == '\n') ? 2 : 1;
+	return n;
+}
+
+/* Append the variable NAME=VAL to the record at P.  Return the pointer
+   past it. */
+static char *
+record_add(char *p, const char *name, const char *val)
+{
+	memcpy(p, "DIREVENT_", 9);
+	p += 9;
+	for (; *name; name++)
+		*p++ = toupper(*name);
+	*p++ = '=';
+	for (; *val; val++) {
+		if (*val == '\\') {
+			*p++ = '\\';
+			*p++ = '\\';
+		} else if (*val == '\n') {
+			*p++ = '\\';
+			*p++ = 'n';
+		} else
+			*p++ = *val;
+	}
+	*p++ = '\n';
+	return p;
+}
+
+/* Send the event EVENT on FILE in DIRNAME to a worker of the handler
+   HP.  Return 0 on success and -1 on error. */
 static int
-prog_handler_run(struct watchpoint *wp, event_mask *event,
-		 const char *dirname, const char *file, void *data)
+coproc_start(struct prog_handler *hp, event_mask *event,
+	     const char *dirname, const char *file,
+	     struct stat const *st, unsigned long count)
+{
+	struct coproc *cp;
+	char *kve[KVE_MAX];
+	char *rec, *p;
+	size_t size;
+	ssize_t n;
+	int i;
+
+	cp = coproc_get(hp);
+	if (!cp)
+		return -1;
+
+	kve_setup(kve, event, file, st, count);
+	size = sizeof("DIREVENT_DIR=\n") + record_value_size(dirname) + 1;
+	if (!(hp->flags & HF_COUNT)) {
+		/* Records carry the same variables as the environment */
+		for (i = 0; kve[i]; i += 2)
+			if (strcmp(kve[i], "sample_count") == 0) {
+				kve[i] = NULL;
+				break;
+			}
+	}
+	for (i = 0; kve[i]; i += 2)
+		size += sizeof("DIREVENT_=\n") + strlen(kve[i])
+			+ record_value_size(kve[i+1]);
+	p = rec = scratch_alloc(size);
+	p = record_add(p, "dir", dirname);
+	for (i = 0; kve[i]; i += 2)
+		p = record_add(p, kve[i], kve[i+1]);
+	*p++ = '\n';
+
+	/* The pipe is empty, since the worker has acknowledged its
+	   previous record, so a short write means it misbehaves */
+	n = write(cp->in, rec, p - rec);
+	if (n != p - rec) {
+		diag(LOG_ERR, _("%s: cannot write to worker %lu: %s"),
+		     hp->command, (unsigned long) cp->proc->pid,
+		     n == -1 ? strerror(errno) : _("short write"));
+		kill(cp->proc->pid, SIGKILL);
+		return -1;
+	}
+	debug(1, (_("%s: worker %lu processing dir=%s, file=%s"),
+		  hp->command, (unsigned long) cp->proc->pid, dirname, file));
+	cp->file = estrdup(file);
+	handler_started(hp);
+	if (hp->timeout)
+		timer_set(&cp->timer, hp->timeout, coproc_timeout, cp);
+	return 0;
+}
+
+/* Handle the acknowledgement LINE from the worker CP */
+static void
+coproc_ack(struct coproc *cp, const char *line)
+{
+	char *end;
+	long status;
+
+	if (!cp->file) {
+		diag(LOG_ERR, _("%s: unexpected output from worker %lu: %s"),
+		     cp->hp->command, (unsigned long) cp->proc->pid, line);
+		return;
+	}
+	errno = 0;
+	status = strtol(line, &end, 10);
+	if (errno || end == line || *end)
+		diag(LOG_ERR, _("%s: invalid acknowledgement from worker %lu: %s"),
+		     cp->hp->command, (unsigned long) cp->proc->pid, line);
+	else if (status)
+		diag(LOG_ERR, _("%s: worker %lu failed on %s with status %ld"),
+		     cp->hp->command, (unsigned long) cp->proc->pid,
+		     cp->file, status);
+	else
+		debug(1, (_("%s: worker %lu finished %s"), cp->hp->command,
+			  (unsigned long) cp->proc->pid, cp->file));
+	coproc_done(cp);
+}
+
+/* Read the acknowledgements available from the worker CP */
+static void
+coproc_read(struct coproc *cp)
+{
+	ssize_t n;
+
+	while ((n = read(cp->ack, cp->buf + cp->len,
+			 sizeof(cp->buf) - cp->len - 1)) > 0) {
+		char *start = cp->buf, *end = cp->buf + cp->len + n, *p;
+
+		while ((p = memchr(start, '\n', end - start)) != NULL) {
+			*p = 0;
+			coproc_ack(cp, start);
+			start = p + 1;
+		}
+		cp->len = end - start;
+		if (cp->len == sizeof(cp->buf) - 1) {
+			/* Overlong line */
+			cp->buf[cp->len] = 0;
+			coproc_ack(cp, cp->buf);
+			cp->len = 0;
+		} else
+			memmove(cp->buf, start, cp->len);
+	}
+	if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+		/* The worker closed its output: it can't be used any
+		   more.  Closing its input should make it exit. */
+		pollset_remove(&cp->pollidx);
+		close(cp->ack);
+		cp->ack = -1;
+		if (!cp->file)
+			kill(cp->proc->pid, SIGTERM);
+	}
+}
+
+/* Wait for input on descriptor FD, servicing the redirectors and
+   coprocesses and reaping terminated processes meanwhile.  Wait at most TIMEOUT
+   milliseconds (-1 means infinity).  FD can be -1, if the caller is
+   interested only in servicing the redirectors.  Return 0 if FD is
+   ready for reading, 1 if it is not (i.e. some redirectors,
+   coprocesses or processes have been serviced or the timeout expired), and -1 on
+   error (errno is set). */
+int
+redirector_wait(int fd, int timeout)
+{
+	static struct pollsrc *ready;
+	static size_t ready_max;
+	size_t i, n;
+	int type;
+	int rc;
+	int run_queue = 0;
+
+	if (poll_count == 1 && fd != -1 && timeout == -1)
+		return 0;
+	pollset_grow();
+	poll_fd[0].fd = fd;
+	poll_fd[0].events = POLLIN;
+	if (poll(poll_fd, poll_count, timeout) == -1)
+		return -1;
+	rc = (poll_fd[0].revents & POLLIN) ? 0 : 1;
+
+	/* Servicing the entries changes the poll set, so collect the
+	   ready ones first */
+	if (poll_count > ready_max) {
+		ready_max = poll_max;
+		ready = erealloc(ready, ready_max * sizeof(ready[0]));
+	}
+	for (i = 1, n = 0; i < poll_count; i++)
+		if (poll_fd[i].revents)
+			ready[n++] = poll_src[i];
+
+	/* Processes are reaped last, because reaping a process destroys
+	   its redirectors and coprocess */
+	for (type = 0; type < POLLSRC_COUNT; type++)
+		for (i = 0; i < n; i++) {
+			if (ready[i].type != type)
+				continue;
+			switch (type) {
+			case POLLSRC_REDIR:
+				redirector_read(ready[i].ptr);
+				break;
+			case POLLSRC_COPROC:
+				coproc_read(ready[i].ptr);
+				run_queue = 1;
+				break;
+			case POLLSRC_PROC:
+				process_reap(ready[i].ptr);
+				run_queue = 1;
+				break;
+			}
+		}
+	if (run_queue)
+		job_queue_run();
+	return rc;
+}
+
+/* Start the handler HP for the event EVENT on the file FILE in
+   DIRNAME.  ST is the status of the file, if available, and COUNT is
+   the number of events the run stands for.  WP is the watchpoint that
+   reported the event, or NULL if it is not known.  IN_FD, unless -1,
+   is the descriptor to use as the standard input of the handler (a
+   batch file).  It is closed in any case.  FP is the single-flight
+   entry the run belongs to, or NULL. */
+static int
+prog_handler_start(struct prog_handler *hp, struct watchpoint *wp,
+		   event_mask *event, const char *dirname, const char *file,
+		   struct stat const *st, unsigned long count, int in_fd,
+		   struct flight *fp)
 {
 	pid_t pid;
 	int redir_fd[2] = { -1, -1 };
-	struct process *redir_proc[2] = { NULL, NULL };
+	struct redirector *redir[2] = { NULL, NULL };
 	struct process *p;
-	struct prog_handler *hp = data;
+	int dirfd;
+	struct spawn_args sa;
+	char *kve[KVE_MAX];
+
+	if (hp->flags & HF_COPROC)
+		return coproc_start(hp, event, dirname, file, st, count);
 
-	if (!hp->command)
-		return 0;
-	
 	debug(1, (_("starting %s, dir=%s, file=%s"),
 		  hp->command, dirname, file));
 	if (hp->flags & HF_STDERR)
-		redir_fd[REDIR_ERR] = open_redirector(hp->command, LOG_ERR,
-						      &redir_proc[REDIR_ERR]);
+		redir_fd[REDIR_ERR] = redirector_open(hp->command, LOG_ERR,
+						      &redir[REDIR_ERR]);
 	if (hp->flags & HF_STDOUT)
-		redir_fd[REDIR_OUT] = open_redirector(hp->command, LOG_INFO,
-						      &redir_proc[REDIR_OUT]);
+		redir_fd[REDIR_OUT] = redirector_open(hp->command, LOG_INFO,
+						      &redir[REDIR_OUT]);
+
+	/* Let the child change to the directory using its cached
+	   descriptor, if there is one */
+	if (wp && strcmp(dirname, wp->dirname) == 0)
+		dirfd = watchpoint_dirfd(wp);
+	else
+		dirfd = -1;
 	
-	pid = fork();
+	kve_setup(kve, event, file, st, count);
+	if (spawn_prepare(&sa, hp, kve))
+		pid = -1;
+	else {
+		struct spawn_params sp;
+
+		sp.uid = hp->uid;
+		sp.gidc = hp->gidc;
+		sp.gidv = hp->gidv;
+		sp.dirname = dirname;
+		sp.dirfd = dirfd;
+		sp.fd[REDIR_OUT] = redir_fd[REDIR_OUT];
+		sp.fd[REDIR_ERR] = redir_fd[REDIR_ERR];
+		sp.fd_in = in_fd;
+		sp.argv = sa.argv;
+		sp.env = sa.env;
+		pid = spawn_process(&sp, hp->command);
+		spawn_free(&sa);
+	}
+	if (in_fd != -1)
+		close(in_fd);
 	if (pid == -1) {
-		diag(LOG_ERR, "fork: %s", strerror(errno));
 		close(redir_fd[REDIR_OUT]);
 		close(redir_fd[REDIR_ERR]);
-		if (redir_proc[REDIR_OUT])
-			kill(redir_proc[REDIR_OUT]->pid, SIGKILL);
-		if (redir_proc[REDIR_ERR])
-			kill(redir_proc[REDIR_ERR]->pid, SIGKILL);
+		redirector_close(redir[REDIR_OUT]);
+		redirector_close(redir[REDIR_ERR]);
 		return -1;
 	}
 	
-	if (pid == 0) {		
-		/* child */
-		bigfd_set fdset = BIGFD_SET_ALLOC();
-		
-		if (switchpriv(hp))
-			_exit(127);
-		
-		if (chdir(dirname)) {
-			diag(LOG_CRIT, _("cannot change to %s: %s"),
-			     dirname, strerror(errno));
-			_exit(127);
+	/* master */
+	debug(1, (_("%s running; dir=%s, file=%s, pid=%lu"),
+		  hp->command, dirname, file, (unsigned long)pid));
+
+	p = register_process(pid, hp->timeout);
+	p->handler = hp;
+	p->flight = fp;
+	handler_started(hp);
+
+	memcpy(p->redir, redir, sizeof(p->redir));
+	
+	close(redir_fd[REDIR_OUT]);
+	close(redir_fd[REDIR_ERR]);
+
+	return 0;
+}
+
+/* Return true if the handler HP can be started now.  A handler with
+   the "wait" option can't be started while its previous instance is
+   running. */
+static int
+handler_can_start(struct prog_handler *hp)
+{
+	return (max_handlers == 0 || handlers_running < max_handlers)
+		&& (hp->max_running == 0 || hp->running < hp->max_running)
+		&& ((hp->flags & HF_NOWAIT) || hp->running == 0)
+		&& (!(hp->flags & HF_COPROC)
+		    || hp->running < coproc_pool_size(hp));
+}
+
+static void
+handler_started(struct prog_handler *hp)
+{
+	hp->running++;
+	handlers_running++;
+}
+
+static void
+handler_done(struct prog_handler *hp)
+{
+	if (hp) {
+		hp->running--;
+		handlers_running--;
+	}
+}
+
+/* Remove the job JP, preceded by PREV, from the queue of class CP */
+static void
+job_unlink(struct job_class *cp, struct job *jp, struct job *prev)
+{
+	if (prev)
+		prev->next = jp->next;
+	else
+		cp->head = jp->next;
+	if (cp->tail == jp)
+		cp->tail = prev;
+	jp->next = NULL;
+	cp->count--;
+	job_count--;
+	jp->hp->queued--;
+}
+
+static void
+job_free(struct job *jp)
+{
+	free(jp->dirname);
+	free(jp->file);
+	free(jp);
+}
+
+/* Remove the newest job of the lowest class below PRIO from the queue
+   and return it.  Return NULL if there are no such jobs. */
+static struct job *
+job_evict(int prio)
+{
+	int i;
+
+	for (i = PRIO_COUNT - 1; i > prio; i--) {
+		struct job_class *cp = &job_class[i];
+		struct job *jp, *prev = NULL;
+
+		if (cp->count == 0)
+			continue;
+		for (jp = cp->head; jp->next; jp = jp->next)
+			prev = jp;
+		job_unlink(cp, jp, prev);
+		return jp;
+	}
+	return NULL;
+}
+
+/* Drop the job JP removed from the queue */
+static void
+job_drop(struct job *jp)
+{
+	struct flight *fp = jp->flight;
+
+	diag(LOG_ERR, _("job queue full; dropping %s for %s/%s"),
+	     jp->hp->command, jp->dirname, jp->file);
+	job_dropped++;
+	job_class[jp->hp->priority].dropped++;
+	if (jp->in_fd != -1)
+		close(jp->in_fd);
+	job_free(jp);
+	if (fp)
+		flight_done(fp);
+}
+
+static int
+job_enqueue(struct prog_handler *hp, event_mask *event,
+	    const char *dirname, const char *file,
+	    struct stat const *st, unsigned long count, int in_fd,
+	    struct flight *fp)
+{
+	struct job_class *cp = &job_class[hp->priority];
+	struct job *jp, *victim = NULL;
+
+	if (job_count >= job_queue_size
+	    && (victim = job_evict(hp->priority)) == NULL) {
+		diag(LOG_ERR, _("job queue full; not running %s for %s/%s"),
+		     hp->command, dirname, file);
+		job_dropped++;
+		cp->dropped++;
+		if (in_fd != -1)
+			close(in_fd);
+		return -1;
+	}
+	jp = emalloc(sizeof(*jp));
+	jp->next = NULL;
+	jp->hp = hp;
+	jp->event = *event;
+	jp->dirname = estrdup(dirname);
+	jp->file = estrdup(file);
+	jp->have_stat = st != NULL;
+	if (st)
+		jp->st = *st;
+	jp->count = count;
+	jp->in_fd = in_fd;
+	jp->flight = fp;
+	jp->queued = timer_now();
+	if (cp->tail)
+		cp->tail->next = jp;
+	else
+		cp->head = jp;
+	cp->tail = jp;
+	cp->count++;
+	cp->queued++;
+	hp->queued++;
+	if (++job_count > job_count_max)
+		job_count_max = job_count;
+	job_total++;
+	debug(1, (_("queued %s, dir=%s, file=%s; %lu jobs pending"),
+		  hp->command, dirname, file, (unsigned long) job_count));
+	/* Drop the evicted job when the new one is in place, since
+	   dropping it can dispatch a single-flight rerun */
+	if (victim)
+		job_drop(victim);
+	return 0;
+}
+
+/* Return the first job in the queue of class CP that can be started
+   now, and store the job preceding it in *PPREV. */
+static struct job *
+job_class_next(struct job_class *cp, struct job **pprev)
+{
+	struct job *jp, *prev = NULL;
+
+	for (jp = cp->head; jp; prev = jp, jp = jp->next)
+		if (handler_can_start(jp->hp)) {
+			*pprev = prev;
+			return jp;
 		}
+	return NULL;
+}
 
-		if (redir_fd[REDIR_OUT] != -1) {
-			if (redir_fd[REDIR_OUT] != 1 &&
-			    dup2(redir_fd[REDIR_OUT], 1) == -1) {
-				diag(LOG_ERR, "dup2: %s", strerror(errno));
-				_exit(127);
+/* Select the next job to start.  Store its class in *PCP and the job
+   preceding it in *PPREV.  Return NULL if no job can be started. */
+static struct job *
+job_select(struct job_class **pcp, struct job **pprev)
+{
+	struct job *jp;
+	int i;
+
+	if (job_scheduler == SCHED_STRICT) {
+		for (i = 0; i < PRIO_COUNT; i++) {
+			jp = job_class_next(&job_class[i], pprev);
+			if (jp) {
+				*pcp = &job_class[i];
+				return jp;
 			}
-			BIGFD_SET(1, fdset);
 		}
-		if (redir_fd[REDIR_ERR] != -1) {
-			if (redir_fd[REDIR_ERR] != 2 &&
-			    dup2(redir_fd[REDIR_ERR], 2) == -1) {
-				diag(LOG_ERR, "dup2: %s", strerror(errno));
-				_exit(127);
-			}
-			BIGFD_SET(2, fdset);
+		return NULL;
+	}
+
+	/* Serve the current class while it has credit and startable
+	   jobs, then pass on to the next one, giving it new credit.
+	   Each class is visited at most once with fresh credit. */
+	for (i = 0; i <= PRIO_COUNT; i++) {
+		struct job_class *cp = &job_class[job_class_cur];
+
+		if (cp->credit > 0
+		    && (jp = job_class_next(cp, pprev)) != NULL) {
+			cp->credit--;
+			*pcp = cp;
+			return jp;
 		}
-		close_fds(fdset);
-		alarm(0);
-		signal_setup(SIG_DFL);
-		runcmd(hp->command, hp->env, event, file, hp->flags & HF_SHELL);
+		job_class_cur = (job_class_cur + 1) % PRIO_COUNT;
+		job_class[job_class_cur].credit =
+			job_class_weight[job_class_cur];
 	}
+	return NULL;
+}
 
-	/* master */
-	debug(1, (_("%s running; dir=%s, file=%s, pid=%lu"),
-		  hp->command, dirname, file, (unsigned long)pid));
+/* Start queued jobs, as long as the limits permit. */
+static void
+job_queue_run(void)
+{
+	struct job_class *cp;
+	struct job *jp, *prev;
 
-	p = register_process(PROC_HANDLER, pid, time(NULL), hp->timeout);
+	if (job_queue_hold)
+		return;
+	job_queue_hold++;
+	while (job_count > 0
+	       && (max_handlers == 0 || handlers_running < max_handlers)
+	       && (jp = job_select(&cp, &prev)) != NULL) {
+		unsigned long wait;
+
+		job_unlink(cp, jp, prev);
+
+		wait = timer_now() - jp->queued;
+		job_wait_total += wait;
+		if (wait > job_wait_max)
+			job_wait_max = wait;
+		job_started++;
+		cp->runs++;
+		cp->wait_total += wait;
+		if (wait > cp->wait_max)
+			cp->wait_max = wait;
+
+		if (prog_handler_start(jp->hp, NULL, &jp->event,
+				       jp->dirname, jp->file,
+				       jp->have_stat ? &jp->st : NULL,
+				       jp->count, jp->in_fd, jp->flight)
+		    && jp->flight)
+			flight_done(jp->flight);
+		job_free(jp);
+	}
+	job_queue_hold--;
+}
 
-	if (redir_proc[REDIR_OUT]) {
-		redir_proc[REDIR_OUT]->v.master = p;
-		redir_proc[REDIR_OUT]->timeout = hp->timeout;
+/* Run the handler HP now, if the limits permit, or queue it.  The
+   arguments are as for prog_handler_start. */
+static int
+job_dispatch(struct prog_handler *hp, struct watchpoint *wp,
+	     event_mask *event, const char *dirname, const char *file,
+	     struct stat const *st, unsigned long count, int in_fd,
+	     struct flight *fp)
+{
+	/* Jobs of the same handler are started in order */
+	if (hp->queued == 0 && handler_can_start(hp)) {
+		job_class[hp->priority].runs++;
+		return prog_handler_start(hp, wp, event, dirname, file,
+					  st, count, in_fd, fp);
 	}
-	if (redir_proc[REDIR_ERR]) {
-		redir_proc[REDIR_ERR]->v.master = p;
-		redir_proc[REDIR_ERR]->timeout = hp->timeout;
+	return job_enqueue(hp, event, dirname, file, st, count, in_fd, fp);
+}
+
+/* Single-flight invocations.
+
+   A handler with the "single-flight" option runs at most one
+   invocation for each file at a time.  An invocation is in flight from
+   the moment it is started or queued until its process terminates.
+   Events for the same file that arrive meanwhile are collapsed into a
+   single pending rerun: their event masks are merged and their counts
+   are summed.  When the invocation in flight terminates, the rerun is
+   dispatched, and is in flight in its turn.  The rerun gets the
+   current status of the file, if the handler needs it.
+
+   In-flight invocations are kept in a hash table keyed by the handler
+   and the file name. */
+
+struct flight {
+	struct flight *next;          /* Next entry in the hash chain */
+	unsigned hash;                /* Hash value of the key */
+	struct prog_handler *hp;      /* Handler */
+	char *dirname;                /* Directory */
+	char *file;                   /* File name */
+	int pending;                  /* A rerun is pending */
+	event_mask event;             /* Merged events of the rerun */
+	unsigned long count;          /* Number of events it stands for */
+};
+
+static struct flight **flight_hash;
+static size_t flight_hash_size;       /* Number of buckets (power of 2) */
+static size_t flight_count;           /* Number of entries */
+
+/* Statistics */
+static unsigned long flight_total;    /* Number of invocations */
+static unsigned long flight_collapsed; /* Number of collapsed events */
+static unsigned long flight_reruns;   /* Number of reruns */
+
+static unsigned
+flight_hash_key(struct prog_handler *hp, const char *dirname,
+		const char *file)
+{
+	unsigned hash = (unsigned) ((uintptr_t) hp >> 4) * 2654435761u;
+
+	while (*dirname)
+		hash = hash * 31 + (unsigned char) *dirname++;
+	hash = hash * 31 + '/';
+	while (*file)
+		hash = hash * 31 + (unsigned char) *file++;
+	return hash;
+}
+
+static struct flight *
+flight_lookup(struct prog_handler *hp, const char *dirname,
+	      const char *file, unsigned hash)
+{
+	struct flight *fp;
+
+	if (flight_count == 0)
+		return NULL;
+	for (fp = flight_hash[hash & (flight_hash_size - 1)]; fp;
+	     fp = fp->next)
+		if (fp->hash == hash && fp->hp == hp
+		    && strcmp(fp->file, file) == 0
+		    && strcmp(fp->dirname, dirname) == 0)
+			return fp;
+	return NULL;
+}
+
+static void
+flight_insert(struct flight *fp)
+{
+	size_t i;
+
+	if (flight_count >= flight_hash_size) {
+		/* Keep the load factor at most 1 */
+		struct flight **old = flight_hash;
+		size_t j, old_size = flight_hash_size;
+
+		flight_hash_size = old_size ? old_size * 2 : 64;
+		flight_hash = ecalloc(flight_hash_size,
+				      sizeof(flight_hash[0]));
+		for (j = 0; j < old_size; j++) {
+			struct flight *q, *next;
+
+			for (q = old[j]; q; q = next) {
+				next = q->next;
+				i = q->hash & (flight_hash_size - 1);
+				q->next = flight_hash[i];
+				flight_hash[i] = q;
+			}
+		}
+		free(old);
 	}
-	memcpy(p->v.redir, redir_proc, sizeof(p->v.redir));
-	
-	close(redir_fd[REDIR_OUT]);
-	close(redir_fd[REDIR_ERR]);
+	i = fp->hash & (flight_hash_size - 1);
+	fp->next = flight_hash[i];
+	flight_hash[i] = fp;
+	flight_count++;
+}
 
-	if (hp->flags & HF_NOWAIT) {
+static void
+flight_free(struct flight *fp)
+{
+	struct flight **pp;
+
+	for (pp = &flight_hash[fp->hash & (flight_hash_size - 1)]; *pp;
+	     pp = &(*pp)->next)
+		if (*pp == fp) {
+			*pp = fp->next;
+			flight_count--;
+			break;
+		}
+	free(fp->dirname);
+	free(fp->file);
+	free(fp);
+}
+
+/* Run the single-flight handler HP for the event, or collapse the
+   event into the pending rerun, if an invocation for the same file is
+   in flight.  The arguments are as for prog_handler_start. */
+static int
+flight_dispatch(struct prog_handler *hp, struct watchpoint *wp,
+		event_mask *event, const char *dirname, const char *file,
+		struct stat const *st, unsigned long count)
+{
+	unsigned hash = flight_hash_key(hp, dirname, file);
+	struct flight *fp = flight_lookup(hp, dirname, file, hash);
+
+	if (fp) {
+		if (!fp->pending) {
+			fp->pending = 1;
+			fp->event = *event;
+			fp->count = count;
+		} else {
+			fp->event.sys_mask |= event->sys_mask;
+			fp->event.gen_mask |= event->gen_mask;
+			fp->count += count;
+		}
+		flight_collapsed++;
+		debug(1, (_("%s: %s/%s in flight; event collapsed"),
+			  hp->command, dirname, file));
 		return 0;
 	}
 
-	debug(1, (_("waiting for %s (%lu) to terminate"),
-		  hp->command, (unsigned long)pid));
-	while (time(NULL) - p->start < 2 * p->timeout) {
-		sleep(1);
-		process_cleanup(1);
-		if (p->pid == 0)
-			break;
+	fp = ecalloc(1, sizeof(*fp));
+	fp->hash = hash;
+	fp->hp = hp;
+	fp->dirname = estrdup(dirname);
+	fp->file = estrdup(file);
+	flight_insert(fp);
+	flight_total++;
+	if (job_dispatch(hp, wp, event, dirname, file, st, count, -1, fp)) {
+		flight_free(fp);
+		return -1;
 	}
 	return 0;
 }
 
+/* The invocation FP has finished: dispatch the pending rerun, if any,
+   or remove the entry. */
+static void
+flight_done(struct flight *fp)
+{
+	if (fp->pending) {
+		event_mask event = fp->event;
+		unsigned long count = fp->count;
+		struct stat st;
+		int have_stat;
+
+		fp->pending = 0;
+		flight_reruns++;
+		have_stat = (fp->hp->flags & HF_STAT)
+			&& lstat(scratch_filename(fp->dirname, fp->file),
+				 &st) == 0;
+		if (job_dispatch(fp->hp, NULL, &event,
+				 fp->dirname, fp->file,
+				 have_stat ? &st : NULL, count, -1,
+				 fp) == 0)
+			return;
+	}
+	flight_free(fp);
+}
+
+void
+job_stats_report(void)
+{
+	int i;
+
+	diag(LOG_INFO, _("handlers running: %u"), handlers_running);
+	diag(LOG_INFO,
+	     _("job queue: %lu pending (max. %lu), %lu queued, %lu dropped"),
+	     (unsigned long) job_count, (unsigned long) job_count_max,
+	     job_total, job_dropped);
+	diag(LOG_INFO, _("job wait time: %lu ms average, %lu ms max."),
+	     job_started ? (unsigned long) (job_wait_total / job_started) : 0,
+	     job_wait_max);
+	/* Report the classes only if priorities are in use */
+	if (job_class_used & ~(1 << PRIO_NORMAL))
+		for (i = 0; i < PRIO_COUNT; i++) {
+			struct job_class *cp = &job_class[i];
+
+			if (!(job_class_used & (1 << i)))
+				continue;
+			diag(LOG_INFO,
+			     _("job class %s: %lu pending, %lu started "
+			       "(%lu queued), %lu dropped, latency %lu ms "
+			       "average, %lu ms max."),
+			     trans_toktostr(prio_transtab, i),
+			     (unsigned long) cp->count, cp->runs, cp->queued,
+			     cp->dropped,
+			     cp->runs ?
+				(unsigned long) (cp->wait_total / cp->runs) : 0,
+			     cp->wait_max);
+		}
+	if (flight_total)
+		diag(LOG_INFO,
+		     _("single-flight: %lu in flight, %lu invocations, "
+		       "%lu events collapsed, %lu reruns"),
+		     (unsigned long) flight_count, flight_total,
+		     flight_collapsed, flight_reruns);
+}
+
+/* Batches.
+
+   A handler with the "batch" statement collects the events instead of
+   running the command for each of them.  The command is run once the
+   batch contains the configured number of events, or when the
+   configured delay has passed since the first of them, whichever
+   occurs first.  The events are listed in a temporary file, which is
+   the standard input of the command, one per line:
+
+     SYSEV_CODE GENEV_CODE DIR/FILE
+
+   Backslashes and newlines in file names are escaped as \\ and \n.
+   The environment and macro variables are set for the first event in
+   the batch, except that $sample_count is the number of events in it.
+   The command runs in the directory of the first event.  A batch is
+   run (or queued) as a single job, so that batches of a handler are
+   run in order.  Pending batches are run when direvent exits (see
+   batch_flush_all). */
+
+struct batch {
+	struct batch *next, *prev;    /* Links in the list of pending
+					 batches */
+	struct prog_handler *hp;      /* Handler it belongs to */
+	FILE *fp;                     /* Temporary file with the list */
+	unsigned count;               /* Number of entries */
+	unsigned long events;         /* Number of events */
+	event_mask event;             /* First event */
+	char *dirname;                /* Its directory */
+	char *file;                   /* Its file name */
+	int have_stat;                /* True if st is valid */
+	struct stat st;               /* Status of the file */
+	struct timer timer;           /* Delay timer */
+};
+
+/* List of pending (non-empty) batches */
+static struct batch *batch_head;
+
+static void
+batch_unlink(struct batch *bp)
+{
+	if (bp->prev)
+		bp->prev->next = bp->next;
+	else
+		batch_head = bp->next;
+	if (bp->next)
+		bp->next->prev = bp->prev;
+	bp->next = bp->prev = NULL;
+}
+
+/* Create an unlinked temporary file */
+static FILE *
+batch_tmpfile(void)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	char *template;
+	int fd;
+	FILE *fp;
+
+	if (!tmpdir || !*tmpdir)
+		tmpdir = "/tmp";
+#ifdef O_TMPFILE
+	fd = open(tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd == -1)
+#endif
+	{
+		template = emalloc(strlen(tmpdir) + sizeof("/direvent.XXXXXX"));
+		strcat(strcpy(template, tmpdir), "/direvent.XXXXXX");
+		fd = mkstemp(template);
+		if (fd != -1) {
+			unlink(template);
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+		free(template);
+	}
+	if (fd == -1) {
+		diag(LOG_ERR, _("cannot create temporary file in %s: %s"),
+		     tmpdir, strerror(errno));
+		return NULL;
+	}
+	fp = fdopen(fd, "w+");
+	if (!fp) {
+		diag(LOG_ERR, _("cannot create temporary file in %s: %s"),
+		     tmpdir, strerror(errno));
+		close(fd);
+	}
+	return fp;
+}
+
+/* Run the batch collected for the handler HP.  If NOW is true, start
+   it right away, regardless of the limits on running handlers. */
+static void
+batch_flush(struct prog_handler *hp, int now)
+{
+	struct batch *bp = hp->batch;
+	int fd;
+
+	if (!bp || bp->count == 0)
+		return;
+	timer_cancel(&bp->timer);
+	batch_unlink(bp);
+	debug(1, (_("%s: running batch of %u entries"),
+		  hp->command, bp->count));
+	fd = -1;
+	if (fflush(bp->fp) || ferror(bp->fp))
+		diag(LOG_ERR, _("%s: error writing batch file: %s"),
+		     hp->command, strerror(errno));
+	else if ((fd = dup(fileno(bp->fp))) == -1)
+		diag(LOG_ERR, _("%s: can't duplicate batch file: %s"),
+		     hp->command, strerror(errno));
+	else {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		lseek(fd, 0, SEEK_SET);
+	}
+	fclose(bp->fp);
+	bp->fp = NULL;
+	if (fd != -1) {
+		if (now)
+			prog_handler_start(hp, NULL, &bp->event,
+					   bp->dirname, bp->file,
+					   bp->have_stat ? &bp->st : NULL,
+					   bp->events, fd, NULL);
+		else
+			job_dispatch(hp, NULL, &bp->event,
+				     bp->dirname, bp->file,
+				     bp->have_stat ? &bp->st : NULL,
+				     bp->events, fd, NULL);
+	}
+	free(bp->dirname);
+	free(bp->file);
+	bp->dirname = bp->file = NULL;
+	bp->count = 0;
+	bp->events = 0;
+}
+
+static void
+batch_expire(struct timer *t)
+{
+	batch_flush(t->data, 0);
+}
+
+/* Run all pending batches.  This is called before exiting, when the
+   job queue will not be run any more, so the batches are started
+   right away. */
+void
+batch_flush_all(void)
+{
+	while (batch_head)
+		batch_flush(batch_head->hp, 1);
+}
+
+/* Write the name NAME to FP, escaping backslashes and newlines */
+static void
+batch_write_name(FILE *fp, const char *name)
+{
+	for (; *name; name++) {
+		if (*name == '\\')
+			fputs("\\\\", fp);
+		else if (*name == '\n')
+			fputs("\\n", fp);
+		else
+			putc(*name, fp);
+	}
+}
+
+/* Add the event EVENT on FILE in DIRNAME to the batch of the handler
+   HP */
+static int
+batch_add(struct prog_handler *hp, event_mask *event,
+	  const char *dirname, const char *file,
+	  struct stat const *st, unsigned long count)
+{
+	struct batch *bp = hp->batch;
+
+	if (!bp) {
+		bp = hp->batch = ecalloc(1, sizeof(*bp));
+		bp->hp = hp;
+	}
+	if (bp->count == 0) {
+		bp->fp = batch_tmpfile();
+		if (!bp->fp)
+			return -1;
+		bp->next = batch_head;
+		if (batch_head)
+			batch_head->prev = bp;
+		batch_head = bp;
+		bp->event = *event;
+		bp->dirname = estrdup(dirname);
+		bp->file = estrdup(file);
+		bp->have_stat = st != NULL;
+		if (st)
+			bp->st = *st;
+		timer_set(&bp->timer, hp->batch_delay, batch_expire, hp);
+	}
+	fprintf(bp->fp, "%d %d ", event->sys_mask, event->gen_mask);
+	batch_write_name(bp->fp, dirname);
+	putc('/', bp->fp);
+	batch_write_name(bp->fp, file);
+	putc('\n', bp->fp);
+	bp->count++;
+	bp->events += count;
+	if (bp->count >= hp->batch_max)
+		batch_flush(hp, 0);
+	return 0;
+}
+
+static int
+prog_handler_run(struct watchpoint *wp, event_mask *event,
+		 const char *dirname, const char *file, void *data)
+{
+	struct prog_handler *hp = data;
+	struct stat const *st;
+
+	if (!hp->command)
+		return 0;
+	st = (hp->flags & HF_STAT) ? event_file_stat() : NULL;
+	if (hp->batch_max)
+		return batch_add(hp, event, dirname, file, st,
+				 event_sample_count());
+	if (hp->flags & HF_SINGLE)
+		return flight_dispatch(hp, wp, event, dirname, file, st,
+				       event_sample_count());
+	return job_dispatch(hp, wp, event, dirname, file, st,
+			    event_sample_count(), -1, NULL);
+}
+
 static void
 envfree(char **env)
 {
@@ -554,12 +1970,106 @@ envfree(char **env)
 	free(env);
 }
 
+/* Remove the references to the handler HP, which is about to be
+   freed, from the job queue, the single-flight table, the coprocess
+   workers and the process table.  Its queued jobs are dropped, its
+   workers are told to exit, and its running processes are left to
+   terminate on their own. */
+static void
+prog_handler_detach(struct prog_handler *hp)
+{
+	struct process *p;
+	struct coproc *cp, *cnext;
+	size_t i;
+	int prio;
+
+	for (prio = 0; prio < PRIO_COUNT && hp->queued; prio++) {
+		struct job *jp, *prev = NULL, *next;
+
+		for (jp = job_class[prio].head; jp; jp = next) {
+			next = jp->next;
+			if (jp->hp != hp) {
+				prev = jp;
+				continue;
+			}
+			job_unlink(&job_class[prio], jp, prev);
+			debug(1, (_("%s: handler removed; dropping job "
+				    "for %s/%s"),
+				  hp->command, jp->dirname, jp->file));
+			if (jp->in_fd != -1)
+				close(jp->in_fd);
+			job_free(jp);
+		}
+	}
+
+	for (p = proc_list; p; p = p->next)
+		if (p->handler == hp) {
+			p->handler = NULL;
+			p->flight = NULL;
+			hp->running--;
+			handlers_running--;
+		}
+
+	for (i = 0; flight_count && i < flight_hash_size; i++) {
+		struct flight *fp, *next;
+
+		for (fp = flight_hash[i]; fp; fp = next) {
+			next = fp->next;
+			if (fp->hp == hp)
+				flight_free(fp);
+		}
+	}
+
+	for (cp = coproc_head; cp; cp = cnext) {
+		cnext = cp->next;
+		if (cp->hp != hp)
+			continue;
+		if (cp->file)
+			coproc_done(cp);
+		/* The worker exits at end of file */
+		close(cp->in);
+		if (cp->ack != -1) {
+			pollset_remove(&cp->pollidx);
+			close(cp->ack);
+		}
+		cp->proc->coproc = NULL;
+		coproc_unlink(cp);
+		free(cp);
+	}
+}
+
 void
 prog_handler_free(struct prog_handler *hp)
 {
+	if (hp->batch) {
+		/* Don't lose the events collected so far */
+		batch_flush(hp, 1);
+		free(hp->batch);
+	}
+	prog_handler_detach(hp);
 	free(hp->command);
 	free(hp->gidv);
 	envfree(hp->env);
+	template_free(hp->tmpl);
+}
+
+/* Return true if the command or environment of HP refers to one of
+   the macros describing the status of the file. */
+static int
+prog_handler_uses_stat(struct prog_handler *hp)
+{
+	static char *names[] = { "file_size", "file_mtime", "file_inode",
+				 NULL };
+	size_t i, j;
+
+	for (i = 0; names[i]; i++) {
+		if (hp->command && strstr(hp->command, names[i]))
+			return 1;
+		for (j = 0; hp->env && hp->env[j]; j++)
+			if (strstr(hp->env[j], names[i]))
+				return 1;
+	}
+	return 0;
 }
 
 static void
@@ -570,18 +2080,30 @@ prog_handler_free_data(void *ptr)
 
 struct handler *
 prog_handler_alloc(event_mask ev_mask, filpatlist_t fpat,
-		   struct prog_handler *p)
+		   filpredlist_t fpred, struct prog_handler *p)
 {
 	struct handler *hp = handler_alloc(ev_mask);
 	struct prog_handler *mem;
 
 	hp->fnames = fpat;
+	hp->fpreds = fpred;
+	filpatlist_compile(fpat);
 	hp->run = prog_handler_run;
 	hp->free = prog_handler_free_data;
+	/* The file is stat'ed anyway if there are predicates */
+	if (fpred || prog_handler_uses_stat(p))
+		p->flags |= HF_STAT;
+	/* The environment of direvent does not change after startup, so
+	   the template can be compiled now */
+	p->tmpl = template_compile(p->command, p->flags, p->env);
+	if (!p->tmpl)
+		debug(1, (_("%s: expanding command on each run"),
+			  p->command));
 	mem = emalloc(sizeof(*mem));
 	*mem = *p;
 	hp->data = mem;
 	memset(p, 0, sizeof(*p));
+	job_class_used |= 1 << mem->priority;
 	return hp;
 }
 
@@ -0,0 +1,420 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2016 Sergey Poznyakoff
+
+   Direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   Direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+/* Rate limiting.
+
+   Events delivered to a handler with the "rate-limit" statement pass
+   through token buckets.  A bucket holds at most BURST tokens and is
+   refilled with RATE tokens per PERIOD.  Each delivered event takes
+   one token.  Depending on the scope, the handler has a single bucket,
+   or one bucket for each directory or for each file.
+
+   An event that finds its bucket empty is dropped, deferred or
+   coalesced, depending on the mode.  Deferred events are kept in a
+   queue of limited size and delivered in order as tokens become
+   available.  Coalesced events are merged into a single summary event,
+   delivered when the next token becomes available: its event mask is
+   the union of theirs, its file is the last of them, and its sample
+   count is the total number of events it stands for.
+
+   To avoid rounding errors, the contents of a bucket is kept as a
+   credit: a token costs PERIOD units, and RATE units are added each
+   millisecond.
+
+   Buckets are kept in a hash table keyed by the directory or file
+   name.  Buckets that are full and have no pending events are
+   removed when the table fills up. */
+
+#include "direvent.h"
+
+/* A deferred or summary event */
+struct rl_event {
+	struct rl_event *next;
+	event_mask event;             /* Event (merged, for a summary) */
+	char *dirname;                /* Directory */
+	char *file;                   /* File name */
+	unsigned long count;          /* Number of events it stands for */
+};
+
+struct rl_bucket {
+	struct rl_bucket *next;       /* Next bucket in the hash chain */
+	unsigned hash;                /* Hash value of the key */
+	char *key;                    /* Directory or file name, or "" */
+	struct ratelimit *rl;         /* Limiter it belongs to */
+	unsigned long long credit;    /* Available credit */
+	timer_msec_t last;            /* Time of the last refill */
+	struct timer timer;           /* Expires when a token is available */
+	struct rl_event *head, *tail; /* Pending events */
+	size_t qlen;                  /* Number of them */
+};
+
+struct ratelimit {
+	struct handler *hp;           /* Handler it guards */
+	struct ratelimit_conf conf;   /* Configuration */
+	unsigned long long capacity;  /* Bucket capacity (credit units) */
+	struct rl_bucket **hash;      /* Hash table of buckets */
+	size_t hash_size;             /* Number of buckets (power of 2) */
+	size_t count;                 /* Number of entries */
+};
+
+static size_t ratelimit_count;        /* Number of limiters */
+
+/* Statistics */
+static unsigned long rl_passed;       /* Events passed immediately */
+static unsigned long rl_deferred;     /* Events deferred */
+static unsigned long rl_coalesced;    /* Events coalesced */
+static unsigned long rl_dropped;      /* Events dropped */
+static unsigned long rl_delivered;    /* Pending events delivered */
+static size_t rl_pending;             /* Events pending now */
+
+static char const *rl_scope_str[] = {
+	[RL_SCOPE_WATCHER]   = "watcher",
+	[RL_SCOPE_DIRECTORY] = "directory",
+	[RL_SCOPE_FILE]      = "file"
+};
+
+/* Create a rate limiter for the handler HP */
+struct ratelimit *
+ratelimit_create(struct handler *hp, struct ratelimit_conf const *conf)
+{
+	struct ratelimit *rl = ecalloc(1, sizeof(*rl));
+
+	rl->hp = hp;
+	rl->conf = *conf;
+	rl->capacity = (unsigned long long) conf->burst * conf->period;
+	ratelimit_count++;
+	debug(2, (_("rate limit: %lu events per %lu ms, burst %lu, per %s"),
+		  conf->rate, conf->period, conf->burst,
+		  rl_scope_str[conf->scope]));
+	return rl;
+}
+
+static void
+rl_event_free(struct rl_event *ep)
+{
+	free(ep->dirname);
+	free(ep->file);
+	free(ep);
+}
+
+static void
+bucket_free(struct rl_bucket *bp)
+{
+	struct rl_event *ep, *next;
+
+	timer_cancel(&bp->timer);
+	for (ep = bp->head; ep; ep = next) {
+		next = ep->next;
+		rl_event_free(ep);
+	}
+	rl_pending -= bp->qlen;
+	free(bp->key);
+	free(bp);
+}
+
+void
+ratelimit_free(struct ratelimit *rl)
+{
+	size_t i;
+
+	for (i = 0; i < rl->hash_size; i++) {
+		struct rl_bucket *bp, *next;
+
+		for (bp = rl->hash[i]; bp; bp = next) {
+			next = bp->next;
+			bucket_free(bp);
+		}
+	}
+	free(rl->hash);
+	free(rl);
+	ratelimit_count--;
+}
+
+/* Add the credit accumulated since the last refill to the bucket BP */
+static void
+bucket_refill(struct ratelimit *rl, struct rl_bucket *bp, timer_msec_t now)
+{
+	timer_msec_t elapsed;
+
+	if (now <= bp->last)
+		return;
+	elapsed = now - bp->last;
+	bp->last = now;
+	if (elapsed >= rl->capacity / rl->conf.rate + 1
+	    || bp->credit + elapsed * rl->conf.rate >= rl->capacity)
+		bp->credit = rl->capacity;
+	else
+		bp->credit += elapsed * rl->conf.rate;
+}
+
+/* Take a token from the bucket BP.  Return 1 on success, 0 if the
+   bucket is empty. */
+static int
+bucket_take(struct ratelimit *rl, struct rl_bucket *bp)
+{
+	if (bp->credit < rl->conf.period)
+		return 0;
+	bp->credit -= rl->conf.period;
+	return 1;
+}
+
+/* Return the number of milliseconds till a token is available in the
+   empty bucket BP. */
+static unsigned long
+bucket_wait(struct ratelimit *rl, struct rl_bucket *bp)
+{
+	unsigned long long need = rl->conf.period - bp->credit;
+	return (need + rl->conf.rate - 1) / rl->conf.rate;
+}
+
+static int
+bucket_idle(struct ratelimit *rl, struct rl_bucket *bp, timer_msec_t now)
+{
+	if (bp->qlen)
+		return 0;
+	bucket_refill(rl, bp, now);
+	return bp->credit == rl->capacity;
+}
+
+/* Remove idle buckets from the hash table of RL */
+static void
+ratelimit_sweep(struct ratelimit *rl, timer_msec_t now)
+{
+	size_t i;
+
+	for (i = 0; i < rl->hash_size; i++) {
+		struct rl_bucket **pp = &rl->hash[i];
+
+		while (*pp) {
+			struct rl_bucket *bp = *pp;
+
+			if (bucket_idle(rl, bp, now)) {
+				*pp = bp->next;
+				bucket_free(bp);
+				rl->count--;
+			} else
+				pp = &bp->next;
+		}
+	}
+}
+
+static unsigned
+rl_hash_key(const char *key)
+{
+	unsigned hash = 0;
+
+	while (*key)
+		hash = hash * 31 + (unsigned char) *key++;
+	return hash;
+}
+
+static void
+ratelimit_insert(struct ratelimit *rl, struct rl_bucket *bp, timer_msec_t now)
+{
+	size_t i;
+
+	if (rl->count >= rl->hash_size) {
+		ratelimit_sweep(rl, now);
+		/* Grow the table unless the sweep has freed enough room */
+		if (rl->count >= rl->hash_size / 2) {
+			struct rl_bucket **old = rl->hash;
+			size_t j, old_size = rl->hash_size;
+
+			rl->hash_size = old_size ? old_size * 2 : 16;
+			rl->hash = ecalloc(rl->hash_size,
+					   sizeof(rl->hash[0]));
+			for (j = 0; j < old_size; j++) {
+				struct rl_bucket *q, *next;
+
+				for (q = old[j]; q; q = next) {
+					next = q->next;
+					i = q->hash & (rl->hash_size - 1);
+					q->next = rl->hash[i];
+					rl->hash[i] = q;
+				}
+			}
+			free(old);
+		}
+	}
+	i = bp->hash & (rl->hash_size - 1);
+	bp->next = rl->hash[i];
+	rl->hash[i] = bp;
+	rl->count++;
+}
+
+/* Return the bucket for FILE in DIRNAME, creating it if necessary */
+static struct rl_bucket *
+bucket_get(struct ratelimit *rl, const char *dirname, const char *file,
+	   timer_msec_t now)
+{
+	const char *key;
+	unsigned hash;
+	struct rl_bucket *bp;
+
+	switch (rl->conf.scope) {
+	case RL_SCOPE_DIRECTORY:
+		key = dirname;
+		break;
+	case RL_SCOPE_FILE:
+		key = scratch_filename(dirname, file);
+		break;
+	default:
+		key = "";
+	}
+	hash = rl_hash_key(key);
+	if (rl->count) {
+		for (bp = rl->hash[hash & (rl->hash_size - 1)]; bp;
+		     bp = bp->next)
+			if (bp->hash == hash && strcmp(bp->key, key) == 0)
+				return bp;
+	}
+
+	bp = ecalloc(1, sizeof(*bp));
+	bp->hash = hash;
+	bp->key = estrdup(key);
+	bp->rl = rl;
+	bp->credit = rl->capacity;
+	bp->last = now;
+	ratelimit_insert(rl, bp, now);
+	return bp;
+}
+
+static void bucket_expire(struct timer *t);
+
+static void
+bucket_schedule(struct ratelimit *rl, struct rl_bucket *bp)
+{
+	if (!bp->timer.active)
+		timer_set(&bp->timer, bucket_wait(rl, bp), bucket_expire, bp);
+}
+
+/* Deliver the pending events of the bucket, as long as it has tokens */
+static void
+bucket_expire(struct timer *t)
+{
+	struct rl_bucket *bp = t->data;
+	struct ratelimit *rl = bp->rl;
+
+	bucket_refill(rl, bp, timer_now());
+	while (bp->head && bucket_take(rl, bp)) {
+		struct rl_event *ep = bp->head;
+
+		bp->head = ep->next;
+		if (!bp->head)
+			bp->tail = NULL;
+		bp->qlen--;
+		rl_pending--;
+		rl_delivered++;
+		debug(1, (_("rate limit: delivering %s/%s (%lu events)"),
+			  ep->dirname, ep->file, ep->count));
+		handler_deliver(rl->hp, &ep->event, ep->dirname, ep->file,
+				ep->count);
+		rl_event_free(ep);
+	}
+	if (bp->head)
+		bucket_schedule(rl, bp);
+}
+
+/* Account for the event EVENT on FILE in DIRNAME, which stands for
+   COUNT events, to be delivered to the handler HP.  Return 0 if it
+   must be delivered now.  Otherwise, drop, defer or coalesce it and
+   return 1. */
+int
+ratelimit_check(struct handler *hp, event_mask *event,
+		const char *dirname, const char *file, unsigned long count)
+{
+	struct ratelimit *rl = hp->ratelimit;
+	timer_msec_t now = timer_now();
+	struct rl_bucket *bp = bucket_get(rl, dirname, file, now);
+	struct rl_event *ep;
+
+	bucket_refill(rl, bp, now);
+	/* Pending events are delivered first */
+	if (bp->qlen == 0 && bucket_take(rl, bp)) {
+		rl_passed++;
+		return 0;
+	}
+
+	switch (rl->conf.mode) {
+	case RL_DROP:
+		rl_dropped++;
+		debug(1, (_("rate limit: dropping event on %s/%s"),
+			  dirname, file));
+		return 1;
+
+	case RL_DEFER:
+		if (bp->qlen >= rl->conf.queue_size) {
+			rl_dropped++;
+			debug(1, (_("rate limit: queue full; dropping event "
+				    "on %s/%s"),
+				  dirname, file));
+			return 1;
+		}
+		rl_deferred++;
+		debug(1, (_("rate limit: deferring event on %s/%s"),
+			  dirname, file));
+		break;
+
+	case RL_COALESCE:
+		rl_coalesced++;
+		ep = bp->head;
+		if (ep) {
+			ep->event.sys_mask |= event->sys_mask;
+			ep->event.gen_mask |= event->gen_mask;
+			ep->count += count;
+			if (strcmp(ep->file, file)) {
+				free(ep->file);
+				ep->file = estrdup(file);
+			}
+			if (strcmp(ep->dirname, dirname)) {
+				free(ep->dirname);
+				ep->dirname = estrdup(dirname);
+			}
+			return 1;
+		}
+		debug(1, (_("rate limit: coalescing events on %s/%s"),
+			  dirname, file));
+		break;
+	}
+
+	ep = emalloc(sizeof(*ep));
+	ep->next = NULL;
+	ep->event = *event;
+	ep->dirname = estrdup(dirname);
+	ep->file = estrdup(file);
+	ep->count = count;
+	if (bp->tail)
+		bp->tail->next = ep;
+	else
+		bp->head = ep;
+	bp->tail = ep;
+	bp->qlen++;
+	rl_pending++;
+	bucket_schedule(rl, bp);
+	return 1;
+}
+
+void
+ratelimit_stats_report(void)
+{
+	if (ratelimit_count == 0)
+		return;
+	diag(LOG_INFO,
+	     _("rate limit: %lu passed, %lu deferred, %lu coalesced, "
+	       "%lu dropped, %lu delivered later, %lu pending"),
+	     rl_passed, rl_deferred, rl_coalesced, rl_dropped,
+	     rl_delivered, (unsigned long) rl_pending);
+}
@@ -0,0 +1,188 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2016 Sergey Poznyakoff
+
+   Direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   Direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+/* Spawning handler processes.
+
+   Handler processes are created with vfork(2), so that the cost of
+   starting a handler does not depend on the size of the daemon.  The
+   command line and environment are prepared by the caller in advance.
+   The child shares the address space with its parent, therefore it
+   does only the minimum needed before execve(2): switches privileges,
+   changes to the working directory, sets up the standard streams and
+   closes the remaining descriptors.  It must neither allocate memory
+   nor call diag(): the only thing it is allowed to modify is the
+   spawn_status structure below, which the parent inspects when the
+   child has exec'ed or exited. */
+
+#include "direvent.h"
+#include <signal.h>
+#include <grp.h>
+#include <fcntl.h>
+
+/* Spawn failure stages */
+enum {
+	SPAWN_OK,
+	SPAWN_FORK,
+	SPAWN_SETGROUPS,
+	SPAWN_SETREGID,
+	SPAWN_SETREUID,
+	SPAWN_CHDIR,
+	SPAWN_DUP2,
+	SPAWN_EXEC
+};
+
+struct spawn_status {
+	int stage;                    /* Stage at which the child failed */
+	int ec;                       /* Error code */
+};
+
+static struct spawn_status volatile spawn_status;
+
+/* Close all descriptors starting from FD.  OPEN_MAX is the maximum
+   number of open descriptors.  If CLOEXEC is not 0, the caller is
+   going to exec or exit right away, so it is enough to mark the
+   descriptors close-on-exec, which is cheaper than closing them. */
+static void
+close_from(int fd, int open_max, int cloexec)
+{
+#ifdef HAVE_CLOSE_RANGE
+# ifdef CLOSE_RANGE_CLOEXEC
+	if (cloexec && close_range(fd, ~0U, CLOSE_RANGE_CLOEXEC) == 0)
+		return;
+# endif
+	if (close_range(fd, ~0U, 0) == 0)
+		return;
+#endif
+	for (; fd < open_max; fd++)
+		close(fd);
+}
+
+static void
+spawn_fail(int stage)
+{
+	spawn_status.ec = errno;
+	spawn_status.stage = stage;
+	_exit(127);
+}
+
+/* Child part of the spawn.  See the comment at the top of the file. */
+static void
+spawn_child(struct spawn_params *sp, int open_max, sigset_t *oldmask)
+{
+	if (sp->uid != 0 && sp->uid != getuid()) {
+		if (setgroups(sp->gidc, sp->gidv) < 0)
+			spawn_fail(SPAWN_SETGROUPS);
+		if (setregid(sp->gidv[0], sp->gidv[0]) < 0)
+			spawn_fail(SPAWN_SETREGID);
+		if (setreuid(sp->uid, sp->uid) < 0)
+			spawn_fail(SPAWN_SETREUID);
+	}
+
+	if (sp->dirfd != -1 ? fchdir(sp->dirfd) : chdir(sp->dirname))
+		spawn_fail(SPAWN_CHDIR);
+
+	if (sp->fd_in == -1)
+		close(0);
+	else if (sp->fd_in != 0 && dup2(sp->fd_in, 0) == -1)
+		spawn_fail(SPAWN_DUP2);
+	if (sp->fd[REDIR_OUT] == -1)
+		close(1);
+	else if (sp->fd[REDIR_OUT] != 1 && dup2(sp->fd[REDIR_OUT], 1) == -1)
+		spawn_fail(SPAWN_DUP2);
+	if (sp->fd[REDIR_ERR] == -1)
+		close(2);
+	else if (sp->fd[REDIR_ERR] != 2 && dup2(sp->fd[REDIR_ERR], 2) == -1)
+		spawn_fail(SPAWN_DUP2);
+	close_from(3, open_max, 1);
+
+	signal_setup(SIG_DFL);
+	sigprocmask(SIG_SETMASK, oldmask, NULL);
+
+	execve(sp->argv[0], sp->argv, sp->env);
+	spawn_fail(SPAWN_EXEC);
+}
+
+/* Report the failure ST of the child process that ran COMMAND as
+   described by SP. */
+static void
+spawn_report(struct spawn_status volatile *st, struct spawn_params *sp,
+	     const char *command)
+{
+	char const *what;
+
+	switch (st->stage) {
+	case SPAWN_OK:
+		return;
+	case SPAWN_FORK:
+		what = "fork";
+		break;
+	case SPAWN_SETGROUPS:
+		what = "setgroups";
+		break;
+	case SPAWN_SETREGID:
+		what = "setregid";
+		break;
+	case SPAWN_SETREUID:
+		what = "setreuid";
+		break;
+	case SPAWN_CHDIR:
+		diag(LOG_CRIT, _("cannot change to %s: %s"),
+		     sp->dirname, strerror(st->ec));
+		return;
+	case SPAWN_DUP2:
+		what = "dup2";
+		break;
+	case SPAWN_EXEC:
+		diag(LOG_ERR, "execve: %s \"%s\": %s", sp->argv[0], command,
+		     strerror(st->ec));
+		return;
+	default:
+		diag(LOG_ERR, _("unknown spawn failure %d: %s"), st->stage,
+		     strerror(st->ec));
+		return;
+	}
+	diag(LOG_CRIT, "%s: %s", what, strerror(st->ec));
+}
+
+/* Start the process described by SP for running COMMAND.  Return its
+   PID or -1 on error. */
+pid_t
+spawn_process(struct spawn_params *sp, const char *command)
+{
+	static int open_max;
+	sigset_t mask, oldmask;
+	pid_t pid;
+
+	if (!open_max)
+		open_max = sysconf(_SC_OPEN_MAX);
+
+	/* Block the signals, so that the handlers of the parent don't
+	   get run in the child before it resets them */
+	sigfillset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, &oldmask);
+
+	spawn_status.stage = SPAWN_OK;
+	pid = vfork();
+	if (pid == 0)
+		spawn_child(sp, open_max, &oldmask);
+	if (pid == -1) {
+		spawn_status.ec = errno;
+		spawn_status.stage = SPAWN_FORK;
+	}
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	spawn_report(&spawn_status, sp, command);
+	return pid;
+}
@@ -0,0 +1,559 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2016 Sergey Poznyakoff
+
+   Direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   Direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+/* Handler templates.
+
+   The command line and environment of a handler are the same for all
+   its invocations, except for the values of the event macros ($file,
+   $genev_name, etc.) substituted into them.  Instead of splitting the
+   command and building the environment anew for each event, they are
+   compiled into templates.  A template string is a sequence of fixed
+   segments and substitution slots, one slot per macro reference.
+   Filling a template copies the segments and the macro values into
+   memory allocated from the scratch arena.
+
+   A template is compiled by expanding the command and environment as
+   usual, with each macro defined to a unique marker, and locating the
+   markers in the result.  This is valid only if the expansion inserts
+   macro values verbatim.  To make sure it does, the expansion is
+   repeated with markers containing whitespace, quotes and other
+   special characters (for macros whose values may contain them), and
+   with all macros undefined, and the results are compared with the
+   template.  Handlers that fail the check (for example, those using
+   unquoted $file in a command run without the shell, which undergoes
+   word splitting, or macro operators, such as ${file:-none}) are
+   expanded on each invocation, as before. */
+
+#include "direvent.h"
+#include "wordsplit.h"
+#include <ctype.h>
+
+extern char **environ;
+
+/* Event macros.  Must be kept in sync with kve_setup in progman.c. */
+static struct tmpl_var {
+	char *name;  /* Macro name */
+	int text;    /* Its value is arbitrary text (otherwise, it is a
+			single token, such as a number) */
+} tmpl_var[] = {
+	{ "file",          1 },
+	{ "sysev_code",    0 },
+	{ "self_test_pid", 0 },
+	{ "sysev_name",    1 },
+	{ "genev_code",    0 },
+	{ "genev_name",    0 },
+	{ "file_size",     0 },
+	{ "file_mtime",    0 },
+	{ "file_inode",    0 },
+	{ "sample_count",  0 },
+};
+#define TMPL_NVARS (sizeof(tmpl_var) / sizeof(tmpl_var[0]))
+
+/* Markers delimiting a slot number in compiled strings */
+#define TMPL_BEG '\001'
+#define TMPL_END '\002'
+
+/* Segment of a template string */
+struct tmpl_seg {
+	int slot;             /* Macro index, or -1 for fixed text */
+	const char *text;     /* Fixed text */
+	size_t len;           /* Its length */
+};
+
+/* Template string */
+struct tmpl_str {
+	char *str;            /* Compiled string (with markers) */
+	size_t nseg;          /* Number of segments (0 if constant) */
+	struct tmpl_seg *seg; /* Segments */
+	size_t fixlen;        /* Total length of fixed segments */
+};
+
+struct template {
+	int shell;             /* Run the command via /bin/sh -c */
+	size_t argc;           /* Number of command line words */
+	struct tmpl_str *argv; /* Command line words */
+	size_t envc;           /* Number of environment entries */
+	struct tmpl_str *env;  /* Environment */
+	char **env_str;        /* Compiled environment (from environ_setup) */
+};
+
+/* Flags for expanding handler commands */
+#define COMMAND_WRDSF (WRDSF_NOCMD | WRDSF_QUOTE \
+		       | WRDSF_SQUEEZE_DELIMS | WRDSF_CESCAPES \
+		       | WRDSF_ENV | WRDSF_ENV_KV)
+
+/* Expand the handler command COMMAND using macros from KVE.  SHELL is
+   true if the command is to be run via the shell, in which case it is
+   expanded into a single word.  Return 0 on success.  On error, issue
+   a diagnostic message and return -1. */
+int
+command_expand(const char *command, int shell, char **kve,
+	       struct wordsplit *ws)
+{
+	ws->ws_env = (const char **) kve;
+	if (wordsplit(command, ws,
+		      COMMAND_WRDSF | (shell ? WRDSF_NOSPLIT : 0))) {
+		diag(LOG_ERR, "wordsplit: %s", wordsplit_strerror(ws));
+		return -1;
+	}
+	return 0;
+}
+
+/* Check the syntax of the handler command COMMAND, as command_expand
+   would expand it.  Return NULL if it is correct, and the error
+   message otherwise. */
+const char *
+command_check(const char *command, int shell)
+{
+	struct wordsplit ws;
+	char *kve[1] = { NULL };
+	const char *err = NULL;
+
+	ws.ws_env = (const char **) kve;
+	if (wordsplit(command, &ws,
+		      COMMAND_WRDSF | (shell ? WRDSF_NOSPLIT : 0)))
+		err = wordsplit_strerror(&ws);
+	else
+		wordsplit_free(&ws);
+	return err;
+}
+
+/* Return true if STR contains nothing that prevents it from being
+   compiled: marker characters or macro references other than plain
+   $name and ${name}. */
+static int
+tmpl_compilable(const char *str)
+{
+	for (; *str; str++) {
+		if (*str == TMPL_BEG || *str == TMPL_END)
+			return 0;
+		if (str[0] == '$' && str[1] == '{') {
+			str += 2;
+			if (!(isalpha((unsigned char)*str) || *str == '_'))
+				return 0;
+			while (isalnum((unsigned char)*str) || *str == '_')
+				str++;
+			if (*str != '}')
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* Probe kinds */
+enum {
+	PROBE_MARKER,  /* Markers used for compilation */
+	PROBE_SPECIAL, /* Markers containing special characters */
+	PROBE_UNSET,   /* No macros defined */
+	PROBE_MAX
+};
+
+/* Macro values for PROBE_SPECIAL.  For text macros, these are
+   markers with the characters " '\"\\$\t" inserted before TMPL_END.
+   Token macros keep their plain markers, so that they can be used
+   unquoted. */
+static char tmpl_special[TMPL_NVARS][10];
+
+/* Fill KVE with macro definitions for the probe PROBE. */
+static void
+tmpl_probe_kve(char **kve, int probe)
+{
+	static char marker[TMPL_NVARS][4];
+	size_t i, n = 0;
+
+	if (probe != PROBE_UNSET)
+		for (i = 0; i < TMPL_NVARS; i++) {
+			marker[i][0] = TMPL_BEG;
+			marker[i][1] = 'A' + i;
+			marker[i][2] = TMPL_END;
+			marker[i][3] = 0;
+			if (tmpl_var[i].text) {
+				tmpl_special[i][0] = TMPL_BEG;
+				tmpl_special[i][1] = 'A' + i;
+				strcpy(tmpl_special[i] + 2, " '\"\\$\t");
+				tmpl_special[i][8] = TMPL_END;
+				tmpl_special[i][9] = 0;
+			} else
+				strcpy(tmpl_special[i], marker[i]);
+			kve[n++] = tmpl_var[i].name;
+			kve[n++] = probe == PROBE_MARKER
+				     ? marker[i] : tmpl_special[i];
+		}
+	kve[n] = NULL;
+}
+
+/* Parse the string STR containing markers into the template string
+   TS.  STR becomes owned by TS.  Return 0 on success and -1 if a
+   marker is malformed. */
+static int
+tmpl_str_parse(struct tmpl_str *ts, char *str)
+{
+	size_t n;
+	char *p;
+
+	ts->str = str;
+	ts->nseg = 0;
+	ts->seg = NULL;
+	ts->fixlen = 0;
+
+	if (!strchr(str, TMPL_BEG))
+		return strchr(str, TMPL_END) ? -1 : 0;
+
+	/* Each marker can add at most two segments */
+	n = 1;
+	for (p = str; *p; p++)
+		if (*p == TMPL_BEG)
+			n += 2;
+	ts->seg = ecalloc(n, sizeof(ts->seg[0]));
+
+	p = str;
+	while (*p) {
+		struct tmpl_seg *sp = &ts->seg[ts->nseg++];
+
+		if (*p == TMPL_BEG) {
+			if (p[1] < 'A' || p[1] >= (char)('A' + TMPL_NVARS)
+			    || p[2] != TMPL_END)
+				return -1;
+			sp->slot = p[1] - 'A';
+			p += 3;
+		} else {
+			size_t len = strcspn(p, "\001\002");
+
+			if (len == 0)
+				return -1;
+			sp->slot = -1;
+			sp->text = p;
+			sp->len = len;
+			ts->fixlen += len;
+			p += len;
+		}
+	}
+	return 0;
+}
+
+static void
+tmpl_str_free(struct tmpl_str *ts)
+{
+	free(ts->seg);
+}
+
+/* Return the length of the string TS with macro values VAL. */
+static size_t
+tmpl_str_len(struct tmpl_str *ts, char **val)
+{
+	size_t i, len = ts->fixlen;
+
+	for (i = 0; i < ts->nseg; i++)
+		if (ts->seg[i].slot != -1 && val[ts->seg[i].slot])
+			len += strlen(val[ts->seg[i].slot]);
+	return len;
+}
+
+/* Fill the template string TS with macro values VAL into BUF, which
+   must be large enough. */
+static void
+tmpl_str_fill(struct tmpl_str *ts, char **val, char *buf)
+{
+	size_t i;
+
+	for (i = 0; i < ts->nseg; i++) {
+		struct tmpl_seg *sp = &ts->seg[i];
+
+		if (sp->slot == -1) {
+			memcpy(buf, sp->text, sp->len);
+			buf += sp->len;
+		} else if (val[sp->slot]) {
+			size_t len = strlen(val[sp->slot]);
+			memcpy(buf, val[sp->slot], len);
+			buf += len;
+		}
+	}
+	*buf = 0;
+}
+
+/* Return the string TS filled with macro values VAL.  The returned
+   string is allocated from the scratch arena, unless TS is constant. */
+static char *
+tmpl_str_expand(struct tmpl_str *ts, char **val)
+{
+	char *buf;
+
+	if (ts->nseg == 0)
+		return ts->str;
+	buf = scratch_alloc(tmpl_str_len(ts, val) + 1);
+	tmpl_str_fill(ts, val, buf);
+	return buf;
+}
+
+/* Return true if the template string TS filled with macro values
+   VAL is equal to STR. */
+static int
+tmpl_str_check(struct tmpl_str *ts, char **val, const char *str)
+{
+	char *buf;
+	int rc;
+
+	if (ts->nseg == 0)
+		return strcmp(ts->str, str) == 0;
+	buf = emalloc(tmpl_str_len(ts, val) + 1);
+	tmpl_str_fill(ts, val, buf);
+	rc = strcmp(buf, str) == 0;
+	free(buf);
+	return rc;
+}
+
+/* Verify that the probe strings STR[PROBE_SPECIAL] and STR[PROBE_UNSET]
+   agree with the template string TS. */
+static int
+tmpl_str_verify(struct tmpl_str *ts, char **str)
+{
+	char *val[TMPL_NVARS];
+	size_t i;
+
+	for (i = 0; i < TMPL_NVARS; i++)
+		val[i] = tmpl_special[i];
+	if (!tmpl_str_check(ts, val, str[PROBE_SPECIAL]))
+		return 0;
+	for (i = 0; i < TMPL_NVARS; i++)
+		val[i] = NULL;
+	return tmpl_str_check(ts, val, str[PROBE_UNSET]);
+}
+
+/* Compile the command COMMAND into TP.  Return 0 on success. */
+static int
+tmpl_compile_command(struct template *tp, const char *command)
+{
+	char *kve[2 * TMPL_NVARS + 1];
+	struct wordsplit ws[PROBE_MAX];
+	int probe, rc = 0;
+	size_t i;
+
+	if (!tmpl_compilable(command))
+		return -1;
+	for (probe = 0; probe < PROBE_MAX; probe++) {
+		tmpl_probe_kve(kve, probe);
+		if (command_expand(command, tp->shell, kve, &ws[probe])) {
+			while (probe--)
+				wordsplit_free(&ws[probe]);
+			return -1;
+		}
+	}
+
+	if (ws[PROBE_MARKER].ws_wordc == 0
+	    || (tp->shell && ws[PROBE_MARKER].ws_wordc != 1)
+	    || ws[PROBE_SPECIAL].ws_wordc != ws[PROBE_MARKER].ws_wordc
+	    || ws[PROBE_UNSET].ws_wordc != ws[PROBE_MARKER].ws_wordc)
+		rc = -1;
+	else {
+		tp->argc = ws[PROBE_MARKER].ws_wordc;
+		tp->argv = ecalloc(tp->argc, sizeof(tp->argv[0]));
+		for (i = 0; i < tp->argc; i++) {
+			char *str[PROBE_MAX];
+
+			for (probe = 0; probe < PROBE_MAX; probe++)
+				str[probe] = ws[probe].ws_wordv[i];
+			if (tmpl_str_parse(&tp->argv[i],
+					   estrdup(str[PROBE_MARKER]))
+			    || !tmpl_str_verify(&tp->argv[i], str)) {
+				rc = -1;
+				break;
+			}
+		}
+	}
+
+	for (probe = 0; probe < PROBE_MAX; probe++)
+		wordsplit_free(&ws[probe]);
+	return rc;
+}
+
+/* Return true if the variable NAME of length LEN is defined in the
+   direvent environment. */
+static int
+tmpl_env_defined(const char *name, size_t len)
+{
+	size_t i;
+
+	for (i = 0; environ[i]; i++)
+		if (strncmp(environ[i], name, len) == 0
+		    && environ[i][len] == '=')
+			return 1;
+	return 0;
+}
+
+/* Return true if the environment modifications HINT can be compiled. */
+static int
+tmpl_env_compilable(char **hint)
+{
+	size_t i;
+
+	for (i = 0; hint[i]; i++) {
+		char *p;
+		size_t len;
+
+		if (!tmpl_compilable(hint[i]))
+			return 0;
+		if (!strchr(hint[i], '$'))
+			continue;
+		/* The variable name must be fixed.  Besides, appending
+		   to or prepending to an undefined variable removes a
+		   punctuation character from the edge of the value,
+		   which depends on the value itself. */
+		len = strcspn(hint[i], "=");
+		if (memchr(hint[i], '$', len))
+			return 0;
+		p = hint[i] + len;
+		if (*p == 0)
+			continue;
+		if (len > 0 && p[-1] == '+') {
+			if (!tmpl_env_defined(hint[i], len - 1))
+				return 0;
+		} else if (p[1] == '+') {
+			if (!tmpl_env_defined(hint[i], len))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* Compile the environment modifications HINT of a handler with the
+   flags FLAGS into TP.  Return 0 on success. */
+static int
+tmpl_compile_env(struct template *tp, char **hint, int flags)
+{
+	char *kve[2 * TMPL_NVARS + 1];
+	char **env[PROBE_MAX];
+	int probe, rc = 0;
+	size_t i;
+
+	if (hint && !tmpl_env_compilable(hint))
+		return -1;
+	for (probe = 0; probe < PROBE_MAX; probe++) {
+		tmpl_probe_kve(kve, probe);
+		env[probe] = environ_setup(hint, kve, flags);
+		if (!env[probe]) {
+			while (probe--)
+				environ_free(env[probe]);
+			return -1;
+		}
+	}
+
+	tp->env_str = env[PROBE_MARKER];
+	for (i = 0; env[PROBE_MARKER][i]; i++)
+		;
+	tp->envc = i;
+	tp->env = ecalloc(i, sizeof(tp->env[0]));
+	for (i = 0; i < tp->envc; i++) {
+		char *str[PROBE_MAX];
+
+		for (probe = 0; probe < PROBE_MAX; probe++) {
+			str[probe] = env[probe][i];
+			if (!str[probe])
+				break;
+		}
+		if (probe < PROBE_MAX
+		    || tmpl_str_parse(&tp->env[i], str[PROBE_MARKER])
+		    || !tmpl_str_verify(&tp->env[i], str)) {
+			rc = -1;
+			break;
+		}
+	}
+	if (rc == 0
+	    && (env[PROBE_SPECIAL][i] || env[PROBE_UNSET][i]))
+		rc = -1;
+
+	environ_free(env[PROBE_SPECIAL]);
+	environ_free(env[PROBE_UNSET]);
+	return rc;
+}
+
+void
+template_free(struct template *tp)
+{
+	size_t i;
+
+	if (!tp)
+		return;
+	if (tp->argv) {
+		for (i = 0; i < tp->argc; i++) {
+			free(tp->argv[i].str);
+			tmpl_str_free(&tp->argv[i]);
+		}
+		free(tp->argv);
+	}
+	if (tp->env) {
+		for (i = 0; i < tp->envc; i++)
+			tmpl_str_free(&tp->env[i]);
+		free(tp->env);
+	}
+	environ_free(tp->env_str);
+	free(tp);
+}
+
+/* Compile the command line COMMAND and environment modifications HINT
+   of a handler with the flags FLAGS (HF_*) into a template.  Return NULL
+   if they cannot be compiled. */
+struct template *
+template_compile(const char *command, int flags, char **hint)
+{
+	struct template *tp = ecalloc(1, sizeof(*tp));
+
+	tp->shell = (flags & HF_SHELL) != 0;
+	if (tmpl_compile_command(tp, command)
+	    || tmpl_compile_env(tp, hint, flags)) {
+		template_free(tp);
+		return NULL;
+	}
+	return tp;
+}
+
+/* Fill the template TP with macro values from KVE.  Return the
+   command line in ARGV and the environment in ENV.  Both are allocated
+   from the scratch arena. */
+void
+template_fill(struct template *tp, char **kve, char ***argv, char ***env)
+{
+	char *val[TMPL_NVARS];
+	char **v;
+	size_t i, j;
+
+	memset(val, 0, sizeof(val));
+	for (i = 0; kve[i]; i += 2)
+		for (j = 0; j < TMPL_NVARS; j++)
+			if (strcmp(kve[i], tmpl_var[j].name) == 0) {
+				val[j] = kve[i + 1];
+				break;
+			}
+
+	if (tp->shell) {
+		v = scratch_alloc(4 * sizeof(v[0]));
+		v[0] = "/bin/sh";
+		v[1] = "-c";
+		v[2] = tmpl_str_expand(&tp->argv[0], val);
+		v[3] = NULL;
+	} else {
+		v = scratch_alloc((tp->argc + 1) * sizeof(v[0]));
+		for (i = 0; i < tp->argc; i++)
+			v[i] = tmpl_str_expand(&tp->argv[i], val);
+		v[i] = NULL;
+	}
+	*argv = v;
+
+	v = scratch_alloc((tp->envc + 1) * sizeof(v[0]));
+	for (i = 0; i < tp->envc; i++)
+		v[i] = tmpl_str_expand(&tp->env[i], val);
+	v[i] = NULL;
+	*env = v;
+}
@@ -0,0 +1,278 @@
+/* direvent - directory content watcher daemon
+   Copyright (C) 2012-2016 Sergey Poznyakoff
+
+   Direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   Direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+/* Timers.
+
+   Timers are kept in a hierarchical timer wheel driven by the
+   monotonic clock with the resolution of one millisecond.  The wheel
+   consists of TIMER_LEVELS levels of TIMER_SLOTS slots each.  A slot
+   at level L covers TIMER_SLOTS^L milliseconds.  A timer is placed
+   into the lowest level whose span covers the time remaining till its
+   expiration.  When the wheel time crosses the boundary of a slot at
+   level L > 0, the timers from that slot are redistributed among the
+   lower levels (cascaded).  Thus, setting and cancelling a timer takes
+   constant time, and so does running it, amortized.
+
+   A bitmap of non-empty slots is kept for each level, which allows to
+   skip empty slots quickly. */
+
+#include "direvent.h"
+#include <time.h>
+#include <sys/time.h>
+#include <limits.h>
+
+#define TIMER_BITS   6
+#define TIMER_SLOTS  (1 << TIMER_BITS)
+#define TIMER_MASK   (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 4
+
+/* Maximum time (ms) the wheel can hold.  Timers set farther in the
+   future are placed into the last slot and get cascaded until they
+   expire. */
+#define TIMER_SPAN   ((timer_msec_t)1 << (TIMER_BITS * TIMER_LEVELS))
+
+static struct timer *wheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t wheel_map[TIMER_LEVELS]; /* Bitmaps of non-empty slots */
+static timer_msec_t wheel_time;          /* Time of the current slot */
+static size_t timer_count;               /* Number of active timers */
+
+/* Return the current monotonic time in milliseconds */
+timer_msec_t
+timer_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (timer_msec_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return (timer_msec_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	}
+}
+
+static void
+timer_link(struct timer *t)
+{
+	timer_msec_t delta, expires = t->expires;
+	int level, slot;
+
+	if (expires < wheel_time)
+		expires = wheel_time;
+	delta = expires - wheel_time;
+	if (delta >= TIMER_SPAN)
+		expires = wheel_time + TIMER_SPAN - 1;
+	for (level = 0; level < TIMER_LEVELS - 1; level++)
+		if (delta < ((timer_msec_t)1 << (TIMER_BITS * (level + 1))))
+			break;
+	slot = (expires >> (TIMER_BITS * level)) & TIMER_MASK;
+
+	t->level = level;
+	t->slot = slot;
+	t->prev = NULL;
+	t->next = wheel[level][slot];
+	if (t->next)
+		t->next->prev = t;
+	wheel[level][slot] = t;
+	wheel_map[level] |= (uint64_t)1 << slot;
+}
+
+static void
+timer_unlink(struct timer *t)
+{
+	if (t->prev)
+		t->prev->next = t->next;
+	else {
+		wheel[t->level][t->slot] = t->next;
+		if (!t->next)
+			wheel_map[t->level] &= ~((uint64_t)1 << t->slot);
+	}
+	if (t->next)
+		t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+
+/* Arm the timer T to expire in MSEC milliseconds.  When it expires,
+   FUNC will be called with T as its argument.  If T is already armed,
+   it is re-armed. */
+void
+timer_set(struct timer *t, unsigned long msec,
+	  void (*func)(struct timer *), void *data)
+{
+	timer_msec_t now = timer_now();
+	
+	if (t->active)
+		timer_cancel(t);
+	if (timer_count == 0)
+		wheel_time = now;
+	t->expires = now + msec;
+	t->func = func;
+	t->data = data;
+	t->active = 1;
+	timer_link(t);
+	timer_count++;
+}
+
+/* Disarm the timer T.  It is OK to call it for an inactive timer. */
+void
+timer_cancel(struct timer *t)
+{
+	if (!t->active)
+		return;
+	timer_unlink(t);
+	t->active = 0;
+	timer_count--;
+}
+
+/* Move the timers from the slot SLOT at level LEVEL to lower levels */
+static void
+timer_cascade(int level, int slot)
+{
+	struct timer *t = wheel[level][slot];
+
+	wheel[level][slot] = NULL;
+	wheel_map[level] &= ~((uint64_t)1 << slot);
+	while (t) {
+		struct timer *next = t->next;
+		timer_link(t);
+		t = next;
+	}
+}
+
+/* Return the index of the first set bit in MAP at or after N, or
+   TIMER_SLOTS if there is none. */
+static int
+map_next(uint64_t map, int n)
+{
+	if (n >= TIMER_SLOTS)
+		return TIMER_SLOTS;
+	map >>= n;
+	if (map == 0)
+		return TIMER_SLOTS;
+	while (!(map & 1)) {
+		map >>= 1;
+		n++;
+	}
+	return n;
+}
+
+/* Run expired timers */
+void
+timer_run(void)
+{
+	timer_msec_t now = timer_now();
+
+	while (timer_count && wheel_time <= now) {
+		int idx = wheel_time & TIMER_MASK;
+		int next;
+
+		if (idx == 0) {
+			int level;
+
+			for (level = 1; level < TIMER_LEVELS; level++) {
+				int slot = (wheel_time >> (TIMER_BITS * level))
+					    & TIMER_MASK;
+				timer_cascade(level, slot);
+				if (slot)
+					break;
+			}
+		}
+
+		while (wheel[0][idx]) {
+			struct timer *t = wheel[0][idx];
+
+			timer_unlink(t);
+			t->active = 0;
+			timer_count--;
+			t->func(t);
+		}
+
+		/* Skip empty slots */
+		next = map_next(wheel_map[0], idx + 1);
+		if (wheel_time + (next - idx) > now + 1)
+			wheel_time = now + 1;
+		else
+			wheel_time += next - idx;
+	}
+}
+
+/* Return the number of milliseconds till the nearest timer needs
+   attention (at most INT_MAX), or -1 if there are no active timers.
+   The return value is suitable as a timeout for poll(2).
+
+   At level 0, this is the expiration time of the earliest timer.  At
+   higher levels, it is the time when the first non-empty slot is
+   cascaded.  Timers in it expire no earlier than that, and the
+   slot order does not reflect the order of expiration times of
+   timers that had to be clamped to the wheel span. */
+int
+timer_next(void)
+{
+	timer_msec_t now, min = 0;
+	int level;
+
+	if (timer_count == 0)
+		return -1;
+
+	if (wheel_map[0]) {
+		int slot;
+		struct timer *t;
+
+		slot = map_next(wheel_map[0], wheel_time & TIMER_MASK);
+		if (slot == TIMER_SLOTS)
+			slot = map_next(wheel_map[0], 0);
+		for (t = wheel[0][slot]; t; t = t->next)
+			if (min == 0 || t->expires < min)
+				min = t->expires;
+		/* Timers set to expire before the current slot are run
+		   with it */
+		if (min < wheel_time)
+			min = wheel_time;
+	}
+
+	for (level = 1; level < TIMER_LEVELS; level++) {
+		int shift = TIMER_BITS * level;
+		int cur = (wheel_time >> shift) & TIMER_MASK;
+		int slot, dist, pending;
+		timer_msec_t t;
+
+		if (!wheel_map[level])
+			continue;
+		/* Unless the wheel time is at the slot boundary, the
+		   current slot has already been cascaded, so it is
+		   examined last. */
+		pending = (wheel_time & (((timer_msec_t)1 << shift) - 1)) == 0;
+		slot = map_next(wheel_map[level], pending ? cur : cur + 1);
+		if (slot == TIMER_SLOTS)
+			slot = map_next(wheel_map[level], 0);
+		dist = (slot - cur) & TIMER_MASK;
+		if (dist == 0 && !pending)
+			dist = TIMER_SLOTS;
+		t = ((wheel_time >> shift) + dist) << shift;
+		if (min == 0 || t < min)
+			min = t;
+	}
+
+	now = timer_now();
+	if (min <= now)
+		return 0;
+	if (min - now > INT_MAX)
+		return INT_MAX;
+	return min - now;
+}
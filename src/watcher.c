@@ -16,19 +16,136 @@
 
 #include "direvent.h"
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
+#ifndef O_PATH
+# define O_PATH 0
+#endif
+#ifndef O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
+
 void
 watchpoint_ref(struct watchpoint *wpt)
 {
 	++wpt->refcnt;
 }
 
+/* Directory descriptor cache.
+
+   Descriptors of recently used watched directories are kept open, so
+   that file names can be resolved relative to them instead of walking
+   the full pathname each time.  At most dirfd_cache_size descriptors
+   are kept open; when the limit is reached, the least recently used
+   one is closed. */
+
+unsigned dirfd_cache_size = DIRFD_CACHE_SIZE;
+static struct watchpoint *dirfd_head, *dirfd_tail; /* LRU list */
+static unsigned dirfd_count;          /* Number of open descriptors */
+static unsigned long dirfd_hits, dirfd_misses;
+
+static void
+dirfd_unlink(struct watchpoint *wpt)
+{
+	if (wpt->dirfd_prev)
+		wpt->dirfd_prev->dirfd_next = wpt->dirfd_next;
+	else
+		dirfd_head = wpt->dirfd_next;
+	if (wpt->dirfd_next)
+		wpt->dirfd_next->dirfd_prev = wpt->dirfd_prev;
+	else
+		dirfd_tail = wpt->dirfd_prev;
+	wpt->dirfd_prev = wpt->dirfd_next = NULL;
+}
+
+static void
+dirfd_push(struct watchpoint *wpt)
+{
+	wpt->dirfd_prev = NULL;
+	wpt->dirfd_next = dirfd_head;
+	if (dirfd_head)
+		dirfd_head->dirfd_prev = wpt;
+	else
+		dirfd_tail = wpt;
+	dirfd_head = wpt;
+}
+
+static void
+watchpoint_dirfd_close(struct watchpoint *wpt)
+{
+	if (wpt->dirfd != -1) {
+		dirfd_unlink(wpt);
+		close(wpt->dirfd);
+		wpt->dirfd = -1;
+		dirfd_count--;
+	}
+}
+
+/* Return a descriptor of the directory watched by WPT, or -1 if it is
+   not a directory or cannot be opened. */
+int
+watchpoint_dirfd(struct watchpoint *wpt)
+{
+	int fd;
+
+	if (!wpt->isdir || dirfd_cache_size == 0)
+		return -1;
+	if (wpt->dirfd != -1) {
+		dirfd_hits++;
+		if (wpt != dirfd_head) {
+			dirfd_unlink(wpt);
+			dirfd_push(wpt);
+		}
+		return wpt->dirfd;
+	}
+
+	dirfd_misses++;
+	if (wpt->parent && wpt->parent->dirfd != -1)
+		fd = openat(wpt->parent->dirfd,
+			    strrchr(wpt->dirname, '/') + 1,
+			    O_PATH | O_DIRECTORY | O_CLOEXEC);
+	else
+		fd = open(wpt->dirname, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		debug(1, (_("cannot open %s: %s"),
+			  wpt->dirname, strerror(errno)));
+		return -1;
+	}
+	if (dirfd_count == dirfd_cache_size)
+		watchpoint_dirfd_close(dirfd_tail);
+	wpt->dirfd = fd;
+	dirfd_push(wpt);
+	dirfd_count++;
+	return fd;
+}
+
+void
+dirfd_stats_report(void)
+{
+	diag(LOG_INFO,
+	     _("directory descriptor cache: %lu hits, %lu misses, %u open"),
+	     dirfd_hits, dirfd_misses, dirfd_count);
+}
+
+/* Stat the file watched by WPT.  Subwatchers are looked up relative to
+   their parent directory. */
+static int
+watchpoint_stat(struct watchpoint *wpt, struct stat *st)
+{
+	int fd;
+
+	if (wpt->parent && (fd = watchpoint_dirfd(wpt->parent)) != -1)
+		return fstatat(fd, strrchr(wpt->dirname, '/') + 1, st, 0);
+	return stat(wpt->dirname, st);
+}
+
 void
 watchpoint_unref(struct watchpoint *wpt)
 {
 	if (--wpt->refcnt)
 		return;
+	watchpoint_dirfd_close(wpt);
 	free(wpt->dirname);
 	handler_list_unref(wpt->handler_list);
 	free(wpt);
@@ -102,6 +219,7 @@ watchpoint_install(const char *path, int *pnew)
 	        struct watchpoint *wpt = ecalloc(1, sizeof(*wpt));
 		wpt->dirname = estrdup(path);
 		wpt->wd = -1;
+		wpt->dirfd = -1;
 		wpt->handler_list = handler_list_create();
 		wpt->refcnt = 0;
 		ent->wpt = wpt;
@@ -181,6 +299,7 @@ void
 watchpoint_destroy(struct watchpoint *wpt)
 {
 	debug(1, (_("removing watcher %s"), wpt->dirname));
+	watchpoint_dirfd_close(wpt);
 	sysev_rm_watch(wpt);
 	watchpoint_remove(wpt->dirname);
 }
@@ -235,8 +354,8 @@ int
 watchpoint_install_sentinel(struct watchpoint *wpt)
 {
 	struct watchpoint *sent;
-	char *dirname;
-	char *filename;
+	const char *dirname;
+	const char *filename;
 	struct handler *hp;
 	event_mask ev_mask;
 	struct sentinel *sentinel;
@@ -258,7 +377,6 @@ watchpoint_install_sentinel(struct watchpoint *wpt)
 	
 	filpatlist_add_exact(&hp->fnames, filename);
 	handler_list_append(sent->handler_list, hp);
-	unsplit_pathname(wpt);
 	diag(LOG_NOTICE, _("installing CREATE sentinel for %s"), wpt->dirname);
 	return watchpoint_init(sent);
 }
@@ -269,12 +387,12 @@ watchpoint_init(struct watchpoint *wpt)
 	struct stat st;
 	event_mask mask = { 0, 0 };
 	struct handler *hp;
-	handler_iterator_t itr;	
+	size_t i;
 	int wd;
 
 	debug(1, (_("creating watcher %s"), wpt->dirname));
 
-	if (stat(wpt->dirname, &st)) {
+	if (watchpoint_stat(wpt, &st)) {
 		if (errno == ENOENT) {
 			return watchpoint_install_sentinel(wpt);
 		} else {
@@ -286,7 +404,7 @@ watchpoint_init(struct watchpoint *wpt)
 
 	wpt->isdir = S_ISDIR(st.st_mode);
 	
-	for_each_handler(wpt, itr, hp) {
+	for_each_handler(wpt, i, hp) {
 		mask.sys_mask |= hp->ev_mask.sys_mask;
 		mask.gen_mask |= hp->ev_mask.gen_mask;
 	}
@@ -334,20 +452,6 @@ subwatcher_create(struct watchpoint *parent, const char *dirname,
 	return 1 + watch_subdirs(wpt, notify);
 }
 
-/* Deliver GENEV_CREATE event */
-void
-deliver_ev_create(struct watchpoint *wp, const char *dirname, const char *name)
-{
-	event_mask m = { GENEV_CREATE, 0 };
-	struct handler *hp;
-	handler_iterator_t itr;
-	
-	for_each_handler(wp, itr, hp) {
-		if (handler_matches_event(hp, gen, GENEV_CREATE, name))
-			hp->run(wp, &m, dirname, name, hp->data);
-	}
-}
-
 /* Check if a new watcher must be created and create it if so.
 
    A watcher must be created if its parent's recursion depth has a non-null
@@ -357,53 +461,35 @@ deliver_ev_create(struct watchpoint *wp, const char *dirname, const char *name)
    depth decreased by one, thus eventually cutting off creation of new
    watchers.
 
-   Return 0 on success, -1 on error.
+   ISDIR tells whether the created file NAME is a directory, as reported
+   by the kernel.
+
+   No watcher is created for a directory if no file in its subtree can
+   match the path-scoped patterns of the parent's handlers.
+
+   If a watcher is created, the creation event of the directory is
+   delivered before the events of the files found in it, and a positive
+   value is returned.  Otherwise, 0 is returned and the event is left
+   for the caller to deliver.
 */
 int
-check_new_watcher(const char *dir, const char *name)
+check_new_watcher(struct watchpoint *parent, const char *name, int isdir)
 {
 	int rc;
-	char *fname;
-	struct stat st;
-	struct watchpoint *parent;
 
-	parent = watchpoint_lookup(dir);
-	if (!parent || !parent->depth)
+	if (!parent->depth || !isdir)
+		return 0;
+	if (watchpoint_subtree_match(parent, name) == 1) {
+		debug(1, (_("not watching %s/%s: no files can match"),
+			  parent->dirname, name));
 		return 0;
-	
-	fname = mkfilename(dir, name);
-	if (!fname) {
-		diag(LOG_ERR,
-		     _("cannot create watcher %s/%s: not enough memory"),
-		     dir, name);
-		return -1;
-	}
-
-	if (stat(fname, &st)) {
-		diag(LOG_ERR,
-		     _("cannot create watcher %s/%s, stat failed: %s"),
-		     dir, name, strerror(errno));
-		rc = -1;
-	} else if (S_ISDIR(st.st_mode)) {
-		deliver_ev_create(parent, parent->dirname, name);
-		rc = subwatcher_create(parent, fname, 1);
-	} else
-		rc = 0;
-	free(fname);
-	return rc;
-}
-
-int
-watchpoint_pattern_match(struct watchpoint *wpt, const char *file_name)
-{
-	struct handler *hp;
-	handler_iterator_t itr;
-
-	for_each_handler(wpt, itr, hp) {
-		if (filpatlist_match(hp->fnames, file_name) == 0)
-			return 0;
 	}
-	return 1;
+	deliver_ev_create(parent, parent->dirname, name);
+	rc = subwatcher_create(parent,
+			       scratch_filename(parent->dirname, name), 1);
+	/* The event has been delivered, even if the watcher could not
+	   be created */
+	return rc > 0 ? rc : 1;
 }
 
 /* Recursively scan subdirectories of parent and add them to the
@@ -415,6 +501,7 @@ watch_subdirs(struct watchpoint *parent, int notify)
 	struct dirent *ent;
 	int filemask;
 	int total = 0;
+	int fd;
 
 	if (!parent->isdir)
 		return 0;
@@ -425,45 +512,65 @@ watch_subdirs(struct watchpoint *parent, int notify)
 	if (!filemask)
 		return 0;
 	
-	dir = opendir(parent->dirname);
-	if (!dir) {
+	fd = watchpoint_dirfd(parent);
+	if (fd != -1)
+		fd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	else
+		fd = open(parent->dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1 || (dir = fdopendir(fd)) == NULL) {
 		diag(LOG_ERR, _("cannot open directory %s: %s"),
 		     parent->dirname, strerror(errno));
+		if (fd != -1)
+			close(fd);
 		return 0;
 	}
 
 	while (ent = readdir(dir)) {
 		struct stat st;
 		char *dirname;
+		int match;
 		
 		if (ent->d_name[0] == '.' &&
 		    (ent->d_name[1] == 0 ||
 		     (ent->d_name[1] == '.' && ent->d_name[2] == 0)))
 			continue;
 		
-		dirname = mkfilename(parent->dirname, ent->d_name);
-		if (!dirname) {
-			diag(LOG_ERR,
-			     _("cannot stat %s/%s: not enough memory"),
-			     parent->dirname, ent->d_name);
+		/* With path-scoped patterns, a subdirectory is watched if
+		   files under it can match, whatever its own name is */
+		match = watchpoint_pattern_match(parent, ent->d_name) == 0;
+		if (!match
+		    && (!parent->depth
+			|| watchpoint_subtree_match(parent, ent->d_name)))
+			continue;
+		if (fstatat(fd, ent->d_name, &st, 0)) {
+			diag(LOG_ERR, _("cannot stat %s/%s: %s"),
+			     parent->dirname, ent->d_name, strerror(errno));
 			continue;
 		}
-		if (stat(dirname, &st)) {
-			diag(LOG_ERR, _("cannot stat %s: %s"),
-			     dirname, strerror(errno));
-		} else if (watchpoint_pattern_match(parent, ent->d_name)
-			   == 0) {
-			if (notify)
-				deliver_ev_create(parent, parent->dirname,
-						  ent->d_name);
-			if (st.st_mode & filemask) {
-				int rc = subwatcher_create(parent, dirname,
-							   notify);
-				if (rc > 0)
-					total += rc;
+		if (notify && match)
+			deliver_ev_create(parent, parent->dirname,
+					  ent->d_name);
+		if (S_ISDIR(st.st_mode)
+		    ? (parent->depth
+		       && watchpoint_subtree_match(parent, ent->d_name) == 1)
+		    : !match)
+			continue;
+		if (st.st_mode & filemask) {
+			int rc;
+
+			dirname = mkfilename(parent->dirname, ent->d_name);
+			if (!dirname) {
+				diag(LOG_ERR,
+				     _("cannot create watcher %s/%s: "
+				       "not enough memory"),
+				     parent->dirname, ent->d_name);
+				continue;
 			}
+			rc = subwatcher_create(parent, dirname, notify);
+			if (rc > 0)
+				total += rc;
+			free(dirname);
 		}
-		free(dirname);
 	}
 	closedir(dir);
 	return total;
@@ -478,6 +585,8 @@ setwatcher(void *ent, void *data)
 	
 	if (wpt->wd == -1 && watchpoint_init(wpt) == 0)
 		watch_subdirs(wpt, 0);
+	/* Release the temporary strings used while setting it up */
+	scratch_reset();
 	return 0;
 }
 
@@ -524,26 +633,20 @@ shutdown_watchers(void)
 }
 
 
-char *
-split_pathname(struct watchpoint *dp, char **dirname)
+/* Split the pathname of DP into directory and file name.  Return the
+   latter.  The directory name is allocated in the scratch arena. */
+const char *
+split_pathname(struct watchpoint *dp, const char **dirname)
 {
 	char *p = strrchr(dp->dirname, '/');
 	if (p) {
-		dp->split_p = p;
-		*p++ = 0;
-		*dirname = dp->dirname;
-	} else {
-		p = dp->dirname;
-		*dirname = ".";
-	}
-	return p;
-}
-
-void
-unsplit_pathname(struct watchpoint *dp)
-{
-	if (dp->split_p) {
-		*dp->split_p = '/';
-		dp->split_p = NULL;
+		size_t len = p - dp->dirname;
+		char *s = scratch_alloc(len + 1);
+		memcpy(s, dp->dirname, len);
+		s[len] = 0;
+		*dirname = s;
+		return p + 1;
 	}
+	*dirname = ".";
+	return dp->dirname;
 }
@@ -0,0 +1,292 @@
+/* dfacmp.c - compare the pattern automaton with fnmatch and regexec
+   This file is part of Direvent testsuite.
+   Copyright (C) 2013-2016 Sergey Poznyakoff
+
+   Direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   Direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+/* Usage: dfacmp < INPUT
+
+   INPUT consists of groups.  Each group begins with one or more
+   pattern lines, followed by one or more name lines.  A pattern line
+   is
+
+     [!]KIND PATTERN
+
+   where KIND is one of:
+
+     x   exact name
+     g   globbing pattern (fnmatch with FNM_PATHNAME)
+     p   path-scoped globbing pattern, which can contain "**"
+     b   basic regular expression
+     e   extended regular expression
+     i   extended regular expression, ignoring case
+
+   and the exclamation mark negates the pattern.  A name line begins
+   with whitespace.  Empty lines and lines beginning with '#' are
+   ignored.
+
+   The patterns of a group are compiled into one automaton.  Each name
+   is matched against it and against each pattern separately, using
+   strcmp, fnmatch or regexec.  The group matches if any of its
+   positive patterns matches or any of its negated patterns doesn't.
+
+   For each pattern the automaton does not support, the program prints
+   "PATTERN: fallback" and matches the name using the library function
+   alone.  For each name it prints "NAME: match" or "NAME: no match".
+   If the two results differ, it prints "NAME: MISMATCH" and exits
+   with status 1. */
+
+#include "direvent.h"
+#include <fnmatch.h>
+
+char *progname;
+
+void *
+emalloc(size_t size)
+{
+	void *p = malloc(size);
+	if (!p) {
+		fprintf(stderr, "%s: not enough memory\n", progname);
+		exit(2);
+	}
+	return p;
+}
+
+void *
+ecalloc(size_t nmemb, size_t size)
+{
+	void *p = calloc(nmemb, size);
+	if (!p) {
+		fprintf(stderr, "%s: not enough memory\n", progname);
+		exit(2);
+	}
+	return p;
+}
+
+void *
+erealloc(void *ptr, size_t size)
+{
+	void *p = realloc(ptr, size);
+	if (!p) {
+		fprintf(stderr, "%s: not enough memory\n", progname);
+		exit(2);
+	}
+	return p;
+}
+
+struct pattern {
+	int kind;
+	int neg;
+	int fallback;       /* Not supported by the automaton */
+	char *str;
+	regex_t re;
+};
+
+#define MAXPAT 64
+struct pattern pattab[MAXPAT];
+int npat;
+struct dfa *dfa;
+int status;
+
+/* Match PATH against the path-scoped pattern PAT, one component at a
+   time, as direvent does for patterns the automaton cannot handle. */
+static int
+pathglob_match(char const *pat, char const *path)
+{
+	for (;;) {
+		char const *pe = strchr(pat, '/');
+		char const *se = strchr(path, '/');
+		size_t plen = pe ? pe - pat : strlen(pat);
+		size_t len = se ? se - path : strlen(path);
+		char *pbuf, *nbuf;
+		int rc;
+
+		if (plen == 2 && pat[0] == '*' && pat[1] == '*') {
+			if (!pe)
+				return 0;
+			for (;;) {
+				if (pathglob_match(pe + 1, path) == 0)
+					return 0;
+				if (!se)
+					return 1;
+				path = se + 1;
+				se = strchr(path, '/');
+			}
+		}
+		pbuf = strndup(pat, plen);
+		nbuf = strndup(path, len);
+		rc = fnmatch(pbuf, nbuf, FNM_PATHNAME);
+		free(pbuf);
+		free(nbuf);
+		if (rc)
+			return 1;
+		if (!pe || !se)
+			return (pe || se) ? 1 : 0;
+		pat = pe + 1;
+		path = se + 1;
+	}
+}
+
+static int
+libc_match(struct pattern *pat, char const *name)
+{
+	int rc;
+
+	switch (pat->kind) {
+	case 'x':
+		rc = strcmp(pat->str, name) != 0;
+		break;
+	case 'g':
+		rc = fnmatch(pat->str, name, FNM_PATHNAME) != 0;
+		break;
+	case 'p':
+		rc = pathglob_match(pat->str, name);
+		break;
+	default:
+		rc = regexec(&pat->re, name, 0, NULL, 0) != 0;
+	}
+	return pat->neg ? !rc : rc;
+}
+
+static void
+add_pattern(char *line)
+{
+	struct pattern *pat;
+	int rc, cflags = REG_NOSUB;
+
+	if (npat == MAXPAT) {
+		fprintf(stderr, "%s: too many patterns\n", progname);
+		exit(2);
+	}
+	pat = &pattab[npat];
+	pat->neg = *line == '!';
+	if (pat->neg)
+		line++;
+	pat->kind = *line++;
+	if (*line++ != ' ') {
+		fprintf(stderr, "%s: malformed pattern line\n", progname);
+		exit(2);
+	}
+	pat->str = strdup(line);
+
+	if (!dfa)
+		dfa = dfa_create();
+	switch (pat->kind) {
+	case 'x':
+		rc = dfa_add_exact(dfa, pat->str, pat->neg);
+		break;
+	case 'g':
+	case 'p':
+		rc = dfa_add_glob(dfa, pat->str, pat->neg, pat->kind == 'p');
+		break;
+	case 'i':
+		cflags |= REG_ICASE;
+		/* fall through */
+	case 'e':
+		cflags |= REG_EXTENDED;
+		/* fall through */
+	case 'b':
+		if (regcomp(&pat->re, pat->str, cflags)) {
+			fprintf(stderr, "%s: invalid regexp: %s\n",
+				progname, pat->str);
+			exit(2);
+		}
+		rc = dfa_add_regex(dfa, pat->str, cflags, pat->neg);
+		break;
+	default:
+		fprintf(stderr, "%s: unknown pattern kind: %c\n",
+			progname, pat->kind);
+		exit(2);
+	}
+	pat->fallback = rc != 0;
+	if (pat->fallback)
+		printf("%s: fallback\n", pat->str);
+	npat++;
+}
+
+static void
+match_name(char const *name)
+{
+	int i, dfa_rc = 1, libc_rc = 1, residue = 0;
+
+	for (i = 0; i < npat; i++) {
+		struct pattern *pat = &pattab[i];
+		if (libc_match(pat, name) == 0) {
+			libc_rc = 0;
+			if (pat->fallback)
+				residue = 1;
+		}
+	}
+	if (dfa_count(dfa))
+		dfa_rc = dfa_match(dfa, name);
+	if (residue)
+		dfa_rc = 0;
+	if (dfa_rc != libc_rc) {
+		printf("%s: MISMATCH\n", name);
+		status = 1;
+	} else
+		printf("%s: %s\n", name, dfa_rc == 0 ? "match" : "no match");
+}
+
+static void
+reset(void)
+{
+	int i;
+
+	for (i = 0; i < npat; i++) {
+		if (strchr("bei", pattab[i].kind))
+			regfree(&pattab[i].re);
+		free(pattab[i].str);
+	}
+	npat = 0;
+	dfa_free(dfa);
+	dfa = NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	char buf[1024];
+	int names = 0;
+
+	progname = argv[0];
+	while (fgets(buf, sizeof buf, stdin)) {
+		size_t len = strlen(buf);
+		char *p;
+
+		if (len > 0 && buf[len-1] == '\n')
+			buf[--len] = 0;
+		if (len == 0 || buf[0] == '#')
+			continue;
+		if (buf[0] == ' ' || buf[0] == '\t') {
+			if (npat == 0) {
+				fprintf(stderr, "%s: name outside of group\n",
+					progname);
+				exit(2);
+			}
+			for (p = buf; *p == ' ' || *p == '\t'; p++)
+				;
+			match_name(p);
+			names = 1;
+		} else {
+			if (names) {
+				reset();
+				names = 0;
+			}
+			add_pattern(buf);
+		}
+	}
+	reset();
+	return status;
+}
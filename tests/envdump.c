@@ -21,6 +21,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <fcntl.h>
 
 extern char **environ;
 char *progname;
@@ -171,6 +172,19 @@ read_pid_and_sig(char *arg, pid_t *pid, int *sig)
 	}
 }
 
+/* Highest descriptor number checked by -d */
+#define MAXFD 1024
+
+/* Mark in FDTAB the descriptors that are open */
+void
+getfds(char *fdtab)
+{
+	int i;
+
+	for (i = 0; i < MAXFD; i++)
+		fdtab[i] = fcntl(i, F_GETFD) != -1;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -184,22 +198,33 @@ main(int argc, char **argv)
 	char **itab = NULL;
 	pid_t pid = 0;
 	int sig = SIGHUP;
+	char *fdtab = NULL;
 	
 	progname = strrchr(argv[0], '/');
 	if (progname)
 		progname++;
 	else
 		progname = argv[0];
-	while ((i = getopt(argc, argv, "af:hi:k:s")) != EOF)
+	while ((i = getopt(argc, argv, "adf:hi:k:s")) != EOF)
 		switch (i) {
 		case 'a':
 			mode = "a";
 			break;
+		case 'd':
+			/* Check the descriptors before opening the output */
+			fdtab = malloc(MAXFD);
+			if (!fdtab) {
+				fprintf(stderr, "%s: not enough memory\n",
+					progname);
+				return 1;
+			}
+			getfds(fdtab);
+			break;
 		case 'f':
 			file = optarg;
 			break;
 		case 'h':
-			printf("usage: %s [-ahsx] [-f FILE] [-i INCLUDELIST] [-k [@]PID[:SIG]] [ARGS...]\n",
+			printf("usage: %s [-adhsx] [-f FILE] [-i INCLUDELIST] [-k [@]PID[:SIG]] [ARGS...]\n",
 			       progname);
 			return 0;
 		case 's':
@@ -235,6 +260,13 @@ main(int argc, char **argv)
 	for (i = 0; i < argc; i++)
 		fprintf(fp, "argv[%d]=%s\n", i, argv[i]);
 
+	if (fdtab) {
+		fprintf(fp, "# Descriptors\n");
+		for (i = 0; i < MAXFD; i++)
+			if (fdtab[i])
+				fprintf(fp, "%d\n", i);
+	}
+
 	if (sortenv) {
 		for (i = 0; environ[i]; i++);
 		qsort(environ, i, sizeof(environ[0]), compenv);
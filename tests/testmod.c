@@ -0,0 +1,87 @@
+/* testmod.c - a direvent module for the testsuite
+   This file is part of Direvent testsuite.
+   Copyright (C) 2013-2016 Sergey Poznyakoff
+
+   Direvent is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   Direvent is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with direvent. If not, see <http://www.gnu.org/licenses/>. */
+
+/* Usage: module testmod.so FILE [TAG]
+
+   Append a line "TAG EVENT DIR/FILE" to FILE for each event.  EVENT is
+   the name of the generic event. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "direvent-module.h"
+
+DIREVENT_MODULE_DECLARE;
+
+struct testmod {
+	FILE *fp;
+	const char *tag;
+};
+
+int
+direvent_module_init(int argc, char **argv, void **data)
+{
+	struct testmod *tm;
+
+	if (argc < 1 || argc > 2)
+		return 1;
+	tm = malloc(sizeof(*tm));
+	if (!tm)
+		return 1;
+	tm->fp = fopen(argv[0], "a");
+	if (!tm->fp) {
+		free(tm);
+		return 1;
+	}
+	setvbuf(tm->fp, NULL, _IOLBF, 0);
+	tm->tag = argc == 2 ? argv[1] : "testmod";
+	*data = tm;
+	return 0;
+}
+
+static const char *
+genev_name(int gen_mask)
+{
+	if (gen_mask & GENEV_CREATE)
+		return "create";
+	if (gen_mask & GENEV_WRITE)
+		return "write";
+	if (gen_mask & GENEV_ATTRIB)
+		return "attrib";
+	if (gen_mask & GENEV_DELETE)
+		return "delete";
+	return "other";
+}
+
+int
+direvent_module_run(void *data, int gen_mask, int sys_mask,
+		    const char *dir, const char *file)
+{
+	struct testmod *tm = data;
+
+	fprintf(tm->fp, "%s %s %s/%s\n", tm->tag, genev_name(gen_mask),
+		dir, file);
+	return 0;
+}
+
+void
+direvent_module_free(void *data)
+{
+	struct testmod *tm = data;
+
+	fclose(tm->fp);
+	free(tm);
+}